@@ -0,0 +1,205 @@
+//===------------------ CFGStructurizer.cpp ----------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the CFG structurizer of the OpenCL backend.
+//
+//===----------------------------------------------------------------------===//
+#include "CFGStructurizer.h"
+
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Instructions.h"
+
+namespace llvm_opencl {
+
+using namespace llvm;
+
+bool CFGStructurizer::isBackEdge(BasicBlock *From, BasicBlock *To) const {
+  return RPONumber.lookup(To) <= RPONumber.lookup(From);
+}
+
+bool CFGStructurizer::run() {
+  ReversePostOrderTraversal<Function *> RPOT(&F);
+  for (BasicBlock *BB : RPOT) {
+    unsigned N = RPONumber.size();
+    RPONumber[BB] = N;
+  }
+
+  // Every retreating edge must go to a loop header dominating its source,
+  // otherwise the function cannot be expressed without gotos into loops.
+  for (BasicBlock *BB : RPOT)
+    for (BasicBlock *Succ : successors(BB))
+      if (isBackEdge(BB, Succ) &&
+          (!DT.dominates(Succ, BB) || !LI.isLoopHeader(Succ)))
+        return false;
+
+  for (BasicBlock *BB : RPOT) {
+    if (BB == &F.getEntryBlock())
+      continue;
+
+    SmallPtrSet<BasicBlock *, 4> ForwardPreds;
+    for (BasicBlock *Pred : predecessors(BB))
+      if (RPONumber.count(Pred) && !isBackEdge(Pred, BB))
+        ForwardPreds.insert(Pred);
+
+    // A block leaving loops of its dominator is placed after the outermost
+    // of them.
+    BasicBlock *Parent = DT.getNode(BB)->getIDom()->getBlock();
+    Loop *Outer = nullptr;
+    for (Loop *L = LI.getLoopFor(Parent); L; L = L->getParentLoop())
+      if (!L->contains(BB))
+        Outer = L;
+    if (Outer)
+      Parent = Outer->getHeader();
+
+    if (Outer || ForwardPreds.size() > 1) {
+      Followers[Parent].push_back(BB);
+      FollowBlocks.insert(BB);
+    }
+  }
+
+  emitTree(&F.getEntryBlock(), Body);
+  assert(Context.empty());
+  return true;
+}
+
+// getFallthrough - Return the block reached by leaving the statement built
+// within the first End frames of the context.
+BasicBlock *CFGStructurizer::getFallthrough(size_t End) const {
+  while (End-- > 0)
+    if (Context[End].Kind == FollowFrame || Context[End].Kind == LoopFrame)
+      return Context[End].BB;
+  return nullptr;
+}
+
+StructuredNode::JumpKind CFGStructurizer::classifyJump(BasicBlock *To) {
+  if (getFallthrough(Context.size()) == To)
+    return StructuredNode::Fallthrough;
+
+  bool InSwitch = false;
+  for (size_t I = Context.size(); I-- > 0;) {
+    if (Context[I].Kind == SwitchFrame)
+      InSwitch = true;
+    if (Context[I].Kind != LoopFrame)
+      continue;
+    if (Context[I].BB == To) {
+      Context[I].Node->HasContinue = true;
+      return StructuredNode::Continue;
+    }
+    if (!InSwitch && getFallthrough(I) == To)
+      return StructuredNode::Break;
+    break;
+  }
+
+  GotoTargets.insert(To);
+  return StructuredNode::Goto;
+}
+
+void CFGStructurizer::emitTree(BasicBlock *BB, StructuredSeq &Seq) {
+  SmallVector<BasicBlock *, 4> Follow = Followers.lookup(BB);
+
+  if (!LI.isLoopHeader(BB)) {
+    emitWithin(BB, Follow, Seq);
+    return;
+  }
+
+  Loop *L = LI.getLoopFor(BB);
+  SmallVector<BasicBlock *, 4> Inside, Outside;
+  for (BasicBlock *Succ : Follow)
+    (L->contains(Succ) ? Inside : Outside).push_back(Succ);
+
+  for (auto I = Outside.rbegin(), E = Outside.rend(); I != E; ++I)
+    Context.push_back({FollowFrame, *I, nullptr});
+
+  auto LoopNode = std::make_unique<StructuredNode>(StructuredNode::Loop, BB);
+  LoopNode->Arms.emplace_back();
+  Context.push_back({LoopFrame, BB, LoopNode.get()});
+  emitWithin(BB, Inside, LoopNode->Arms[0]);
+  Context.pop_back();
+  Seq.push_back(std::move(LoopNode));
+
+  emitFollowers(Outside, Seq);
+}
+
+void CFGStructurizer::emitWithin(BasicBlock *BB, ArrayRef<BasicBlock *> Follow,
+                                 StructuredSeq &Seq) {
+  for (auto I = Follow.rbegin(), E = Follow.rend(); I != E; ++I)
+    Context.push_back({FollowFrame, *I, nullptr});
+  emitBlock(BB, Seq);
+  emitFollowers(Follow, Seq);
+}
+
+void CFGStructurizer::emitFollowers(ArrayRef<BasicBlock *> Follow,
+                                    StructuredSeq &Seq) {
+  for (BasicBlock *Succ : Follow) {
+    assert(Context.back().Kind == FollowFrame && Context.back().BB == Succ);
+    Context.pop_back();
+    emitTree(Succ, Seq);
+  }
+}
+
+void CFGStructurizer::emitBlock(BasicBlock *BB, StructuredSeq &Seq) {
+  Seq.push_back(std::make_unique<StructuredNode>(StructuredNode::Block, BB));
+
+  Instruction *Term = BB->getTerminator();
+  SmallVector<BasicBlock *, 4> Succs;
+  FrameKind Kind;
+  StructuredNode::NodeKind NodeKind;
+  if (BranchInst *BI = dyn_cast<BranchInst>(Term)) {
+    if (BI->isUnconditional() || BI->getSuccessor(0) == BI->getSuccessor(1)) {
+      emitEdge(BB, BI->getSuccessor(0), Seq);
+      return;
+    }
+    Succs.push_back(BI->getSuccessor(0));
+    Succs.push_back(BI->getSuccessor(1));
+    Kind = IfFrame;
+    NodeKind = StructuredNode::If;
+  } else if (SwitchInst *SI = dyn_cast<SwitchInst>(Term)) {
+    // Cases sharing a successor share an arm, the default comes last.
+    for (auto Case : SI->cases())
+      if (!is_contained(Succs, Case.getCaseSuccessor()))
+        Succs.push_back(Case.getCaseSuccessor());
+    if (!is_contained(Succs, SI->getDefaultDest()))
+      Succs.push_back(SI->getDefaultDest());
+    if (Succs.size() == 1) {
+      emitEdge(BB, Succs[0], Seq);
+      return;
+    }
+    Kind = SwitchFrame;
+    NodeKind = StructuredNode::Switch;
+  } else {
+    Seq.push_back(
+        std::make_unique<StructuredNode>(StructuredNode::Terminator, BB));
+    return;
+  }
+
+  auto Node = std::make_unique<StructuredNode>(NodeKind, BB);
+  Context.push_back({Kind, BB, Node.get()});
+  for (BasicBlock *Succ : Succs) {
+    Node->Succs.push_back(Succ);
+    Node->Arms.emplace_back();
+    emitEdge(BB, Succ, Node->Arms.back());
+  }
+  Context.pop_back();
+  Seq.push_back(std::move(Node));
+}
+
+void CFGStructurizer::emitEdge(BasicBlock *From, BasicBlock *To,
+                               StructuredSeq &Seq) {
+  auto Edge = std::make_unique<StructuredNode>(StructuredNode::Edge, From);
+  Edge->Target = To;
+  bool Nested = !isBackEdge(From, To) && !FollowBlocks.count(To);
+  if (!Nested)
+    Edge->Jump = classifyJump(To);
+  Seq.push_back(std::move(Edge));
+  if (Nested)
+    emitTree(To, Seq);
+}
+
+} // namespace llvm_opencl
@@ -0,0 +1,124 @@
+//===------------------ CFGStructurizer.h ------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares the CFG structurizer which turns the basic blocks of a
+// reducible function into a tree of nested if/switch/loop statements, so the
+// OpenCL backend can print structured C instead of a goto per block.
+//
+//===----------------------------------------------------------------------===//
+#ifndef CFGSTRUCTURIZER_H
+#define CFGSTRUCTURIZER_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+
+#include <memory>
+#include <vector>
+
+namespace llvm_opencl {
+
+struct StructuredNode;
+using StructuredSeq = std::vector<std::unique_ptr<StructuredNode>>;
+
+/// StructuredNode - One statement of a structured function body.
+struct StructuredNode {
+  enum NodeKind {
+    Block,      // Non-terminator instructions of BB
+    Edge,       // PHI copies for BB -> Target followed by the jump, if any
+    If,         // Conditional branch of BB, Arms = {true, false}
+    Switch,     // Switch of BB, one arm per distinct successor
+    Loop,       // Endless loop headed by BB, Arms = {body}
+    Terminator, // Any other terminator of BB (return, unreachable)
+  };
+
+  /// How an Edge reaches its target.
+  enum JumpKind {
+    Inline,      // The target is emitted right after the edge
+    Fallthrough, // Control reaches the target by leaving the construct
+    Continue,
+    Break,
+    Goto,
+  };
+
+  NodeKind Kind;
+  llvm::BasicBlock *BB;
+  llvm::BasicBlock *Target = nullptr;
+  JumpKind Jump = Inline;
+  /// Loop: some edge inside the body continues this loop explicitly.
+  bool HasContinue = false;
+  /// If/Switch: the successor each arm starts with.
+  llvm::SmallVector<llvm::BasicBlock *, 2> Succs;
+  std::vector<StructuredSeq> Arms;
+
+  StructuredNode(NodeKind Kind, llvm::BasicBlock *BB) : Kind(Kind), BB(BB) {}
+};
+
+/// CFGStructurizer - Places every block of a function at the position of its
+/// immediate dominator. Blocks with several forward predecessors and loop
+/// exits are placed after the construct of their dominator, everything else
+/// is emitted inline. Jumps that cannot be expressed as fallthrough, break or
+/// continue become gotos to labelled blocks.
+class CFGStructurizer {
+  llvm::Function &F;
+  llvm::DominatorTree &DT;
+  llvm::LoopInfo &LI;
+
+  llvm::DenseMap<llvm::BasicBlock *, unsigned> RPONumber;
+  /// Blocks emitted after the construct of the key block, in RPO order.
+  llvm::DenseMap<llvm::BasicBlock *, llvm::SmallVector<llvm::BasicBlock *, 4>>
+      Followers;
+  llvm::SmallPtrSet<llvm::BasicBlock *, 16> FollowBlocks;
+  llvm::SmallPtrSet<llvm::BasicBlock *, 8> GotoTargets;
+
+  enum FrameKind { IfFrame, SwitchFrame, LoopFrame, FollowFrame };
+  struct Frame {
+    FrameKind Kind;
+    llvm::BasicBlock *BB;
+    StructuredNode *Node;
+  };
+  /// Constructs enclosing the statement being built, innermost last.
+  std::vector<Frame> Context;
+
+  StructuredSeq Body;
+
+  bool isBackEdge(llvm::BasicBlock *From, llvm::BasicBlock *To) const;
+  llvm::BasicBlock *getFallthrough(size_t End) const;
+  StructuredNode::JumpKind classifyJump(llvm::BasicBlock *To);
+
+  void emitTree(llvm::BasicBlock *BB, StructuredSeq &Seq);
+  void emitWithin(llvm::BasicBlock *BB,
+                  llvm::ArrayRef<llvm::BasicBlock *> Follow,
+                  StructuredSeq &Seq);
+  void emitFollowers(llvm::ArrayRef<llvm::BasicBlock *> Follow,
+                     StructuredSeq &Seq);
+  void emitBlock(llvm::BasicBlock *BB, StructuredSeq &Seq);
+  void emitEdge(llvm::BasicBlock *From, llvm::BasicBlock *To,
+                StructuredSeq &Seq);
+
+public:
+  CFGStructurizer(llvm::Function &F, llvm::DominatorTree &DT,
+                  llvm::LoopInfo &LI)
+      : F(F), DT(DT), LI(LI) {}
+
+  /// Builds the statement tree. Returns false if the CFG is irreducible.
+  bool run();
+
+  StructuredSeq &getBody() { return Body; }
+  bool needsLabel(llvm::BasicBlock *BB) const {
+    return GotoTargets.count(BB) != 0;
+  }
+};
+
+} // namespace llvm_opencl
+
+#endif // CFGSTRUCTURIZER_H
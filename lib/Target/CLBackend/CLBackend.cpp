@@ -14,15 +14,27 @@
 
 
 #include "CLBackend.h"
+#include "CLTranslate.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/BasicAliasAnalysis.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/Analysis/ValueTracking.h"
 #include "llvm/CodeGen/TargetLowering.h"
 #include "llvm/IR/InstIterator.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/IR/Operator.h"
 #include "llvm/IR/PatternMatch.h"
+#include "llvm/IR/TypeFinder.h"
 #include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/Host.h"
 #include "llvm/Support/MathExtras.h"
+#include "llvm/Support/ScopedPrinter.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/Signals.h"
 
@@ -30,10 +42,11 @@
 #include "StringTools.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cstdio>
+#include <thread>
 
 #include <iostream>
-#include <sstream>
 
 
 namespace llvm_opencl {
@@ -54,6 +67,69 @@ enum UnaryOps {
   BinaryNot,
 };
 
+static cl::opt<bool> NativeOperators(
+    "cl-native-operators", cl::init(true),
+    cl::desc("Print arithmetic as C infix operators instead of llvm_<op> "
+             "helpers where LLVM and OpenCL semantics agree"));
+
+static cl::opt<bool> StructuredControlFlow(
+    "cl-structured-cfg", cl::init(true),
+    cl::desc("Print reducible control flow as nested if/switch/loop "
+             "statements instead of a goto per basic block"));
+
+static cl::opt<bool> ExplicitAtomics(
+    "cl-explicit-atomics", cl::init(false),
+    cl::desc("Print atomics as OpenCL 2.0 atomic_*_explicit functions with "
+             "memory order and scope instead of OpenCL 1.2 atomic_* "
+             "functions surrounded by fences"));
+
+static cl::opt<std::string> FunctionCacheDir(
+    "cl-function-cache", cl::value_desc("directory"),
+    cl::desc("Keep the printed functions in this directory and reuse those "
+             "whose IR and dependencies did not change"));
+
+static cl::opt<unsigned> EmitThreads(
+    "cl-emit-threads", cl::init(1),
+    cl::desc("Print functions on this many threads, 0 for one per hardware "
+             "thread. The output does not depend on the number of threads"));
+
+// getOperatorToken - Return the C operator spelling of a binary opcode, or
+// nullptr if there is none.
+static const char *getOperatorToken(unsigned Opcode) {
+  switch (Opcode) {
+  case Instruction::Add:
+  case Instruction::FAdd:
+    return "+";
+  case Instruction::Sub:
+  case Instruction::FSub:
+    return "-";
+  case Instruction::Mul:
+  case Instruction::FMul:
+    return "*";
+  case Instruction::URem:
+  case Instruction::SRem:
+  case Instruction::FRem:
+    return "%";
+  case Instruction::UDiv:
+  case Instruction::SDiv:
+  case Instruction::FDiv:
+    return "/";
+  case Instruction::And:
+    return "&";
+  case Instruction::Or:
+    return "|";
+  case Instruction::Xor:
+    return "^";
+  case Instruction::Shl:
+    return "<<";
+  case Instruction::LShr:
+  case Instruction::AShr:
+    return ">>";
+  default:
+    return nullptr;
+  }
+}
+
 
 #define cwriter_assert(expr)                                                   \
   if (!(expr)) {                                                               \
@@ -82,8 +158,32 @@ bool CWriter::isEmptyType(Type *Ty) const { return llvm_opencl::isEmptyType(Ty);
 bool CWriter::isAddressExposed(Value *V) const {
   if (Argument *A = dyn_cast<Argument>(V))
     return ByValParams.count(A) > 0;
+  else if (GlobalVariable *GV = dyn_cast<GlobalVariable>(V))
+    // Outside of kernels __local variables are pointer parameters.
+    return GV->getAddressSpace() != 3 || InKernel;
   else
-    return isa<GlobalVariable>(V) || isDirectAlloca(V);
+    return isDirectAlloca(V);
+}
+
+// isRematerializable - Return true if I is a single cheap operation on
+// arguments and constants.
+static bool isRematerializable(Instruction &I) {
+  switch (I.getOpcode()) {
+  case Instruction::UDiv:
+  case Instruction::SDiv:
+  case Instruction::URem:
+  case Instruction::SRem:
+  case Instruction::FDiv:
+  case Instruction::FRem:
+    return false;
+  default:
+    break;
+  }
+  if (!isa<BinaryOperator>(I) && !isa<CastInst>(I) &&
+      !isa<GetElementPtrInst>(I))
+    return false;
+  return all_of(I.operands(),
+                [](Value *V) { return isa<Constant>(V) || isa<Argument>(V); });
 }
 
 // isInlinableInst - Attempt to inline instructions into their uses to build
@@ -99,18 +199,69 @@ bool CWriter::isInlinableInst(Instruction &I) const {
   if (isa<CmpInst>(I))
     return true;
 
+  // Loads are only inlined if nothing in between may write the memory, see
+  // collectInlinableLoads.
+  if (isa<LoadInst>(I))
+    return InlinableLoads.count(&I) > 0;
+
+  if (isEmptyType(I.getType()))
+    return false;
+
+  // Cheap expressions of arguments and constants are recomputed at each use
+  // instead of being kept in a variable: their operands never change.
+  if (isRematerializable(I))
+    return true;
+
   // Must be an expression, must be used exactly once.  If it is dead, we
   // emit it inline where it would go.
-  if (isEmptyType(I.getType()) || !I.hasOneUse() || I.isTerminator() ||
-      isa<CallInst>(I) || isa<PHINode>(I) || isa<LoadInst>(I) ||
-      isa<VAArgInst>(I) || isa<InsertElementInst>(I) || isa<InsertValueInst>(I))
-    // Don't inline a load across a store or other bad things!
+  if (!I.hasOneUse() || I.isTerminator() || isa<CallInst>(I) ||
+      isa<PHINode>(I) || isa<VAArgInst>(I) || isa<InsertElementInst>(I) ||
+      isa<InsertValueInst>(I) || I.isAtomic())
     return false;
 
   // Only inline instruction if its use is in the same BB as the inst.
   return I.getParent() == cast<Instruction>(I.user_back())->getParent();
 }
 
+// collectInlinableLoads - Find the loads which can be folded into the
+// statement using them. The statement must be in the same block and reached
+// through single-use inlined expressions, and no instruction in between may
+// write the loaded memory. Blocks are scanned backwards, so loads feeding
+// other loads see the decision for their user first.
+void CWriter::collectInlinableLoads(Function &F) {
+  for (BasicBlock &BB : F) {
+    for (auto II = BB.rbegin(), E = BB.rend(); II != E; ++II) {
+      LoadInst *Load = dyn_cast<LoadInst>(&*II);
+      if (!Load || !Load->isSimple() || !Load->hasOneUse() ||
+          isEmptyType(Load->getType()))
+        continue;
+
+      Instruction *Root = Load;
+      do {
+        Root = cast<Instruction>(Root->user_back());
+      } while (Root->getParent() == &BB && !isa<PHINode>(Root) &&
+               isInlinableInst(*Root) && !isDirectAlloca(Root) &&
+               Root->hasOneUse());
+      if (Root->getParent() != &BB ||
+          (isInlinableInst(*Root) && !isa<PHINode>(Root)))
+        continue;
+      // PHI copies are printed after the terminator.
+      if (isa<PHINode>(Root))
+        Root = BB.getTerminator();
+
+      MemoryLocation Loc = MemoryLocation::get(Load);
+      bool Clobbered = false;
+      for (auto It = std::next(Load->getIterator()); &*It != Root; ++It)
+        if (It->mayWriteToMemory() && isModSet(AA->getModRefInfo(&*It, Loc))) {
+          Clobbered = true;
+          break;
+        }
+      if (!Clobbered)
+        InlinableLoads.insert(Load);
+    }
+  }
+}
+
 // isDirectAlloca - Define fixed sized allocas in the entry block as direct
 // variables which are accessed with the & operator.  This causes GCC to
 // generate significantly better code than to emit alloca calls directly.
@@ -125,31 +276,206 @@ AllocaInst *CWriter::isDirectAlloca(Value *V) const {
   return AI;
 }
 
+void CWriter::getAnalysisUsage(AnalysisUsage &AU) const {
+  // The analyses are computed in printFunctionWithAnalyses, only for the
+  // functions which are printed.
+  AU.setPreservesCFG();
+}
+
 bool CWriter::runOnFunction(Function &F) {
   // Do not codegen any 'available_externally' functions at all, they have
   // definitions outside the translation unit.
   if (F.hasAvailableExternallyLinkage())
     return false;
 
-  LI = &getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+  // Functions not reachable from any kernel are never printed, so they are
+  // neither lowered nor analysed.
+  if (UsedFunctions.find(&F) == UsedFunctions.end())
+    return false;
+
+  // Nothing is printed after an error.
+  if (hasFailed())
+    return false;
 
   // Get rid of intrinsics we can't handle.
   bool Modified = lowerIntrinsics(F);
 
-  if (UsedFunctions.find(&F) != UsedFunctions.end()) {
-    // Function is used
+  // With several threads the functions are printed in doFinalization, once
+  // every one of them is lowered.
+  if (EmitThreads != 1)
+    return Modified;
+
+  printFunctionWithAnalyses(F);
+  flushFunctionBody();
+  // Later passes may free the values of F and reuse their addresses.
+  ValueNames.clear();
+  reportError();
+
+  return Modified;
+}
+
+// printFunctionWithAnalyses - Compute the analyses printFunction uses for F
+// and print it. The alias analysis is the basic one, which is all the
+// pipeline of the backend provides.
+void CWriter::printFunctionWithAnalyses(Function &F) {
+  // A function described the same way as one printed before is copied from
+  // the cache together with the declarations it needs.
+  std::string Key, Description;
+  HeaderDecls ModuleDecls;
+  unsigned NumFunctionTypes = UnnamedFunctionIDs.size();
+  size_t BodyStart = 0;
+  bool Cached = FnCache && describeFunction(F, Description);
+  if (Cached) {
+    Key = FunctionCache::getKey(Description);
+    std::string Entry, Body;
+    HeaderDecls FunctionDecls;
+    if (FnCache->read(Key, Entry)) {
+      bool Parsed;
+      {
+        // Restoring the declarations may create types.
+        auto Lock = lockShared();
+        Parsed = FnCache->parse(Entry, Body, FunctionDecls);
+      }
+      if (Parsed) {
+        Out << Body;
+        Decls.merge(FunctionDecls);
+        return;
+      }
+    }
+    // Collect the declarations of this function alone. A cached spelling of
+    // a type would skip the typedef the type needs, so they are forgotten.
+    std::swap(ModuleDecls, Decls);
+    TypeNames.clear();
+    Out.flush();
+    BodyStart = _Out.size();
+  }
+
+  {
+    // The analyses keep value handles, which are registered in the
+    // LLVMContext, so they are destroyed under the lock. It is declared
+    // before them to be released after they are gone.
+    std::unique_lock<std::mutex> Lock;
+    DominatorTree FDT(F);
+    LoopInfo FLI(FDT);
+    AssumptionCache AC(F);
+    TargetLibraryInfo TLI(*TLII);
+    ScalarEvolution FSE(F, TLI, AC, FDT, FLI);
+    BasicAAResult BAR(*TD, F, TLI, AC, &FDT);
+    AAResults FAA(TLI);
+    FAA.addAAResult(BAR);
+
+    LI = &FLI;
+    DT = &FDT;
+    SE = &FSE;
+    AA = &FAA;
     printFunction(F);
+    LI = nullptr;
+    DT = nullptr;
+    SE = nullptr;
+    AA = nullptr;
+    Lock = lockShared();
+  }
+
+  if (Cached) {
+    Out.flush();
+    // Function pointer types are numbered in the order they are printed.
+    if (UnnamedFunctionIDs.size() == NumFunctionTypes && !hasFailed())
+      FnCache->store(Key, StringRef(_Out).substr(BodyStart), Decls);
+    Decls.merge(ModuleDecls);
   }
+}
+
+static void collectTypes(Type *Ty, SetVector<Type *> &Types) {
+  if (!Types.insert(Ty))
+    return;
+  for (Type *SubTy : Ty->subtypes())
+    collectTypes(SubTy, Types);
+}
 
-  LI = nullptr;
+static void collectOperandTypes(Value *V, SetVector<Type *> &Types) {
+  collectTypes(V->getType(), Types);
+  if (GEPOperator *GEP = dyn_cast<GEPOperator>(V))
+    collectTypes(GEP->getSourceElementType(), Types);
+  if (ConstantExpr *CE = dyn_cast<ConstantExpr>(V))
+    for (Value *Op : CE->operands())
+      collectOperandTypes(Op, Types);
+}
 
-  return Modified;
+// describeFunction - Describe everything the body of F is printed from: the
+// options, the IR of F, the structs it uses, the source lines, the callees and
+// the __local variables. Returns false if some of it may depend on the
+// functions printed before.
+bool CWriter::describeFunction(Function &F, std::string &Description) {
+  raw_string_ostream OS(Description);
+  OS << getBackendVersion() << '\n';
+  OS << "options " << NativeOperators << StructuredControlFlow
+     << ExplicitAtomics << '\n';
+  OS << TheModule->getTargetTriple() << '\n'
+     << TD->getStringRepresentation() << '\n';
+  OS << "globals " << GlobalValueNumbers.size() << '\n';
+
+  if (!SlotTracker)
+    SlotTracker.reset(new ModuleSlotTracker(TheModule));
+  static_cast<Value &>(F).print(OS, *SlotTracker);
+
+  SetVector<Type *> Types;
+  collectTypes(F.getFunctionType(), Types);
+  for (Instruction &I : instructions(F)) {
+    collectOperandTypes(&I, Types);
+    for (Value *Op : I.operands())
+      collectOperandTypes(Op, Types);
+    if (AllocaInst *AI = dyn_cast<AllocaInst>(&I))
+      collectTypes(AI->getAllocatedType(), Types);
+    if (const DILocation *Loc = I.getDebugLoc())
+      OS << "line " << Loc->getLine() << ' ' << Loc->getDirectory() << '/'
+         << Loc->getFilename() << '\n';
+    // Whether loads are moved past a call depends on the attributes of the
+    // call and of the callee, which the IR of F only refers to by number.
+    if (CallInst *CI = dyn_cast<CallInst>(&I)) {
+      AttributeList Attrs = CI->getAttributes();
+      OS << "call [" << Attrs.getAsString(AttributeList::FunctionIndex)
+         << "] [" << Attrs.getAsString(AttributeList::ReturnIndex) << ']';
+      for (unsigned i = 0, e = CI->arg_size(); i != e; ++i)
+        OS << " [" << Attrs.getAsString(AttributeList::FirstArgIndex + i)
+           << ']';
+      OS << '\n';
+      if (Function *Callee = CI->getCalledFunction()) {
+        OS << "callee " << Callee->getName() << ' '
+           << Callee->isDeclaration() << " ["
+           << Callee->getAttributes().getAsString(AttributeList::FunctionIndex)
+           << ']';
+        for (GlobalVariable *GV : getLocalParams(Callee))
+          OS << ' ' << GV->getName();
+        OS << '\n';
+      }
+    }
+  }
+  if (F.getCallingConv() == CallingConv::SPIR_KERNEL)
+    for (GlobalVariable *GV : LocalVars[&F]) {
+      OS << "local " << GV->getName() << ' ' << GV->getAlignment() << '\n';
+      collectTypes(GV->getValueType(), Types);
+    }
+
+  bool Encoded = true;
+  for (Type *Ty : Types)
+    if (StructType *ST = dyn_cast<StructType>(Ty)) {
+      OS << "struct ";
+      Encoded &= FnCache->encodeType(ST, OS);
+      OS << ' ' << ST->isPacked();
+      for (Type *Elt : ST->elements()) {
+        OS << ' ';
+        Encoded &= FnCache->encodeType(Elt, OS);
+      }
+      OS << '\n';
+    }
+  OS.flush();
+  return Encoded;
 }
 
 raw_ostream &CWriter::printTypeString(raw_ostream &Out, Type *Ty) {
   if (StructType *ST = dyn_cast<StructType>(Ty)) {
     cwriter_assert(!isEmptyType(ST));
-    TypedefDeclTypes.insert(Ty);
+    Decls.TypedefDeclTypes.insert(Ty);
 
     if (!ST->isLiteral() && !ST->getName().empty())
       return Out << CBEMangle(ST->getName());
@@ -178,7 +504,7 @@ raw_ostream &CWriter::printTypeString(raw_ostream &Out, Type *Ty) {
     return Out << "f64";
 
   case Type::VectorTyID: {
-    TypedefDeclTypes.insert(Ty);
+    Decls.TypedefDeclTypes.insert(Ty);
     VectorType *VTy = cast<VectorType>(Ty);
     cwriter_assert(VTy->getNumElements() != 0);
     printTypeString(Out, VTy->getElementType());
@@ -186,7 +512,7 @@ raw_ostream &CWriter::printTypeString(raw_ostream &Out, Type *Ty) {
   }
 
   case Type::ArrayTyID: {
-    TypedefDeclTypes.insert(Ty);
+    Decls.TypedefDeclTypes.insert(Ty);
     ArrayType *ATy = cast<ArrayType>(Ty);
     cwriter_assert(ATy->getNumElements() != 0);
     printTypeString(Out, ATy->getElementType());
@@ -201,8 +527,8 @@ raw_ostream &CWriter::printTypeString(raw_ostream &Out, Type *Ty) {
     if (FnTy->isFunctionTy()) {
       errorWithMessage("OpenCL forbids usage of function pointers");
     }
-    errs() << "Unknown primitive type: " << *Ty << "\n";
-    errorWithMessage("unknown primitive type");
+    errorWithMessage("unknown primitive type: " + to_string(*Ty));
+    return Out;
   }
 }
 
@@ -239,8 +565,7 @@ std::string CWriter::getVectorName(VectorType *VT, bool Aligned, bool isSigned)
 
   uint64_t n = VT->getNumElements();
   if (n != 2 && n != 3 && n != 4 && n != 8 && n != 16) {
-    errs() << "Vector of length " << n << " not supported\n";
-    errorWithMessage("Unsupported vector length");
+    errorWithMessage("Unsupported vector length " + utostr(n));
   }
 
   printTypeName(VectorInnards, VT->getElementType(), isSigned);
@@ -248,8 +573,7 @@ std::string CWriter::getVectorName(VectorType *VT, bool Aligned, bool isSigned)
   if (t != "char" && t != "uchar" && t != "short" && t != "ushort" &&
       t != "int" && t != "uint" && t != "long" && t != "ulong" &&
       t != "float" && t != "double") {
-    errs() << "Vector of type " << t << " not supported\n";
-    errorWithMessage("Unsupported vector type");
+    errorWithMessage("Unsupported vector type " + t);
   }
   
   return t + utostr(n);
@@ -310,8 +634,8 @@ std::string CWriter::getCmpPredicateName(CmpInst::Predicate P) const {
   case ICmpInst::ICMP_SGT:
     return "sgt";
   default:
-    errs() << "Invalid icmp predicate: " << P << "\n";
-    errorWithMessage("Invalid icmp predicate");
+    errorWithMessage("Invalid icmp predicate " + utostr(P));
+    return "";
   }
 }
 
@@ -364,8 +688,8 @@ std::string CWriter::getCmpImplem(
     return "1";
 
   default:
-    errs() << "Invalid fcmp predicate: " << P << "\n";
-    errorWithMessage("Invalid fcmp predicate!");
+    errorWithMessage("Invalid fcmp predicate " + utostr(P));
+    return "";
   }
 }
 
@@ -390,8 +714,8 @@ raw_ostream &CWriter::printSimpleType(raw_ostream &Out, Type *Ty,
       return Out << (isSigned ? "int" : "uint");
     else if (NumBits <= 64)
       return Out << (isSigned ? "long" : "ulong");
-    else
-      errorWithMessage("Bit widths > 64 not implemented yet");
+    errorWithMessage("Bit widths > 64 not implemented yet");
+    return Out;
   }
   case Type::FloatTyID:
     return Out << "float";
@@ -399,8 +723,8 @@ raw_ostream &CWriter::printSimpleType(raw_ostream &Out, Type *Ty,
     return Out << "double";
 
   default:
-    errs() << "Unknown primitive type: " << *Ty;
-    errorWithMessage("unknown primitive type");
+    errorWithMessage("unknown primitive type: " + to_string(*Ty));
+    return Out;
   }
 }
 
@@ -443,9 +767,9 @@ unsigned int CWriter::getNextPowerOf2(unsigned int width) {
     return 32;
   } else if (width <= 64) {
     return 64;
-  } else {
-    errorWithMessage("Integers of size larger than 64 is not supported");
   }
+  errorWithMessage("Integers of size larger than 64 is not supported");
+  return 64;
 }
 
 uint64_t CWriter::getIntPadded(uint64_t value, unsigned int width) {
@@ -532,11 +856,58 @@ void CWriter::printUnpadded(
   printUnpadded(Out, Ty, [&]() { Out << inner; }, cond);
 }
 
+// printAddressSpace - Print the qualifier of address space AS with a leading
+// space, or nothing for the generic address space.
+raw_ostream &CWriter::printAddressSpace(raw_ostream &Out, unsigned AS) {
+  switch (AS) {
+    case 0:
+      Out << " __private";
+      break;
+    case 1:
+      Out << " __global";
+      break;
+    case 2:
+      Out << " __constant";
+      break;
+    case 3:
+      Out << " __local";
+      break;
+    case 4:
+      Out << ""; // OpenCL 2.x generic address space
+      break;
+    default:
+      errorWithMessage("Encountered Invalid Address Space " + utostr(AS));
+      break;
+  }
+  return Out;
+}
+
 // Pass the Type* and the variable name and this prints out the variable
 // declaration.
 raw_ostream &
 CWriter::printTypeName(raw_ostream &Out, Type *Ty, bool isSigned,
                        std::pair<AttributeList, CallingConv::ID> PAL) {
+  // Only the names of function types depend on the attributes.
+  if (Ty->isFunctionTy())
+    return spellTypeName(Out, Ty, isSigned, PAL);
+
+  PointerIntPair<Type *, 1, bool> Key(Ty, isSigned);
+  auto It = TypeNames.find(Key);
+  if (It != TypeNames.end())
+    return Out << It->second;
+
+  std::string Name;
+  raw_string_ostream NameOut(Name);
+  spellTypeName(NameOut, Ty, isSigned, PAL);
+  StringRef Saved = NameSaver.save(NameOut.str());
+  TypeNames[Key] = Saved;
+  return Out << Saved;
+}
+
+// spellTypeName - Print the C name of Ty, printTypeName caches the result.
+raw_ostream &
+CWriter::spellTypeName(raw_ostream &Out, Type *Ty, bool isSigned,
+                       std::pair<AttributeList, CallingConv::ID> PAL) {
   if (Ty->isSingleValueType() || Ty->isVoidTy()) {
     if (!Ty->isPointerTy() && !Ty->isVectorTy())
       return printSimpleType(Out, Ty, isSigned);
@@ -551,51 +922,36 @@ CWriter::printTypeName(raw_ostream &Out, Type *Ty, bool isSigned,
     return Out << getFunctionName(FTy, PAL);
   }
   case Type::StructTyID: {
-    TypedefDeclTypes.insert(Ty);
+    Decls.TypedefDeclTypes.insert(Ty);
     return Out << getStructName(cast<StructType>(Ty));
   }
 
   case Type::PointerTyID: {
     Type *ElTy = Ty->getPointerElementType();
+    // OpenCL opaque types like event_t are pointers to `opencl.*` structs
+    if (StructType *STy = dyn_cast<StructType>(ElTy))
+      if (STy->isOpaque() && STy->hasName() &&
+          STy->getName().startswith("opencl."))
+        return Out << STy->getName().substr(strlen("opencl."));
     printTypeName(Out, ElTy);
-    switch (Ty->getPointerAddressSpace()) {
-      case 0:
-        Out << " __private";
-        break;
-      case 1:
-        Out << " __global";
-        break;
-      case 2:
-        Out << " __constant";
-        break;
-      case 3:
-        Out << " __local";
-        break;
-      case 4:
-        Out << ""; // OpenCL 2.x generic address space
-        break;
-      default:
-      errs() << "Invalid address space " << Ty->getPointerAddressSpace() << "\n";
-      errorWithMessage("Encountered Invalid Address Space");
-      break;
-    }
+    printAddressSpace(Out, Ty->getPointerAddressSpace());
     Out << "*";
     return Out;
   }
 
   case Type::ArrayTyID: {
-    TypedefDeclTypes.insert(Ty);
+    Decls.TypedefDeclTypes.insert(Ty);
     return Out << getArrayName(cast<ArrayType>(Ty));
   }
 
   case Type::VectorTyID: {
-    TypedefDeclTypes.insert(Ty);
+    Decls.TypedefDeclTypes.insert(Ty);
     return Out << getVectorName(cast<VectorType>(Ty), true, isSigned);
   }
 
   default:
-    errs() << "Unexpected type: " << *Ty << "\n";
-    errorWithMessage("unexpected type");
+    errorWithMessage("unexpected type: " + to_string(*Ty));
+    return Out;
   }
 }
 
@@ -635,7 +991,8 @@ raw_ostream &
 CWriter::printFunctionProto(raw_ostream &Out, FunctionType *Ty,
                      std::pair<AttributeList, CallingConv::ID> Attrs,
                      const std::string &Name,
-                     iterator_range<Function::arg_iterator> *ArgList) {
+                     iterator_range<Function::arg_iterator> *ArgList,
+                     ArrayRef<GlobalVariable *> LocalParams) {
   // Cache
   int Idx = 0;
   Function::arg_iterator ArgName = Function::arg_iterator();
@@ -652,8 +1009,8 @@ CWriter::printFunctionProto(raw_ostream &Out, FunctionType *Ty,
         ++ArgName;
       }
     }
-    return GetValueName(ArgName);
-  });
+    return GetValueName(ArgName).str();
+  }, LocalParams);
 }
 
 raw_ostream &
@@ -661,7 +1018,8 @@ CWriter::printFunctionProto(raw_ostream &Out, FunctionType *FTy,
                             std::pair<AttributeList, CallingConv::ID> Attrs,
                             const std::string &Name,
                             iterator_range<Function::arg_iterator> *ArgList,
-                            std::function<std::string(int)> GetArgName) {
+                            std::function<std::string(int)> GetArgName,
+                            ArrayRef<GlobalVariable *> LocalParams) {
   AttributeList &PAL = Attrs.first;
 
   // Should this function actually return a struct by-value?
@@ -685,8 +1043,8 @@ CWriter::printFunctionProto(raw_ostream &Out, FunctionType *FTy,
     Out << " __kernel";
     break;
   default:
-    errs() << "Unhandled calling convention " << Attrs.second << "\n";
-    errorWithMessage("Encountered Unhandled Calling Convention");
+    errorWithMessage("Encountered Unhandled Calling Convention " +
+                     utostr(Attrs.second));
     break;
   }
   Out << ' ' << Name << '(';
@@ -723,6 +1081,16 @@ CWriter::printFunctionProto(raw_ostream &Out, FunctionType *FTy,
     ++Idx;
   }
 
+  // __local variables of the calling kernel
+  for (GlobalVariable *GV : LocalParams) {
+    if (PrintedArg)
+      Out << ", ";
+    printTypeName(Out, GV->getType());
+    PrintedArg = true;
+    if (ArgList)
+      Out << ' ' << GetValueName(GV);
+  }
+
   if (FTy->isVarArg()) {
     if (!PrintedArg) {
       Out << "int"; // dummy argument for empty vaarg functs
@@ -775,10 +1143,10 @@ void CWriter::printConstantVector(ConstantVector *CP,
 
 void CWriter::printConstantDataSequential(ConstantDataSequential *CDS,
                                           enum OperandContext Context) {
-  printConstant(CDS->getElementAsConstant(0), Context);
+  printConstant(getElementAsConstant(CDS, 0), Context);
   for (unsigned i = 1, e = CDS->getNumElements(); i != e; ++i) {
     Out << ", ";
-    printConstant(CDS->getElementAsConstant(i), Context);
+    printConstant(getElementAsConstant(CDS, i), Context);
   }
 }
 
@@ -855,8 +1223,8 @@ raw_ostream &CWriter::printVectorComponent(raw_ostream &Out, uint64_t i) {
   if (i < 16) {
     Out << "s" << comps[i];
   } else {
-    errs() << "Vector component index is "  << i << " but it cannot be greater than 15\n";
-    errorWithMessage("Vector component error");
+    errorWithMessage("Vector component index is " + utostr(i) +
+                     " but it cannot be greater than 15");
   }
   return Out;
 }
@@ -867,16 +1235,16 @@ raw_ostream &CWriter::printVectorShuffled(
   static const char comps[17] = "0123456789ABCDEF";
   size_t s = mask.size();
   if (s != 2 && s != 3 && s != 4 && s != 8 && s != 16) {
-    errs() << "Shuffled vector size is "  << s << " but it can only be 2, 3, 4, 8 or 16\n";
-    errorWithMessage("Shuffled vector size error");
+    errorWithMessage("Shuffled vector size is " + utostr(s) +
+                     " but it can only be 2, 3, 4, 8 or 16");
   }
   Out << "s";
   for (uint64_t i : mask) {
     if (i < 16) {
       Out << comps[i];
     } else {
-      errs() << "Vector component index is "  << i << " but it cannot be greater than 15\n";
-      errorWithMessage("Vector component error");
+      errorWithMessage("Vector component index is " + utostr(i) +
+                       " but it cannot be greater than 15");
     }
   }
   return Out;
@@ -963,6 +1331,7 @@ void CWriter::printCast(unsigned opc, Type *SrcTy, Type *DstTy) {
 void CWriter::printConstant(Constant *CPV, enum OperandContext Context) {
   if (ConstantExpr *CE = dyn_cast<ConstantExpr>(CPV)) {
     errorWithMessage("Constant expressions is not supported");
+    return;
   } else if (isa<UndefValue>(CPV) && CPV->getType()->isSingleValueType()) {
     if (CPV->getType()->isVectorTy()) {
       // TODO_: Check this branch
@@ -972,11 +1341,11 @@ void CWriter::printConstant(Constant *CPV, enum OperandContext Context) {
       }
       VectorType *VT = cast<VectorType>(CPV->getType());
       cwriter_assert(!isEmptyType(VT));
-      CtorDeclTypes.insert(VT);
+      Decls.CtorDeclTypes.insert(VT);
       Out << "/*undef*/llvm_ctor_";
       printTypeString(Out, VT);
       Out << "(";
-      Constant *Zero = Constant::getNullValue(VT->getElementType());
+      Constant *Zero = getNullValue(VT->getElementType());
       unsigned NumElts = VT->getNumElements();
       for (unsigned i = 0; i != NumElts; ++i) {
         if (i)
@@ -986,7 +1355,7 @@ void CWriter::printConstant(Constant *CPV, enum OperandContext Context) {
       Out << ")";
 
     } else {
-      Constant *Zero = Constant::getNullValue(CPV->getType());
+      Constant *Zero = getNullValue(CPV->getType());
       Out << "/*UNDEF*/";
       return printConstant(Zero, Context);
     }
@@ -1038,7 +1407,7 @@ void CWriter::printConstant(Constant *CPV, enum OperandContext Context) {
     ArrayType *AT = cast<ArrayType>(CPV->getType());
     cwriter_assert(AT->getNumElements() != 0 && !isEmptyType(AT));
     if (Context != ContextStatic) {
-      CtorDeclTypes.insert(AT);
+      Decls.CtorDeclTypes.insert(AT);
       Out << "llvm_ctor_";
       printTypeString(Out, AT);
       Out << "(";
@@ -1053,7 +1422,7 @@ void CWriter::printConstant(Constant *CPV, enum OperandContext Context) {
       printConstantDataSequential(CDS, Context);
     } else {
       cwriter_assert(isa<ConstantAggregateZero>(CPV) || isa<UndefValue>(CPV));
-      Constant *CZ = Constant::getNullValue(AT->getElementType());
+      Constant *CZ = getNullValue(AT->getElementType());
       printConstant(CZ, Context);
       for (unsigned i = 1, e = AT->getNumElements(); i != e; ++i) {
         Out << ", ";
@@ -1069,7 +1438,7 @@ void CWriter::printConstant(Constant *CPV, enum OperandContext Context) {
     VectorType *VT = cast<VectorType>(CPV->getType());
     cwriter_assert(VT->getNumElements() != 0 && !isEmptyType(VT));
     if (Context != ContextStatic) {
-      CtorDeclTypes.insert(VT);
+      Decls.CtorDeclTypes.insert(VT);
       Out << "llvm_ctor_";
       printTypeString(Out, VT);
       Out << "(";
@@ -1084,7 +1453,7 @@ void CWriter::printConstant(Constant *CPV, enum OperandContext Context) {
       printConstantDataSequential(CDS, Context);
     } else {
       cwriter_assert(isa<ConstantAggregateZero>(CPV) || isa<UndefValue>(CPV));
-      Constant *CZ = Constant::getNullValue(VT->getElementType());
+      Constant *CZ = getNullValue(VT->getElementType());
       printConstant(CZ, Context);
       for (unsigned i = 1, e = VT->getNumElements(); i != e; ++i) {
         Out << ", ";
@@ -1098,7 +1467,7 @@ void CWriter::printConstant(Constant *CPV, enum OperandContext Context) {
     StructType *ST = cast<StructType>(CPV->getType());
     cwriter_assert(!isEmptyType(ST));
     if (Context != ContextStatic) {
-      CtorDeclTypes.insert(ST);
+      Decls.CtorDeclTypes.insert(ST);
       Out << "llvm_ctor_";
       printTypeString(Out, ST);
       Out << "(";
@@ -1115,7 +1484,7 @@ void CWriter::printConstant(Constant *CPV, enum OperandContext Context) {
           continue;
         if (printed)
           Out << ", ";
-        printConstant(Constant::getNullValue(ElTy), Context);
+        printConstant(getNullValue(ElTy), Context);
         printed = true;
       }
       cwriter_assert(printed);
@@ -1146,8 +1515,8 @@ void CWriter::printConstant(Constant *CPV, enum OperandContext Context) {
     break;
   }
   default:
-    errs() << "This constant type is not supported: " << *CPV << "\n";
-    errorWithMessage("This constant type is not supported");
+    errorWithMessage("This constant type is not supported: " +
+                     to_string(*CPV));
   }
 }
 
@@ -1160,10 +1529,9 @@ void CWriter::printConstantWithCast(Constant *CPV, unsigned Opcode) {
   Type *OpTy = CPV->getType();
   // TODO: VectorType are valid here, but not supported
   if (!OpTy->isIntegerTy() && !OpTy->isFloatingPointTy()) {
-    errs() << "Unsupported 'constant with cast' type " << *OpTy
-           << " in: " << *CPV << "\n"
-           << "\n";
-    errorWithMessage("Unsupported 'constant with cast' type");
+    errorWithMessage("Unsupported 'constant with cast' type " +
+                     to_string(*OpTy) + " of: " + to_string(*CPV));
+    return;
   }
 
   // Indicate whether to do the cast or not.
@@ -1183,32 +1551,51 @@ void CWriter::printConstantWithCast(Constant *CPV, unsigned Opcode) {
     printConstant(CPV);
 }
 
-std::string CWriter::GetValueName(Value *Operand) {
+StringRef CWriter::GetValueName(Value *Operand) {
+  // Values sharing a variable with a PHI node are named after the web.
+  Operand = getVarLeader(Operand);
+
+  auto It = ValueNames.find(Operand);
+  if (It != ValueNames.end())
+    return It->second;
 
   // Resolve potential alias.
   if (GlobalAlias *GA = dyn_cast<GlobalAlias>(Operand)) {
     Operand = GA->getAliasee();
   }
 
-  std::string Name = Operand->getName();
+  // Globals are resolved against the built-in table once per module.
+  GlobalValue *GV = dyn_cast<GlobalValue>(Operand);
+  if (GV && GV->hasName())
+    return resolveBuiltIn(GV).Name;
+
+  std::string Name = Operand->getName().str();
   if (Name.empty()) { // Assign unique names to local temporaries.
     unsigned No = AnonValueNumbers.getOrInsert(Operand);
     Name = "tmp_" + utostr(No);
   }
 
-  // Mangle globals with the standard mangler interface for LLC compatibility.
-  if (isa<GlobalValue>(Operand)) {
-    switch (builtins.find(Name.data(), nullptr)) {
-    case -1:
-      errorWithMessage("Built-in check unexpected error");
-    case 0:
-      return CBEMangle(Name);
-    case 1:
-      return "builtin_" + CBEMangle(Name);
-    }
-  }
+  StringRef Saved = NameSaver.save(CBEMangle(Name));
+  ValueNames[Operand] = Saved;
+  return Saved;
+}
 
-  return CBEMangle(Name);
+// resolveBuiltIn - Demangle the name of GV and look it up in the OpenCL
+// built-in table, remembering the outcome and the C name of GV.
+const CWriter::BuiltInResolution &
+CWriter::resolveBuiltIn(const GlobalValue *GV) {
+  auto It = BuiltInResolutions.find(GV);
+  if (It != BuiltInResolutions.end())
+    return It->second;
+
+  BuiltInResolution R;
+  std::string Name = GV->getName().str();
+  R.Kind = builtins.find(Name.data(), &R.func);
+  if (R.Kind == -1)
+    errorWithMessage("Built-in check unexpected error");
+  // Built-ins are called through wrappers named after them.
+  R.Name = (R.Kind == 1 ? "builtin_" : "") + CBEMangle(Name);
+  return BuiltInResolutions.emplace(GV, std::move(R)).first->second;
 }
 
 /// writeInstComputationInline - Emit the computation for the specified
@@ -1411,19 +1798,76 @@ static void FindStaticTors(GlobalVariable *GV,
     }
 }
 
+// getCallee - The function called by CI, looking through pointer casts and
+// aliases, or null for an indirect call.
+static Function *getCallee(CallInst *CI) {
+  Value *V = CI->getCalledValue()->stripPointerCasts();
+  while (GlobalAlias *GA = dyn_cast<GlobalAlias>(V))
+    V = GA->getAliasee()->stripPointerCasts();
+  return dyn_cast<Function>(V);
+}
+
 void CWriter::markUsed(Function *F) {
   if (UsedFunctions.insert(F).second) {
     //outs() << F->getName() << "\n";
     for (Function::iterator b = F->begin(), be = F->end(); b != be; ++b) {
       for (BasicBlock::iterator i = b->begin(), ie = b->end(); i != ie; ++i) {
         if (CallInst* callInst = dyn_cast<CallInst>(&*i)) {
-          markUsed(callInst->getCalledFunction());
+          if (Function *Callee = getCallee(callInst)) {
+            Callers[Callee].insert(F);
+            markUsed(Callee);
+          }
         }
       }
     }
   }
 }
 
+// collectUsers - Insert the functions referring to V, directly or through
+// constant expressions.
+static void collectUsers(Value *V, std::set<Function *> &Users) {
+  for (User *U : V->users()) {
+    if (Instruction *I = dyn_cast<Instruction>(U))
+      Users.insert(I->getFunction());
+    else if (isa<ConstantExpr>(U))
+      collectUsers(U, Users);
+  }
+}
+
+// collectLocalVars - OpenCL C has no program-scope __local variables, so each
+// addrspace(3) global is declared in the kernels reaching it and passed down
+// the call graph to the other functions using it.
+void CWriter::collectLocalVars(Module &M) {
+  for (GlobalVariable &GV : M.globals()) {
+    if (GV.getAddressSpace() != 3 || GV.isDeclaration())
+      continue;
+    if (!isa<UndefValue>(GV.getInitializer()) &&
+        !GV.getInitializer()->isNullValue())
+      errorWithMessage("__local variables cannot be initialized");
+
+    std::set<Function *> Users, Reached;
+    collectUsers(&GV, Users);
+    std::vector<Function *> Worklist(Users.begin(), Users.end());
+    while (!Worklist.empty()) {
+      Function *F = Worklist.back();
+      Worklist.pop_back();
+      if (!UsedFunctions.count(F) || !Reached.insert(F).second)
+        continue;
+      LocalVars[F].push_back(&GV);
+      if (F->getCallingConv() != CallingConv::SPIR_KERNEL)
+        for (Function *Caller : Callers[F])
+          Worklist.push_back(Caller);
+    }
+  }
+}
+
+ArrayRef<GlobalVariable *> CWriter::getLocalParams(Function *F) const {
+  auto It = LocalVars.find(F);
+  if (It == LocalVars.end() || F->getCallingConv() == CallingConv::SPIR_KERNEL)
+    return None;
+  return It->second;
+}
+
 enum SpecialGlobalClass {
   NotSpecial = 0,
   GlobalCtors,
@@ -1455,6 +1899,7 @@ bool CWriter::doInitialization(Module &M) {
 
   TD = new DataLayout(&M);
   IL = new IntrinsicLowering(*TD);
+  TLII = new TargetLibraryInfoImpl(Triple(M.getTargetTriple()));
   //IL->AddPrototypes(M);
 
 #if 0
@@ -1476,25 +1921,181 @@ bool CWriter::doInitialization(Module &M) {
       markUsed(F);
     }
   }
+  collectLocalVars(M);
+  numberUnnamedValues(M);
+  if (!FunctionCacheDir.empty())
+    FnCache.reset(new FunctionCache(FunctionCacheDir, M, UnnamedStructIDs));
 
+  reportError();
   return false;
 }
 
-bool CWriter::doFinalization(Module &M) {
-  // Output all code to the file
-  std::string methods = Out.str();
+// numberUnnamedValues - Number the unnamed struct types and globals of the
+// module in a fixed order, so their names do not depend on the order the
+// functions are printed in.
+void CWriter::numberUnnamedValues(Module &M) {
+  TypeFinder StructTypes;
+  StructTypes.run(M, false);
+  for (StructType *ST : StructTypes)
+    if (ST->isLiteral() || ST->getName().empty())
+      UnnamedStructIDs.getOrInsert(ST);
+  for (GlobalValue &GV : M.global_values())
+    if (!GV.hasName())
+      AnonValueNumbers.getOrInsert(&GV);
+  GlobalValueNumbers = AnonValueNumbers;
+}
+
+// lockShared - Lock the state shared with the other writers printing the
+// same module, if there are any: the LLVMContext, the DataLayout of the
+// module and the standard streams.
+std::unique_lock<std::mutex> CWriter::lockShared() {
+  if (!SharedMutex)
+    return std::unique_lock<std::mutex>();
+  return std::unique_lock<std::mutex>(*SharedMutex);
+}
+
+Constant *CWriter::getNullValue(Type *Ty) {
+  auto Lock = lockShared();
+  return Constant::getNullValue(Ty);
+}
+
+Constant *CWriter::getElementAsConstant(ConstantDataSequential *CDS,
+                                        unsigned i) {
+  auto Lock = lockShared();
+  return CDS->getElementAsConstant(i);
+}
+
+// emitFunctionsInParallel - Print the used functions on NumThreads worker
+// writers. Each worker takes the next function to print, computes its
+// analyses and keeps the output apart. The declarations the workers need
+// are merged into this writer before the header is generated, and the
+// bodies are kept in module order.
+void CWriter::emitFunctionsInParallel(Module &M, unsigned NumThreads) {
+  std::vector<Function *> Functions;
+  for (Function &F : M)
+    if (!F.isDeclaration() && !F.hasAvailableExternallyLinkage() &&
+        UsedFunctions.count(&F))
+      Functions.push_back(&F);
+
+  std::mutex Mutex;
+  std::vector<std::unique_ptr<CWriter>> Workers;
+  for (unsigned i = 0; i < NumThreads; ++i) {
+    Workers.push_back(std::make_unique<CWriter>(nulls()));
+    Workers.back()->SharedMutex = &Mutex;
+    Workers.back()->initializeWorker(M, *this);
+  }
+
+  // A worker stops at its first error. Functions are taken in order, so the
+  // first error in module order is the one a single writer would report.
+  std::vector<std::string> Bodies(Functions.size());
+  std::vector<std::string> Errors(Functions.size());
+  std::atomic<size_t> Next(0);
+  auto Work = [&](CWriter &W) {
+    for (size_t i; (i = Next++) < Functions.size();) {
+      W.printFunctionWithAnalyses(*Functions[i]);
+      W.Out.flush();
+      Bodies[i] = std::move(W._Out);
+      W._Out.clear();
+      W.ValueNames.clear();
+      if (W.hasFailed()) {
+        Errors[i] = W.ErrorMessage;
+        break;
+      }
+    }
+  };
+  std::vector<std::thread> Threads;
+  for (auto &W : Workers)
+    Threads.emplace_back(Work, std::ref(*W));
+  for (std::thread &T : Threads)
+    T.join();
+
+  for (auto &W : Workers) {
+    Decls.merge(W->Decls);
+    W->freeModuleState();
+  }
+  for (std::string &Error : Errors)
+    if (!Error.empty()) {
+      ErrorMessage = Error;
+      return;
+    }
+  for (std::string &Body : Bodies)
+    if (!Body.empty())
+      FunctionBodies.push_back(std::move(Body));
+}
+
+// initializeWorker - Prepare a worker writer to print functions of M. The
+// module-level state Main computed in doInitialization is copied rather than
+// computed again for each worker.
+void CWriter::initializeWorker(Module &M, const CWriter &Main) {
+  TheModule = &M;
+  TD = new DataLayout(*Main.TD);
+  IL = new IntrinsicLowering(*TD);
+  TLII = new TargetLibraryInfoImpl(*Main.TLII);
+  TAsm = new CBEMCAsmInfo();
+  MRI = new MCRegisterInfo();
+  TCtx = new MCContext(TAsm, MRI, nullptr);
+
+  UsedFunctions = Main.UsedFunctions;
+  Callers = Main.Callers;
+  LocalVars = Main.LocalVars;
+  UnnamedStructIDs = Main.UnnamedStructIDs;
+  AnonValueNumbers = Main.AnonValueNumbers;
+  GlobalValueNumbers = Main.GlobalValueNumbers;
+  if (Main.FnCache)
+    FnCache.reset(new FunctionCache(FunctionCacheDir, M, UnnamedStructIDs));
+}
+
+// flushFunctionBody - Move the code printed so far out of _Out, so that the
+// module is kept as a list of function-sized chunks.
+void CWriter::flushFunctionBody() {
+  Out.flush();
+  if (_Out.empty())
+    return;
+  FunctionBodies.push_back(std::move(_Out));
   _Out.clear();
-  generateHeader(M);
-  std::string header = OutHeaders.str() + Out.str();
+}
+
+bool CWriter::doFinalization(Module &M) {
+  if (EmitThreads != 1 && !hasFailed()) {
+    // hardware_concurrency may be unknown and return 0.
+    unsigned NumThreads =
+        EmitThreads ? EmitThreads : std::thread::hardware_concurrency();
+    emitFunctionsInParallel(M, std::max(1u, NumThreads));
+  }
+
+  // Output all code to the file. The header depends on everything the
+  // functions use, so it is generated last and spliced in before them.
+  // Nothing is written after an error.
+  flushFunctionBody();
+  if (!hasFailed())
+    generateHeader(M);
+  if (!hasFailed()) {
+    FileOut << OutHeaders.str() << Out.str();
+    for (std::string &Body : FunctionBodies)
+      FileOut << Body;
+  }
   _Out.clear();
   _OutHeaders.clear();
-  FileOut << header << methods;
+  for (std::string &Body : FunctionBodies)
+    std::string().swap(Body);
+  FunctionBodies.clear();
+
+  reportError();
+  freeModuleState();
+  return true; // may have lowered an IntrinsicCall
+}
 
+void CWriter::freeModuleState() {
   // Free memory...
+  ErrorMessage.clear();
+  ErrorReported = false;
 
   delete IL;
   IL = nullptr;
 
+  delete TLII;
+  TLII = nullptr;
+
   delete TD;
   TD = nullptr;
 
@@ -1514,19 +2115,82 @@ bool CWriter::doFinalization(Module &M) {
   AnonValueNumbers.clear();
   UnnamedStructIDs.clear();
   UnnamedFunctionIDs.clear();
-  TypedefDeclTypes.clear();
-  SelectDeclTypes.clear();
-  CmpDeclTypes.clear();
-  CastOpDeclTypes.clear();
-  InlineOpDeclTypes.clear();
-  CtorDeclTypes.clear();
+  Decls.clear();
+  FnCache.reset();
+  SlotTracker.reset();
+  Callers.clear();
+  LocalVars.clear();
+  BuiltInResolutions.clear();
+  ValueNames.clear();
+  TypeNames.clear();
+  NameAllocator.Reset();
   prototypesToGen.clear();
-
-  return true; // may have lowered an IntrinsicCall
+  GlobalValueNumbers.clear();
 }
 
 
 
+// compareTypes - Order types by their structure. Structs without a name are
+// ordered by their number, so the order does not depend on where the types
+// are allocated.
+int CWriter::compareTypes(Type *A, Type *B) {
+  if (A == B)
+    return 0;
+  if (A->getTypeID() != B->getTypeID())
+    return A->getTypeID() < B->getTypeID() ? -1 : 1;
+
+  auto compareNumbers = [](uint64_t X, uint64_t Y) {
+    return X == Y ? 0 : X < Y ? -1 : 1;
+  };
+  switch (A->getTypeID()) {
+  case Type::IntegerTyID:
+    return compareNumbers(A->getIntegerBitWidth(), B->getIntegerBitWidth());
+  case Type::PointerTyID:
+    if (int C = compareNumbers(A->getPointerAddressSpace(),
+                               B->getPointerAddressSpace()))
+      return C;
+    return compareTypes(A->getPointerElementType(),
+                        B->getPointerElementType());
+  case Type::VectorTyID:
+    if (int C = compareNumbers(cast<VectorType>(A)->getNumElements(),
+                               cast<VectorType>(B)->getNumElements()))
+      return C;
+    return compareTypes(A->getVectorElementType(), B->getVectorElementType());
+  case Type::ArrayTyID:
+    if (int C = compareNumbers(A->getArrayNumElements(),
+                               B->getArrayNumElements()))
+      return C;
+    return compareTypes(A->getArrayElementType(), B->getArrayElementType());
+  case Type::StructTyID: {
+    StructType *SA = cast<StructType>(A), *SB = cast<StructType>(B);
+    bool NamedA = !SA->isLiteral() && SA->hasName();
+    bool NamedB = !SB->isLiteral() && SB->hasName();
+    if (NamedA != NamedB)
+      return NamedA ? -1 : 1;
+    if (NamedA)
+      return SA->getName().compare(SB->getName());
+    return compareNumbers(UnnamedStructIDs.getOrInsert(SA),
+                          UnnamedStructIDs.getOrInsert(SB));
+  }
+  case Type::FunctionTyID: {
+    FunctionType *FA = cast<FunctionType>(A), *FB = cast<FunctionType>(B);
+    if (int C = compareNumbers(FA->isVarArg(), FB->isVarArg()))
+      return C;
+    if (int C = compareNumbers(FA->getNumParams(), FB->getNumParams()))
+      return C;
+    if (int C = compareTypes(FA->getReturnType(), FB->getReturnType()))
+      return C;
+    for (unsigned i = 0, e = FA->getNumParams(); i != e; ++i)
+      if (int C = compareTypes(FA->getParamType(i), FB->getParamType(i)))
+        return C;
+    return 0;
+  }
+  default:
+    // Other types are identified by their ID.
+    return 0;
+  }
+}
+
 void CWriter::generateHeader(Module &M) {
   // Keep track of which functions are static ctors/dtors so they can have
   // an attribute added to their prototypes.
@@ -1554,6 +2218,10 @@ void CWriter::generateHeader(Module &M) {
       continue;
     printTypeName(NullOut, I->getType()->getElementType(), false);
   }
+  if (Decls.UsesInt64Atomics)
+    Out << "#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable\n"
+        << "#pragma OPENCL EXTENSION cl_khr_int64_extended_atomics : enable\n";
+
   printModuleTypes(Out);
 
   // Function declarations and wrappers for OpenCL built-ins
@@ -1572,20 +2240,23 @@ void CWriter::generateHeader(Module &M) {
     // Don't print declarations for intrinsic functions.
     // Store the used intrinsics, which need to be explicitly defined.
     if (I->isIntrinsic()) {
-      if (intrinsics.hasImpl(I->getIntrinsicID())) {
+      if (intrinsics.hasImpl(I->getIntrinsicID(), I->getFunctionType())) {
         intrinsicsToDefine.push_back(&*I);
       }
       continue;
     }
 
     // Skip OpenCL built-in functions
-    Func func;
-    switch (builtins.find(I->getName().data(), &func)) {
+    const BuiltInResolution &R = resolveBuiltIn(&*I);
+    const Func &func = R.func;
+    switch (R.Kind) {
     case -1:
       errorWithMessage("Built-in check unexpected error");
       break;
     case 1: {
-      // Is opencl built-in
+      // Is opencl built-in, called directly unless a wrapper is required
+      if (isDirectBuiltIn(&*I, func))
+        continue;
       // TODO_: Handle more than 26 arguments
       auto GetArgName = [](int i) {
         return std::string() + (char)('a' + i);
@@ -1604,7 +2275,7 @@ void CWriter::generateHeader(Module &M) {
       iterator_range<Function::arg_iterator> args = I->args();
       printFunctionProto(Out, I->getFunctionType(),
                         std::make_pair(I->getAttributes(), I->getCallingConv()),
-                        GetValueName(&*I), &args, GetArgName);
+                        GetValueName(&*I).str(), &args, GetArgName);
       Out << " {\n";
       cwriter_assert(builtins.printDefinition(Out, func, &*I, GetArgName, GetTypeName));
       Out << "}\n";
@@ -1661,8 +2332,8 @@ void CWriter::generateHeader(Module &M) {
   Out << "\n\n/* LLVM Intrinsic Builtin Function Bodies */\n";
 
   // Loop over all select operations
-  for (std::set<std::pair<Type *, Type *>>::iterator it = SelectDeclTypes.begin(),
-                                  end = SelectDeclTypes.end();
+  auto Selects = sortDecls(Decls.SelectDeclTypes);
+  for (auto it = Selects.begin(), end = Selects.end();
        it != end; ++it) {
     // static Rty llvm_select_u8x4(<bool x 4> condition, <u8 x 4>
     // iftrue, <u8 x 4> ifnot) {
@@ -1702,10 +2373,7 @@ void CWriter::generateHeader(Module &M) {
         Out << "long";
         break;
       default:
-        errs() << "Unknown vector element type: ";
-        printTypeName(errs(), ElTy, true);
-        errs() << "\n";
-        errorWithMessage("Unknown vector element type");
+        errorWithMessage("Unknown vector element type: " + to_string(*ElTy));
       }
       Out << VTy->getNumElements() << "(";
       printWithCast(Out, CTy, true, "condition");
@@ -1718,9 +2386,8 @@ void CWriter::generateHeader(Module &M) {
   }
 
   // Loop over all compare operations
-  for (std::set<std::pair<CmpInst::Predicate, Type *>>::iterator
-           it = CmpDeclTypes.begin(),
-           end = CmpDeclTypes.end();
+  auto Cmps = sortDecls(Decls.CmpDeclTypes);
+  for (auto it = Cmps.begin(), end = Cmps.end();
        it != end; ++it) {
     // static <bool x 4> llvm_icmp_ge_u8x4(<u8 x 4> l, <u8 x 4> r) {
     //   return l >= r;
@@ -1779,10 +2446,8 @@ void CWriter::generateHeader(Module &M) {
 
   // TODO: Test cast
   // Loop over all cast operations
-  for (std::set<
-           std::pair<CastInst::CastOps, std::pair<Type *, Type *>>>::iterator
-           it = CastOpDeclTypes.begin(),
-           end = CastOpDeclTypes.end();
+  auto Casts = sortDecls(Decls.CastOpDeclTypes);
+  for (auto it = Casts.begin(), end = Casts.end();
        it != end; ++it) {
     // static <u32 x 4> llvm_ZExt_u8x4_u32x4(<u8 x 4> in) { //
     // Src->isVector == Dst->isVector
@@ -1873,9 +2538,8 @@ void CWriter::generateHeader(Module &M) {
   }
 
   // Loop over all simple operations
-  for (std::set<std::pair<unsigned, Type *>>::iterator
-           it = InlineOpDeclTypes.begin(),
-           end = InlineOpDeclTypes.end();
+  auto InlineOps = sortDecls(Decls.InlineOpDeclTypes);
+  for (auto it = InlineOps.begin(), end = InlineOps.end();
        it != end; ++it) {
     // static <u32 x 4> llvm_BinOp_u32x4(<u32 x 4> a, <u32 x 4> b) {
     //   return a OP b;
@@ -1939,51 +2603,12 @@ void CWriter::generateHeader(Module &M) {
           } else {
             Out << "a";
           }
-          Out << " ";
-          switch (opcode) {
-          case Instruction::Add:
-          case Instruction::FAdd:
-            Out << "+";
-            break;
-          case Instruction::Sub:
-          case Instruction::FSub:
-            Out << "-";
-            break;
-          case Instruction::Mul:
-          case Instruction::FMul:
-            Out << "*";
-            break;
-          case Instruction::URem:
-          case Instruction::SRem:
-          case Instruction::FRem:
-            Out << "%";
-            break;
-          case Instruction::UDiv:
-          case Instruction::SDiv:
-          case Instruction::FDiv:
-            Out << "/";
-            break;
-          case Instruction::And:
-            Out << "&";
-            break;
-          case Instruction::Or:
-            Out << "|";
-            break;
-          case Instruction::Xor:
-            Out << "^";
-            break;
-          case Instruction::Shl:
-            Out << "<<";
-            break;
-          case Instruction::LShr:
-          case Instruction::AShr:
-            Out << ">>";
-            break;
-          default:
-            errs() << "Invalid operator type!" << opcode << "\n";
-            errorWithMessage("invalid operator type");
+          const char *Token = getOperatorToken(opcode);
+          if (!Token) {
+            errorWithMessage("invalid operator type " + utostr(opcode));
+            Token = "";
           }
-          Out << " ";
+          Out << " " << Token << " ";
           if (isSigned) {
             printWithCast(Out, OpTy, isSigned, "b");
           } else if (shouldCast) {
@@ -1999,8 +2624,8 @@ void CWriter::generateHeader(Module &M) {
   }
   
   // Loop over all inline constructors
-  for (std::set<Type *>::iterator it = CtorDeclTypes.begin(),
-                                  end = CtorDeclTypes.end();
+  auto Ctors = sortDecls(Decls.CtorDeclTypes);
+  for (auto it = Ctors.begin(), end = Ctors.end();
        it != end; ++it) {
     // static <u32 x 4> llvm_ctor_u32x4(u32 x1, u32 x2, u32 x3, u32 x4) {
     //   ...
@@ -2069,11 +2694,132 @@ void CWriter::generateHeader(Module &M) {
     Out << "\n}\n";
   }
 
+  // Loop over all cmpxchg operations
+  auto CmpXchgs = sortDecls(Decls.CmpXchgDeclTypes);
+  for (auto it = CmpXchgs.begin(), end = CmpXchgs.end();
+       it != end; ++it) {
+    // static { u32, bool } llvm_cmpxchg_p1i32(volatile __global uint *p,
+    //                                          uint c, uint n) {
+    //   { u32, bool } r;
+    //   r.f0 = atomic_cmpxchg(p, c, n);
+    //   r.f1 = -(r.f0 == c);
+    //   return r;
+    // }
+    Type *PtrTy = it->first;
+    Type *Ty = PtrTy->getPointerElementType();
+    Type *RTy = it->second;
+    Out << "static ";
+    printTypeName(Out, RTy);
+    Out << " llvm_cmpxchg_";
+    printTypeString(Out, PtrTy);
+    Out << "(";
+    printAtomicPointerType(Out, Ty, PtrTy->getPointerAddressSpace(), false);
+    Out << " p, ";
+    printTypeName(Out, Ty);
+    Out << " c, ";
+    printTypeName(Out, Ty);
+    Out << " n";
+    if (ExplicitAtomics)
+      Out << ", memory_order s, memory_order f, memory_scope sc";
+    Out << ") {\n  ";
+    printTypeName(Out, RTy);
+    Out << " r;\n";
+    if (ExplicitAtomics) {
+      Out << "  r.f0 = c;\n"
+          << "  r.f1 = -atomic_compare_exchange_strong_explicit("
+          << "p, &r.f0, n, s, f, sc);\n";
+    } else {
+      Out << "  r.f0 = " << getAtomicFunction("cmpxchg", Ty) << "(p, c, n);\n"
+          << "  r.f1 = -(r.f0 == c);\n";
+    }
+    Out << "  return r;\n}\n";
+  }
+
+  // Loop over all atomicrmw operations without an OpenCL built-in
+  auto AtomicRMWs = sortDecls(Decls.AtomicRMWDeclTypes);
+  for (auto it = AtomicRMWs.begin(), end = AtomicRMWs.end();
+       it != end; ++it) {
+    // static float llvm_atomicrmw_fadd_p1f32(volatile __global uint *p,
+    //                                        float v) {
+    //   uint o = *p, e;
+    //   do {
+    //     e = o;
+    //     o = atomic_cmpxchg(p, e, as_uint(as_float(e) + v));
+    //   } while (o != e);
+    //   return as_float(e);
+    // }
+    AtomicRMWInst::BinOp Op = (AtomicRMWInst::BinOp)it->first;
+    Type *PtrTy = it->second;
+    Type *Ty = PtrTy->getPointerElementType();
+    Type *IntTy = getAtomicIntType(Ty);
+    std::string IntName, Name;
+    raw_string_ostream IntOut(IntName), NameOut(Name);
+    printTypeName(IntOut, IntTy);
+    printTypeName(NameOut, Ty);
+    IntOut.str();
+    NameOut.str();
+
+    bool isFP = Ty->isFloatingPointTy();
+    std::string Old = isFP ? "as_" + Name + "(e)" : "e";
+    std::string New;
+    switch (Op) {
+    case AtomicRMWInst::Nand:
+      New = "~(" + Old + " & v)";
+      break;
+    case AtomicRMWInst::FAdd:
+      New = Old + " + v";
+      break;
+    case AtomicRMWInst::FSub:
+      New = Old + " - v";
+      break;
+    default:
+      errorWithMessage("Unsupported atomicrmw operation");
+    }
+    if (isFP)
+      New = "as_" + IntName + "(" + New + ")";
+
+    Out << "static " << Name << " llvm_atomicrmw_"
+        << AtomicRMWInst::getOperationName(Op) << "_";
+    printTypeString(Out, PtrTy);
+    Out << "(";
+    printAtomicPointerType(Out, IntTy, PtrTy->getPointerAddressSpace(), false);
+    Out << " p, " << Name << " v";
+    if (ExplicitAtomics) {
+      Out << ", memory_order m, memory_scope s) {\n"
+          << "  " << IntName
+          << " e = atomic_load_explicit(p, memory_order_relaxed, s);\n"
+          << "  while (!atomic_compare_exchange_weak_explicit(p, &e, " << New
+          << ", m, memory_order_relaxed, s));\n";
+    } else {
+      Out << ") {\n"
+          << "  " << IntName << " o = *p, e;\n"
+          << "  do {\n"
+          << "    e = o;\n"
+          << "    o = " << getAtomicFunction("cmpxchg", IntTy) << "(p, e, "
+          << New << ");\n"
+          << "  } while (o != e);\n";
+    }
+    Out << "  return " << (isFP ? "as_" + Name + "(e)" : "e") << ";\n}\n";
+  }
+
   // Emit definitions of the intrinsics.
   for (SmallVector<Function *, 16>::iterator I = intrinsicsToDefine.begin(),
                                              E = intrinsicsToDefine.end();
        I != E; ++I) {
-    printIntrinsicDefinition(**I, Out);
+    switch ((*I)->getIntrinsicID()) {
+    case Intrinsic::memset:
+    case Intrinsic::memcpy:
+    case Intrinsic::memmove:
+      // Defined once per length and alignment below.
+      break;
+    default:
+      printIntrinsicDefinition(**I, Out);
+    }
+  }
+  for (auto &Decl : Decls.MemIntrinsicDecls) {
+    Function *F = Decl.second.first;
+    printIntrinsicDefinition(F->getFunctionType(), F->getIntrinsicID(),
+                             Decl.first, Out, Decl.second.second);
   }
 
   if (!M.empty())
@@ -2088,9 +2834,18 @@ void CWriter::declareOneGlobalVariable(GlobalVariable *I) {
   if (getGlobalVariableClass(&*I))
     return;
 
+  // Declared in the kernels using them
+  if (I->getAddressSpace() == 3)
+    return;
+
   if (I->hasLocalLinkage())
     Out << "static ";
-  Out << "__constant ";
+  // Program-scope variables are __constant unless the module places them in
+  // the global address space, which needs OpenCL 2.0.
+  if (I->getAddressSpace() == 1)
+    Out << "__global ";
+  else
+    Out << "__constant ";
 
   Type *ElTy = I->getType()->getElementType();
   unsigned Alignment = I->getAlignment();
@@ -2113,7 +2868,7 @@ void CWriter::printFPConstantValue(raw_ostream &Out, const ConstantFP *FPC,
   if (Context == ContextStatic) {
     // Print in decimal form.
     // It can be used in constexpr but may result in precision loss.
-    double V;
+    double V = 0;
     const char *postfix = "";
     switch(FPC->getType()->getTypeID()) {
       case Type::FloatTyID:
@@ -2168,7 +2923,8 @@ void CWriter::printModuleTypes(raw_ostream &Out) {
 
   {
     std::set<Type *> TypesPrinted;
-    for (auto it = TypedefDeclTypes.begin(), end = TypedefDeclTypes.end();
+    auto Typedefs = sortDecls(Decls.TypedefDeclTypes);
+    for (auto it = Typedefs.begin(), end = Typedefs.end();
          it != end; ++it) {
       forwardDeclareStructs(Out, *it, TypesPrinted);
     }
@@ -2182,10 +2938,22 @@ void CWriter::printModuleTypes(raw_ostream &Out) {
     std::string NameToPrint;
   };
 
+  // Copy Function Types into indexable container, in the order of their IDs
+  // rather than of the map.
+  std::vector<std::pair<unsigned, std::pair<FunctionType *,
+                                            std::pair<AttributeList,
+                                                      CallingConv::ID>>>>
+      FunctionTypes;
+  for (auto &I : UnnamedFunctionIDs)
+    FunctionTypes.push_back(std::make_pair(I.second, I.first));
+  llvm::sort(FunctionTypes, [](const decltype(FunctionTypes)::value_type &A,
+                               const decltype(FunctionTypes)::value_type &B) {
+    return A.first < B.first;
+  });
+
   std::vector<FunctionDefinition> FunctionTypeDefinitions;
-  // Copy Function Types into indexable container
-  for (auto &I : UnnamedFunctionIDs) {
-    const auto &F = I.first;
+  for (auto &I : FunctionTypes) {
+    const auto &F = I.second;
     FunctionType *FT = F.first;
     std::vector<FunctionType *> FDeps;
     for (const auto P : F.first->params()) {
@@ -2221,6 +2989,7 @@ void CWriter::printModuleTypes(raw_ostream &Out) {
   Optional<std::vector<int>> TopologicalSortResult = Sorter.sort();
   if (!TopologicalSortResult.hasValue()) {
     errorWithMessage("Cyclic dependencies in function definitions");
+    return;
   }
   for (const auto I : TopologicalSortResult.getValue()) {
     Out << FunctionTypeDefinitions[I].NameToPrint << "\n";
@@ -2236,7 +3005,8 @@ void CWriter::printModuleTypes(raw_ostream &Out) {
 
   Out << "\n/* Types Definitions */\n";
 
-  for (auto it = TypedefDeclTypes.begin(), end = TypedefDeclTypes.end();
+  auto Typedefs = sortDecls(Decls.TypedefDeclTypes);
+  for (auto it = Typedefs.begin(), end = Typedefs.end();
        it != end; ++it) {
     printContainedTypes(Out, *it, TypesPrinted);
   }
@@ -2294,15 +3064,32 @@ void CWriter::printFunction(Function &F) {
   iterator_range<Function::arg_iterator> args = F.args();
   printFunctionProto(Out, F.getFunctionType(),
                      std::make_pair(F.getAttributes(), F.getCallingConv()),
-                     GetValueName(&F), &args);
+                     GetValueName(&F).str(), &args, getLocalParams(&F));
 
   Out << " {\n";
 
+  // Nothing printed depends on the functions printed before.
+  AnonValueNumbers = GlobalValueNumbers;
+  LastAnnotatedSourceLine = 0;
+
+  InKernel = F.getCallingConv() == CallingConv::SPIR_KERNEL;
+  if (InKernel) {
+    for (GlobalVariable *GV : LocalVars[&F]) {
+      Type *ElTy = GV->getValueType();
+      unsigned Alignment = GV->getAlignment();
+      Out << "  __local ";
+      printTypeName(Out, ElTy, false) << ' ' << GetValueName(GV);
+      if (Alignment && Alignment > TD->getABITypeAlignment(ElTy))
+        Out << " __attribute__((aligned(" << Alignment << ")))";
+      Out << ";\n";
+    }
+  }
+
   Function::arg_iterator A = F.arg_begin(), E = F.arg_end();
   if (F.hasStructRetAttr()) {
     Type *StructTy =
         cast<PointerType>(A->getType())->getElementType();
-    std::string sret_name = GetValueName(A);
+    std::string sret_name = GetValueName(A).str();
     Out << "  ";
     printTypeName(Out, StructTy)
         << " " << sret_name << "_sret;  /* Struct return temporary */\n";
@@ -2315,13 +3102,43 @@ void CWriter::printFunction(Function &F) {
   }
   for (;A != E; ++A) {
     if (A->hasByValAttr()) {
-      std::string val_name = GetValueName(A);
+      std::string val_name = GetValueName(A).str();
       Out << "  ";
       printTypeName(Out, A->getType());
       Out << " " << val_name << " = &" << val_name << "_val;\n";
     }
   }
 
+  {
+    // Alias and SCEV queries may add constants to the shared context.
+    auto Lock = lockShared();
+    collectInlinableLoads(F);
+  }
+
+  CFGStructurizer Structurizer(F, *DT, *LI);
+  if (StructuredControlFlow && Structurizer.run()) {
+    Structure = &Structurizer;
+    auto Lock = lockShared();
+    collectForLoops(Structurizer.getBody());
+  }
+
+  // Take the function out of SSA form: PHI nodes share their variable with
+  // the incoming values they do not interfere with.
+  PHICoalescer PHIWebs(
+      F,
+      [&](Instruction &I) {
+        return !isEmptyType(I.getType()) && !isInlinableInst(I) &&
+               !isDirectAlloca(&I) &&
+               (isa<PHINode>(I) || !ForLoopInsts.count(&I));
+      },
+      [&](Instruction &I) { return isInlinableInst(I) && !isDirectAlloca(&I); });
+  for (Instruction *I : ForLoopInsts)
+    PHIWebs.pin(I);
+  for (auto &FL : ForLoops)
+    PHIWebs.pin(FL.second.Init);
+  PHIWebs.run();
+  Coalescer = &PHIWebs;
+
   bool PrintedVar = false;
 
   // print local variable information for the function
@@ -2338,17 +3155,12 @@ void CWriter::printFunction(Function &F) {
         Out << " __attribute__((aligned(" << Alignment << ")))";
       Out << ";    /* Address-exposed local */\n";
       PrintedVar = true;
-    } else if (!isEmptyType(I->getType()) && !isInlinableInst(*I)) {
+    } else if (!isEmptyType(I->getType()) && !isInlinableInst(*I) &&
+               getVarLeader(&*I) == &*I &&
+               (isa<PHINode>(*I) || !ForLoopInsts.count(&*I))) {
       Out << "  ";
       printTypeName(Out, I->getType(), false) << ' ' << GetValueName(&*I);
       Out << ";\n";
-
-      if (isa<PHINode>(*I)) { // Print out PHI node temporaries as well...
-        Out << "  ";
-        printTypeName(Out, I->getType(), false)
-            << ' ' << (GetValueName(&*I) + "_phi");
-        Out << ";\n";
-      }
       PrintedVar = true;
     }
   }
@@ -2356,16 +3168,35 @@ void CWriter::printFunction(Function &F) {
   if (PrintedVar)
     Out << '\n';
 
-  // print the basic blocks
-  for (Function::iterator BB = F.begin(), E = F.end(); BB != E; ++BB) {
-    if (Loop *L = LI->getLoopFor(&*BB)) {
-      if (L->getHeader() == &*BB && L->getParentLoop() == nullptr)
-        printLoop(L);
-    } else {
-      printBasicBlock(&*BB);
+  if (Structure) {
+    StructuredSeq &Body = Structurizer.getBody();
+
+    // A void return closing the function body is implicit.
+    size_t End = Body.size();
+    if (Body.back()->Kind == StructuredNode::Terminator) {
+      ReturnInst *RI = dyn_cast<ReturnInst>(Body.back()->BB->getTerminator());
+      if (RI && RI->getNumOperands() == 0 && !F.hasStructRetAttr())
+        --End;
+    }
+    printStructuredSeq(Body, 0, End);
+  } else {
+    // print the basic blocks
+    for (Function::iterator BB = F.begin(), E = F.end(); BB != E; ++BB) {
+      if (Loop *L = LI->getLoopFor(&*BB)) {
+        if (L->getHeader() == &*BB && L->getParentLoop() == nullptr)
+          printLoop(L);
+      } else {
+        printBasicBlock(&*BB);
+      }
     }
   }
 
+  ForLoops.clear();
+  ForLoopInsts.clear();
+  InlinableLoads.clear();
+  Coalescer = nullptr;
+  Structure = nullptr;
+
   Out << "}\n\n";
 }
 
@@ -2380,41 +3211,440 @@ void CWriter::printLoop(Loop *L) {
   }
 }
 
-void CWriter::printBasicBlock(BasicBlock *BB) {
+void CWriter::printStructuredSeq(StructuredSeq &Seq, size_t Begin) {
+  printStructuredSeq(Seq, Begin, Seq.size());
+}
 
-  // Don't print the label for the basic block if there are no uses, or if
-  // the only terminator use is the predecessor basic block's terminator.
-  // We have to scan the use list because PHI nodes use basic blocks too but
-  // do not require a label to be generated.
-  bool NeedsLabel = false;
-  for (pred_iterator PI = pred_begin(BB), E = pred_end(BB); PI != E; ++PI)
-    if (isGotoCodeNecessary(*PI, BB)) {
-      NeedsLabel = true;
-      break;
-    }
+void CWriter::printStructuredSeq(StructuredSeq &Seq, size_t Begin,
+                                 size_t End) {
+  for (size_t i = Begin; i < End; ++i)
+    printStructuredNode(*Seq[i]);
+}
+
+void CWriter::printStructuredNode(StructuredNode &N) {
+  switch (N.Kind) {
+  case StructuredNode::Block:
+    if (Structure->needsLabel(N.BB) && !LI->isLoopHeader(N.BB))
+      printLabel(N.BB);
+    printBasicBlockBody(N.BB);
+    break;
+  case StructuredNode::Edge:
+    printStructuredEdge(N);
+    break;
+  case StructuredNode::If:
+    printStructuredIf(N);
+    break;
+  case StructuredNode::Switch:
+    printStructuredSwitch(N);
+    break;
+  case StructuredNode::Loop:
+    printStructuredLoop(N);
+    break;
+  case StructuredNode::Terminator:
+    visit(*N.BB->getTerminator());
+    break;
+  }
+}
+
+void CWriter::printLabel(BasicBlock *BB) {
+  // The empty statement keeps the label valid in front of a closing brace.
+  Out << GetValueName(BB) << ": ;\n";
+}
+
+void CWriter::printStructuredEdge(StructuredNode &N) {
+  printPHICopiesForSuccessor(N.BB, N.Target, StmtIndent - 2);
+  switch (N.Jump) {
+  case StructuredNode::Inline:
+  case StructuredNode::Fallthrough:
+    break;
+  case StructuredNode::Continue:
+    Out.indent(StmtIndent) << "continue;\n";
+    break;
+  case StructuredNode::Break:
+    Out.indent(StmtIndent) << "break;\n";
+    break;
+  case StructuredNode::Goto:
+    Out.indent(StmtIndent) << "goto ";
+    writeOperand(N.Target);
+    Out << ";\n";
+    break;
+  }
+}
+
+void CWriter::printCondition(Value *Cond, bool Negate) {
+  if (Negate)
+    Out << "!";
+  writeOperand(Cond);
+}
+
+void CWriter::printStructuredIf(StructuredNode &N) {
+  Value *Cond = cast<BranchInst>(N.BB->getTerminator())->getCondition();
+  StructuredSeq &Then = N.Arms[0], &Else = N.Arms[1];
+  bool ThenEmpty = isEmptySeq(Then), ElseEmpty = isEmptySeq(Else);
+  if (ThenEmpty && ElseEmpty)
+    return;
+
+  // An arm which only leaves the construct becomes a guard and the other arm
+  // continues at the same level.
+  for (unsigned Jump = 0; Jump < 2; ++Jump) {
+    StructuredSeq &Rest = N.Arms[1 - Jump];
+    if (isJumpOnly(N.Arms[Jump]) && !isJumpOnly(Rest)) {
+      Out.indent(StmtIndent) << "if (";
+      printCondition(Cond, Jump == 1);
+      Out << ") ";
+      unsigned Indent = StmtIndent;
+      StmtIndent = 0;
+      printStructuredEdge(*N.Arms[Jump][0]);
+      StmtIndent = Indent;
+      printStructuredSeq(Rest);
+      return;
+    }
+  }
+
+  Out.indent(StmtIndent) << "if (";
+  printCondition(Cond, ThenEmpty);
+  Out << ") {\n";
+  StmtIndent += 2;
+  printStructuredSeq(ThenEmpty ? Else : Then);
+  StmtIndent -= 2;
+  if (!ThenEmpty && !ElseEmpty) {
+    Out.indent(StmtIndent) << "} else {\n";
+    StmtIndent += 2;
+    printStructuredSeq(Else);
+    StmtIndent -= 2;
+  }
+  Out.indent(StmtIndent) << "}\n";
+}
+
+void CWriter::printStructuredSwitch(StructuredNode &N) {
+  SwitchInst *SI = cast<SwitchInst>(N.BB->getTerminator());
+  Out.indent(StmtIndent) << "switch (";
+  writeOperand(SI->getCondition());
+  Out << ") {\n";
+  for (unsigned i = 0, e = N.Succs.size(); i != e; ++i) {
+    for (auto Case : SI->cases())
+      if (Case.getCaseSuccessor() == N.Succs[i]) {
+        Out.indent(StmtIndent) << "case ";
+        writeOperand(Case.getCaseValue());
+        Out << ":\n";
+      }
+    if (SI->getDefaultDest() == N.Succs[i])
+      Out.indent(StmtIndent) << "default:\n";
+
+    StmtIndent += 2;
+    StructuredSeq &Arm = N.Arms[i];
+    printStructuredSeq(Arm);
+    StructuredNode &Last = *Arm.back();
+    if (Last.Kind != StructuredNode::Terminator &&
+        !(Last.Kind == StructuredNode::Edge &&
+          (Last.Jump == StructuredNode::Continue ||
+           Last.Jump == StructuredNode::Goto)))
+      Out.indent(StmtIndent) << "break;\n";
+    StmtIndent -= 2;
+  }
+  Out.indent(StmtIndent) << "}\n";
+}
+
+void CWriter::printStructuredLoop(StructuredNode &N) {
+  auto FL = ForLoops.find(N.BB);
+  if (FL != ForLoops.end()) {
+    printForLoop(N, FL->second);
+    return;
+  }
+
+  if (Structure->needsLabel(N.BB))
+    printLabel(N.BB);
+  StructuredSeq &Body = N.Arms[0];
+
+  // while (c) { ... } if the header only computes the exit condition.
+  if (Body.size() >= 2 && isEmptyNode(*Body[0]) &&
+      Body[1]->Kind == StructuredNode::If) {
+    StructuredNode &Test = *Body[1];
+    for (unsigned Exit = 0; Exit < 2; ++Exit) {
+      if (!isJumpOnly(Test.Arms[Exit], true))
+        continue;
+      Out.indent(StmtIndent) << "while (";
+      printCondition(cast<BranchInst>(Test.BB->getTerminator())->getCondition(),
+                     Exit == 0);
+      Out << ") {\n";
+      StmtIndent += 2;
+      printStructuredSeq(Test.Arms[1 - Exit]);
+      printStructuredSeq(Body, 2);
+      StmtIndent -= 2;
+      Out.indent(StmtIndent) << "}\n";
+      return;
+    }
+  }
+
+  // do { ... } while (c) if the body ends with the latch test. The PHI copies
+  // of the back edge run before the test, so they must not assign anything
+  // the test reads.
+  unsigned Back;
+  if (isDoWhileLoop(N, Back) &&
+      !copiesClobber(
+          Body.back()->BB, N.BB,
+          cast<BranchInst>(Body.back()->BB->getTerminator())->getCondition())) {
+    StructuredNode &Latch = *Body.back();
+    Out.indent(StmtIndent) << "do {\n";
+    StmtIndent += 2;
+    printStructuredSeq(Body, 0, Body.size() - 1);
+    printPHICopiesForSuccessor(Latch.BB, N.BB, StmtIndent - 2);
+    StmtIndent -= 2;
+    Out.indent(StmtIndent) << "} while (";
+    printCondition(cast<BranchInst>(Latch.BB->getTerminator())->getCondition(),
+                   Back == 1);
+    Out << ");\n";
+    return;
+  }
+
+  Out.indent(StmtIndent) << "for (;;) {\n";
+  StmtIndent += 2;
+  printStructuredSeq(Body);
+  StmtIndent -= 2;
+  Out.indent(StmtIndent) << "}\n";
+}
+
+// isDoWhileLoop - Return true if the loop body ends with an if whose arm Back
+// is the only way back to the header and whose other arm breaks out.
+bool CWriter::isDoWhileLoop(StructuredNode &N, unsigned &Back) const {
+  StructuredNode &Latch = *N.Arms[0].back();
+  if (N.HasContinue || Latch.Kind != StructuredNode::If)
+    return false;
+  for (Back = 0; Back < 2; ++Back) {
+    StructuredSeq &Arm = Latch.Arms[Back];
+    if (Arm.size() == 1 && Arm[0]->Kind == StructuredNode::Edge &&
+        Arm[0]->Jump == StructuredNode::Fallthrough &&
+        Arm[0]->Target == N.BB && isJumpOnly(Latch.Arms[1 - Back], true))
+      return true;
+  }
+  return false;
+}
+
+static const char *getICmpToken(CmpInst::Predicate P) {
+  switch (P) {
+  case ICmpInst::ICMP_EQ:
+    return "==";
+  case ICmpInst::ICMP_NE:
+    return "!=";
+  case ICmpInst::ICMP_ULT:
+  case ICmpInst::ICMP_SLT:
+    return "<";
+  case ICmpInst::ICMP_ULE:
+  case ICmpInst::ICMP_SLE:
+    return "<=";
+  case ICmpInst::ICMP_UGT:
+  case ICmpInst::ICMP_SGT:
+    return ">";
+  case ICmpInst::ICMP_UGE:
+  case ICmpInst::ICMP_SGE:
+    return ">=";
+  default:
+    return nullptr;
+  }
+}
+
+// collectForLoops - Find the rotated loops whose induction variable can be
+// printed as the counter of a for statement. The latch test of such a loop
+// checks the incremented IV, which is the value the for condition sees at
+// the top of the next iteration, so the loop is only converted if
+// ScalarEvolution proves the test also holds on entry.
+void CWriter::collectForLoops(StructuredSeq &Seq) {
+  for (size_t i = 0; i < Seq.size(); ++i) {
+    StructuredNode &N = *Seq[i];
+    for (StructuredSeq &Arm : N.Arms)
+      collectForLoops(Arm);
+
+    unsigned Back;
+    if (N.Kind != StructuredNode::Loop || i == 0 ||
+        Structure->needsLabel(N.BB) || !isDoWhileLoop(N, Back))
+      continue;
+
+    // The init expression is printed in place of the preheader copy, so the
+    // loop has to follow that edge directly.
+    Loop *L = LI->getLoopFor(N.BB);
+    StructuredNode &Entry = *Seq[i - 1];
+    if (Entry.Kind != StructuredNode::Edge ||
+        Entry.Jump != StructuredNode::Inline ||
+        Entry.BB != L->getLoopPreheader())
+      continue;
+
+    PHINode *IV = L->getInductionVariable(*SE);
+    Optional<Loop::LoopBounds> Bounds = L->getBounds(*SE);
+    ICmpInst *Cmp = L->getLatchCmpInst();
+    if (!IV || !Bounds || !Cmp || !Cmp->hasOneUse())
+      continue;
+
+    IntegerType *Ty = cast<IntegerType>(IV->getType());
+    unsigned BitWidth = Ty->getBitWidth();
+    if (BitWidth < 8 || BitWidth > 64 || !isPowerOf2_32(BitWidth))
+      continue;
+
+    BinaryOperator *StepInst = dyn_cast<BinaryOperator>(&Bounds->getStepInst());
+    if (!StepInst ||
+        (Cmp->getOperand(0) != StepInst && Cmp->getOperand(1) != StepInst))
+      continue;
+    Value *Step = nullptr;
+    if (StepInst->getOperand(0) == IV &&
+        (StepInst->getOpcode() == Instruction::Add ||
+         StepInst->getOpcode() == Instruction::Sub))
+      Step = StepInst->getOperand(1);
+    else if (StepInst->getOperand(1) == IV &&
+             StepInst->getOpcode() == Instruction::Add)
+      Step = StepInst->getOperand(0);
+    if (!Step || !L->isLoopInvariant(Step))
+      continue;
+
+    ForLoop FL = {IV, StepInst, &Bounds->getInitialIVValue(),
+                  &Bounds->getFinalIVValue(), Step,
+                  Bounds->getCanonicalPredicate()};
+    if (!getICmpToken(FL.Pred) || !L->isLoopInvariant(FL.Final) ||
+        !SE->isLoopEntryGuardedByCond(L, FL.Pred, SE->getSCEV(FL.Init),
+                                      SE->getSCEV(FL.Final)))
+      continue;
+
+    // After the loop the counter holds the first failing value instead of
+    // the last one, so it must not be used outside.
+    if (any_of(IV->users(), [&](User *U) {
+          return !L->contains(cast<Instruction>(U));
+        }))
+      continue;
+
+    ForLoops[N.BB] = FL;
+    ForLoopInsts.insert(IV);
+    if (all_of(StepInst->users(),
+               [&](User *U) { return U == IV || U == Cmp; }))
+      ForLoopInsts.insert(StepInst);
+  }
+}
+
+void CWriter::printForLoop(StructuredNode &N, const ForLoop &FL) {
+  StructuredSeq &Body = N.Arms[0];
+  StructuredNode &Latch = *Body.back();
+  std::string IVName = GetValueName(FL.IV).str();
+
+  auto printBound = [&](Value *V) {
+    if (ICmpInst::isSigned(FL.Pred)) {
+      Out << "(";
+      printTypeName(Out, V->getType(), true);
+      Out << ")";
+    }
+    writeOperand(V);
+  };
+
+  Out.indent(StmtIndent) << "for (" << IVName << " = ";
+  writeOperand(FL.Init);
+  Out << "; ";
+  printBound(FL.IV);
+  Out << " " << getICmpToken(FL.Pred) << " ";
+  printBound(FL.Final);
+  Out << "; " << IVName
+      << (FL.StepInst->getOpcode() == Instruction::Sub ? " -= " : " += ");
+  writeOperand(FL.Step);
+  Out << ") {\n";
+
+  StmtIndent += 2;
+  printStructuredSeq(Body, 0, Body.size() - 1);
+  printPHICopiesForSuccessor(Latch.BB, N.BB, StmtIndent - 2);
+  StmtIndent -= 2;
+  Out.indent(StmtIndent) << "}\n";
+}
+
+bool CWriter::hasPHICopies(BasicBlock *From, BasicBlock *To) const {
+  for (PHINode &PN : To->phis())
+    if (isPHICopyNeeded(&PN, From))
+      return true;
+  return false;
+}
+
+bool CWriter::isEmptyBlockBody(BasicBlock *BB) const {
+  for (BasicBlock::iterator II = BB->begin(), E = --BB->end(); II != E; ++II)
+    if (!isa<PHINode>(*II) && !isInstIgnored(*II) && !isInlinableInst(*II) &&
+        !isDirectAlloca(&*II) && !ForLoopInsts.count(&*II))
+      return false;
+  return true;
+}
+
+// isEmptyNode - Return true if printing the node would output nothing.
+bool CWriter::isEmptyNode(StructuredNode &N) const {
+  switch (N.Kind) {
+  case StructuredNode::Block:
+    return isEmptyBlockBody(N.BB) &&
+           (!Structure->needsLabel(N.BB) || LI->isLoopHeader(N.BB));
+  case StructuredNode::Edge:
+    return (N.Jump == StructuredNode::Inline ||
+            N.Jump == StructuredNode::Fallthrough) &&
+           !hasPHICopies(N.BB, N.Target);
+  default:
+    return false;
+  }
+}
+
+bool CWriter::isEmptySeq(StructuredSeq &Seq) const {
+  for (auto &N : Seq)
+    if (!isEmptyNode(*N))
+      return false;
+  return true;
+}
+
+// isJumpOnly - Return true if the sequence is a single break, continue or
+// goto without PHI copies.
+bool CWriter::isJumpOnly(StructuredSeq &Seq, bool BreakOnly) const {
+  if (Seq.size() != 1 || Seq[0]->Kind != StructuredNode::Edge)
+    return false;
+  StructuredNode &N = *Seq[0];
+  if (hasPHICopies(N.BB, N.Target))
+    return false;
+  if (BreakOnly)
+    return N.Jump == StructuredNode::Break;
+  return N.Jump == StructuredNode::Break ||
+         N.Jump == StructuredNode::Continue || N.Jump == StructuredNode::Goto;
+}
+
+void CWriter::printBasicBlock(BasicBlock *BB) {
+
+  // Don't print the label for the basic block if there are no uses, or if
+  // the only terminator use is the predecessor basic block's terminator.
+  // We have to scan the use list because PHI nodes use basic blocks too but
+  // do not require a label to be generated.
+  bool NeedsLabel = false;
+  for (pred_iterator PI = pred_begin(BB), E = pred_end(BB); PI != E; ++PI)
+    if (isGotoCodeNecessary(*PI, BB)) {
+      NeedsLabel = true;
+      break;
+    }
 
   if (NeedsLabel)
     Out << GetValueName(BB) << ":\n";
 
-  // Output all of the instructions in the basic block...
-  for (BasicBlock::iterator II = BB->begin(), E = --BB->end(); II != E; ++II) {
+  printBasicBlockBody(BB);
+
+  // Don't emit prefix or suffix for the terminator.
+  visit(*BB->getTerminator());
+}
+
+// printBasicBlockBody - Output all of the instructions in the basic block
+// except the terminator.
+void CWriter::printBasicBlockBody(BasicBlock *BB) {
+  for (BasicBlock::iterator II = BB->begin(), E = --BB->end();
+       II != E && !hasFailed(); ++II) {
     DILocation *Loc = (*II).getDebugLoc();
     if (Loc != nullptr && LastAnnotatedSourceLine != Loc->getLine()) {
       Out << "#line " << Loc->getLine() << " \"" << Loc->getDirectory() << "/" << Loc->getFilename() << "\"" << "\n";
       LastAnnotatedSourceLine = Loc->getLine();
     }
-    if (!isInstIgnored(*II) && !isInlinableInst(*II) && !isDirectAlloca(&*II)) {
+    // PHI nodes are assigned by the copies on the incoming edges.
+    if (!isa<PHINode>(*II) && !isInstIgnored(*II) && !isInlinableInst(*II) &&
+        !isDirectAlloca(&*II) && !ForLoopInsts.count(&*II)) {
+      printAtomicFence(*II, /*Before=*/true);
       if (!isEmptyType(II->getType()))
         outputLValue(&*II);
       else
-        Out << "  ";
+        Out.indent(StmtIndent);
       writeInstComputationInline(*II);
       Out << ";\n";
+      printAtomicFence(*II, /*Before=*/false);
     }
   }
-
-  // Don't emit prefix or suffix for the terminator.
-  visit(*BB->getTerminator());
 }
 
 // Specific Instruction type classes... note that all of the casts are
@@ -2425,19 +3655,20 @@ void CWriter::visitReturnInst(ReturnInst &I) {
   // If this is a struct return function, return the temporary struct.
   Function *F = I.getParent()->getParent();
   if (F->hasStructRetAttr()) {
-    Out << "  return " << GetValueName(F->arg_begin()) << "_sret;\n";
+    Out.indent(StmtIndent)
+        << "return " << GetValueName(F->arg_begin()) << "_sret;\n";
     return;
   }
 
   // Don't output a void return if this is the last basic block in the function
   // unless that would make the basic block empty
-  if (I.getNumOperands() == 0 &&
+  if (!Structure && I.getNumOperands() == 0 &&
       &*--I.getParent()->getParent()->end() == I.getParent() &&
       &*I.getParent()->begin() != &I) {
     return;
   }
 
-  Out << "  return";
+  Out.indent(StmtIndent) << "return";
   if (I.getNumOperands()) {
     Out << ' ';
     writeOperand(I.getOperand(0));
@@ -2516,20 +3747,100 @@ bool CWriter::isGotoCodeNecessary(BasicBlock *From, BasicBlock *To) {
   return false;
 }
 
+// isPHICopyNeeded - Return true if the variable of PN has to be assigned on
+// the edge from the block From.
+bool CWriter::isPHICopyNeeded(PHINode *PN, BasicBlock *From) const {
+  if (ForLoopInsts.count(PN))
+    return false;
+  Value *IV = PN->getIncomingValueForBlock(From);
+  return !isa<UndefValue>(IV) && !isEmptyType(IV->getType()) &&
+         getVarLeader(IV) != getVarLeader(PN);
+}
+
+// collectReadVars - Collect the variables read by printing the operand V.
+void CWriter::collectReadVars(Value *V, SmallPtrSetImpl<Value *> &Vars) const {
+  if (Instruction *I = dyn_cast<Instruction>(V)) {
+    if (isInlinableInst(*I) && !isDirectAlloca(I)) {
+      for (Value *Op : I->operands())
+        collectReadVars(Op, Vars);
+      return;
+    }
+    Vars.insert(getVarLeader(I));
+  } else if (isa<Argument>(V)) {
+    Vars.insert(V);
+  }
+}
+
+// copiesClobber - Return true if the PHI copies on the edge From -> To assign
+// a variable read by printing V.
+bool CWriter::copiesClobber(BasicBlock *From, BasicBlock *To, Value *V) const {
+  SmallPtrSet<Value *, 8> Reads;
+  collectReadVars(V, Reads);
+  for (PHINode &PN : To->phis())
+    if (isPHICopyNeeded(&PN, From) && Reads.count(getVarLeader(&PN)))
+      return true;
+  return false;
+}
+
+// printPHICopiesForSuccessor - Assign the incoming values of the PHI nodes of
+// Successor. The copies are parallel: a copy waits while another one still
+// reads its variable, and a cycle is broken by saving one value to a
+// temporary.
 void CWriter::printPHICopiesForSuccessor(BasicBlock *CurBlock,
                                          BasicBlock *Successor,
                                          unsigned Indent) {
-  for (BasicBlock::iterator I = Successor->begin(); isa<PHINode>(I); ++I) {
-    PHINode *PN = cast<PHINode>(I);
-    // Now we have to do the printing.
-    Value *IV = PN->getIncomingValueForBlock(CurBlock);
-    if (!isa<UndefValue>(IV) && !isEmptyType(IV->getType())) {
-      Out << std::string(Indent, ' ');
-      Out << "  " << GetValueName(&*I) << "_phi = ";
-      writeOperand(IV);
-      Out << ";   /* for PHI node */\n";
+  struct PHICopy {
+    PHINode *PN;
+    Value *Src;
+    SmallPtrSet<Value *, 4> Reads;
+    bool Saved;
+  };
+  std::vector<PHICopy> Copies;
+  for (PHINode &PN : Successor->phis()) {
+    if (!isPHICopyNeeded(&PN, CurBlock))
+      continue;
+    Copies.push_back({&PN, PN.getIncomingValueForBlock(CurBlock), {}, false});
+    collectReadVars(Copies.back().Src, Copies.back().Reads);
+  }
+
+  Indent += 2;
+  bool Braced = false;
+  while (!Copies.empty()) {
+    auto Ready = find_if(Copies, [&](PHICopy &C) {
+      Value *Dst = getVarLeader(C.PN);
+      return none_of(Copies, [&](PHICopy &Other) {
+        return &Other != &C && Other.Reads.count(Dst);
+      });
+    });
+
+    if (Ready == Copies.end()) {
+      PHICopy &C =
+          *find_if(Copies, [](PHICopy &C) { return !C.Saved; });
+      if (!Braced) {
+        Out.indent(Indent) << "{\n";
+        Indent += 2;
+        Braced = true;
+      }
+      Out.indent(Indent);
+      printTypeName(Out, C.PN->getType(), false)
+          << ' ' << GetValueName(C.PN) << "_tmp = ";
+      writeOperand(C.Src);
+      Out << ";\n";
+      C.Saved = true;
+      C.Reads.clear();
+      continue;
     }
+
+    Out.indent(Indent) << GetValueName(Ready->PN) << " = ";
+    if (Ready->Saved)
+      Out << GetValueName(Ready->PN) << "_tmp";
+    else
+      writeOperand(Ready->Src);
+    Out << ";\n";
+    Copies.erase(Ready);
   }
+  if (Braced)
+    Out.indent(Indent - 2) << "}\n";
 }
 
 void CWriter::printBranchToBlock(BasicBlock *CurBB, BasicBlock *Succ,
@@ -2578,32 +3889,25 @@ void CWriter::visitBranchInst(BranchInst &I) {
   Out << "\n";
 }
 
-// PHI nodes get copied into temporary values at the end of predecessor basic
-// blocks.  We now need to copy these temporary values into the REAL value for
-// the PHI.
-void CWriter::visitPHINode(PHINode &I) {
-  CurInstr = &I;
-
-  writeOperand(&I);
-  Out << "_phi";
-}
-
 void CWriter::visitUnaryOperator(UnaryOperator &I) {
   CurInstr = &I;
   Type *Ty = I.getOperand(0)->getType();
   unsigned opcode = I.getOpcode();
   switch (opcode) {
   case Instruction::FNeg:
+    if (isNativeOperator(opcode, Ty)) {
+      printNativeOperator(opcode, Ty, I.getOperand(0));
+      break;
+    }
     Out << "llvm_neg_";
     printTypeString(Out, Ty);
     Out << "(";
     writeOperand(I.getOperand(0));
     Out << ")";
-    InlineOpDeclTypes.insert(std::pair<unsigned, Type *>(opcode, Ty));
+    Decls.InlineOpDeclTypes.insert(std::pair<unsigned, Type *>(opcode, Ty));
     break;
   default:
-    errs() << "Unknown unary operator: " << I << "\n";
-    errorWithMessage("Unknown unary operator");
+    errorWithMessage("Unknown unary operator", &I);
   }
 }
 
@@ -2619,12 +3923,20 @@ void CWriter::visitBinaryOperator(BinaryOperator &I) {
   unsigned opcode;
   Value *X;
   if (match(&I, m_Neg(m_Value(X)))) {
+    if (isNativeOperator(BinaryNeg, Ty)) {
+      printNativeOperator(BinaryNeg, Ty, X);
+      return;
+    }
     opcode = BinaryNeg;
     Out << "llvm_neg_";
     printTypeString(Out, Ty);
     Out << "(";
     writeOperand(X);
   } else if (match(&I, m_Not(m_Value(X)))) {
+    if (isNativeOperator(BinaryNot, Ty)) {
+      printNativeOperator(BinaryNot, Ty, X);
+      return;
+    }
     opcode = BinaryNot;
     Out << "llvm_not_";
     printTypeString(Out, Ty);
@@ -2632,6 +3944,10 @@ void CWriter::visitBinaryOperator(BinaryOperator &I) {
     writeOperand(X);
   } else {
     opcode = I.getOpcode();
+    if (isNativeOperator(opcode, Ty)) {
+      printNativeOperator(opcode, Ty, I.getOperand(0), I.getOperand(1));
+      return;
+    }
     Out << "llvm_" << Instruction::getOpcodeName(opcode) << "_";
     printTypeString(Out, Ty);
     Out << "(";
@@ -2640,7 +3956,75 @@ void CWriter::visitBinaryOperator(BinaryOperator &I) {
     writeOperand(I.getOperand(1));
   }
   Out << ")";
-  InlineOpDeclTypes.insert(std::pair<unsigned, Type *>(opcode, Ty));
+  Decls.InlineOpDeclTypes.insert(std::pair<unsigned, Type *>(opcode, Ty));
+}
+
+// isNativeOperator - Return true if the operation can be printed as a plain
+// C infix expression.  Helpers are still needed for integers of odd width
+// (they have to be re-padded after every operation) and for the signed
+// operations, because integer values are always stored as unsigned types.
+bool CWriter::isNativeOperator(unsigned Opcode, Type *Ty) const {
+  if (!NativeOperators)
+    return false;
+
+  Type *ElTy = Ty->getScalarType();
+  if (ElTy->isFloatTy() || ElTy->isDoubleTy())
+    return true;
+
+  IntegerType *ITy = dyn_cast<IntegerType>(ElTy);
+  if (!ITy || !ITy->isPowerOf2ByteWidth())
+    return false;
+
+  switch (Opcode) {
+  case Instruction::AShr:
+  case Instruction::SDiv:
+  case Instruction::SRem:
+    return false;
+  default:
+    return getOperatorToken(Opcode) != nullptr || Opcode == BinaryNeg ||
+           Opcode == BinaryNot;
+  }
+}
+
+// printNativeOperator - Print the operation as a C expression.  Scalar
+// integers narrower than int are promoted by C, so the result is cast back to
+// the operand type to keep the wrap-around behaviour of LLVM.
+void CWriter::printNativeOperator(unsigned Opcode, Type *Ty, Value *A,
+                                  Value *B) {
+  bool isPromoted = Ty->isIntegerTy() && Ty->getIntegerBitWidth() < 32;
+  if (isPromoted) {
+    Out << "(";
+    printTypeName(Out, Ty);
+    Out << ")(";
+  }
+
+  switch (Opcode) {
+  case BinaryNeg:
+  case Instruction::FNeg:
+    Out << "-";
+    writeOperand(A);
+    break;
+  case BinaryNot:
+    Out << "~";
+    writeOperand(A);
+    break;
+  case Instruction::FRem:
+    Out << "fmod(";
+    writeOperand(A);
+    Out << ", ";
+    writeOperand(B);
+    Out << ")";
+    break;
+  default:
+    cwriter_assert(B);
+    writeOperand(A);
+    Out << " " << getOperatorToken(Opcode) << " ";
+    writeOperand(B);
+    break;
+  }
+
+  if (isPromoted)
+    Out << ")";
 }
 
 void CWriter::visitICmpInst(ICmpInst &I) {
@@ -2654,11 +4038,11 @@ void CWriter::visitICmpInst(ICmpInst &I) {
   writeOperand(I.getOperand(1));
   Out << ")";
 
-  CmpDeclTypes.insert(
+  Decls.CmpDeclTypes.insert(
       std::pair<CmpInst::Predicate, Type *>(I.getPredicate(), I.getOperand(0)->getType()));
 
   if (VectorType *VTy = dyn_cast<VectorType>(I.getOperand(0)->getType())) {
-    TypedefDeclTypes.insert(
+    Decls.TypedefDeclTypes.insert(
         I.getType()); // insert type not necessarily visible above
   }
 }
@@ -2674,11 +4058,11 @@ void CWriter::visitFCmpInst(FCmpInst &I) {
   writeOperand(I.getOperand(1));
   Out << ")";
 
-  CmpDeclTypes.insert(
+  Decls.CmpDeclTypes.insert(
       std::pair<CmpInst::Predicate, Type *>(I.getPredicate(), I.getOperand(0)->getType()));
 
   if (VectorType *VTy = dyn_cast<VectorType>(I.getOperand(0)->getType())) {
-    TypedefDeclTypes.insert(
+    Decls.TypedefDeclTypes.insert(
         I.getType()); // insert type not necessarily visible above
   }
 }
@@ -2696,7 +4080,7 @@ void CWriter::visitCastInst(CastInst &I) {
   Out << "(";
   writeOperand(I.getOperand(0));
   Out << ")";
-  CastOpDeclTypes.insert(
+  Decls.CastOpDeclTypes.insert(
       std::pair<Instruction::CastOps, std::pair<Type *, Type *>>(
           I.getOpcode(), std::pair<Type *, Type *>(SrcTy, DstTy)));
 }
@@ -2719,13 +4103,16 @@ void CWriter::visitSelectInst(SelectInst &I) {
   Out << ", ";
   writeOperand(I.getFalseValue());
   Out << ")";
-  SelectDeclTypes.insert(std::make_pair(
+  Decls.SelectDeclTypes.insert(std::make_pair(
     I.getCondition()->getType(),
     I.getType()
   ));
 }
 
 bool CWriter::isInstIgnored(Instruction &I) const {
+  // Nothing to order between the work-item and itself.
+  if (FenceInst *FI = dyn_cast<FenceInst>(&I))
+    return FI->getSyncScopeID() == SyncScope::SingleThread;
   if (CallInst *CI = dyn_cast<CallInst>(&I)) {
     if (Function *F = CI->getCalledFunction()) {
       if (F->isIntrinsic() && isIntrinsicIgnored(F->getIntrinsicID())) {
@@ -2748,28 +4135,87 @@ bool CWriter::isIntrinsicIgnored(unsigned ID) const {
 }
 
 void CWriter::printIntrinsicDefinition(FunctionType *funT, unsigned Opcode,
-                                       std::string OpName, raw_ostream &Out) {
+                                       std::string OpName, raw_ostream &Out,
+                                       const CLIntrinsicSite &Site) {
   const CLIntrinsic *intr = intrinsics.get(Opcode);
   if (intr) {
     intr->printDefinition(
       Out, funT, OpName,
       [this](raw_ostream &Out, Type *Ty, bool isSigned) {
         printTypeName(Out, Ty, isSigned);
-      }
+      },
+      Site
     );
   } else {
-    errs() << "Unsupported Intrinsic: " << Opcode << "\n";
-    errorWithMessage("unsupported instrinsic");
+    errorWithMessage("unsupported instrinsic " + utostr(Opcode));
   }
 }
 
 void CWriter::printIntrinsicDefinition(Function &F, raw_ostream &Out) {
   FunctionType *funT = F.getFunctionType();
   unsigned Opcode = F.getIntrinsicID();
-  std::string OpName = GetValueName(&F);
+  std::string OpName = GetValueName(&F).str();
   printIntrinsicDefinition(funT, Opcode, OpName, Out);
 }
 
+// stripInlinedBitCasts - Look through the bitcasts that are printed inline
+// with their user. A bitcast instruction with its own variable is kept, so
+// that the variable is read where its value is live.
+Value *CWriter::stripInlinedBitCasts(Value *V) const {
+  while (BitCastOperator *BC = dyn_cast<BitCastOperator>(V)) {
+    if (BitCastInst *BI = dyn_cast<BitCastInst>(V))
+      if (!isInlinableInst(*BI))
+        break;
+    V = BC->getOperand(0);
+  }
+  return V;
+}
+
+// getAggregateCopyType - Return the struct or array type if I copies exactly
+// one aggregate of this type from a pointer to it to another, so the copy can
+// be printed as an assignment. Clang emits such a memcpy for every struct
+// copy.
+Type *CWriter::getAggregateCopyType(MemCpyInst &I) {
+  ConstantInt *Len = dyn_cast<ConstantInt>(I.getLength());
+  if (!Len || I.isVolatile())
+    return nullptr;
+
+  Type *DstTy = stripInlinedBitCasts(I.getRawDest())->getType();
+  Type *SrcTy = stripInlinedBitCasts(I.getRawSource())->getType();
+  Type *Ty = DstTy->getPointerElementType();
+  if (SrcTy->getPointerElementType() != Ty ||
+      !(Ty->isStructTy() || Ty->isArrayTy()) || !Ty->isSized() ||
+      isEmptyType(Ty) || TD->getTypeAllocSize(Ty) != Len->getZExtValue())
+    return nullptr;
+
+  // The typed access must not claim more alignment than the memcpy has.
+  unsigned Align = TD->getABITypeAlignment(Ty);
+  if (std::max(I.getDestAlignment(), 1u) < Align ||
+      std::max(I.getSourceAlignment(), 1u) < Align)
+    return nullptr;
+  return Ty;
+}
+
+// getMemIntrinsicName - Return the name of the definition of MI specialized
+// for its constant length and the alignment of its pointer operands.
+std::string CWriter::getMemIntrinsicName(MemIntrinsic &MI) {
+  CLIntrinsicSite Site;
+  if (ConstantInt *Len = dyn_cast<ConstantInt>(MI.getLength()))
+    Site.Length = Len->getZExtValue();
+  unsigned Align = std::max(MI.getDestAlignment(), 1u);
+  if (MemTransferInst *MTI = dyn_cast<MemTransferInst>(&MI))
+    Align = std::min(Align, std::max(MTI->getSourceAlignment(), 1u));
+  Site.Align = std::min(Align, 16u);
+
+  Function *F = MI.getCalledFunction();
+  std::string Name = GetValueName(F).str();
+  if (Site.Length)
+    Name += "_" + utostr(Site.Length);
+  Name += "_a" + utostr(Site.Align);
+  Decls.MemIntrinsicDecls[Name] = std::make_pair(F, Site);
+  return Name;
+}
+
 bool CWriter::lowerIntrinsics(Function &F) {
   bool LoweredAny = false;
 
@@ -2782,7 +4228,7 @@ bool CWriter::lowerIntrinsics(Function &F) {
           if (
             F->isIntrinsic() &&
             !isIntrinsicIgnored(F->getIntrinsicID()) &&
-            !intrinsics.hasImpl(F->getIntrinsicID())
+            !intrinsics.hasImpl(F->getIntrinsicID(), F->getFunctionType())
           ) {
             // All other intrinsic calls we must lower.
             LoweredAny = true;
@@ -2827,6 +4273,12 @@ void CWriter::visitCallInst(CallInst &I) {
     auto ID = F->getIntrinsicID();
     if (ID != Intrinsic::not_intrinsic && visitBuiltinCall(I, ID))
       return;
+
+    const BuiltInResolution &R = resolveBuiltIn(F);
+    if (R.Kind == 1 && isDirectBuiltIn(F, R.func)) {
+      printDirectBuiltInCall(I, R.func);
+      return;
+    }
   }
 
   Value *Callee = I.getCalledValue();
@@ -2834,6 +4286,18 @@ void CWriter::visitCallInst(CallInst &I) {
   PointerType *PTy = cast<PointerType>(Callee->getType());
   FunctionType *FTy = cast<FunctionType>(PTy->getElementType());
 
+  // A memcpy of a whole struct or array is printed as an assignment.
+  if (MemCpyInst *MCI = dyn_cast<MemCpyInst>(&I)) {
+    if (Type *Ty = getAggregateCopyType(*MCI)) {
+      writeMemoryAccess(stripInlinedBitCasts(MCI->getRawDest()), Ty, false,
+                        0);
+      Out << " = ";
+      writeMemoryAccess(stripInlinedBitCasts(MCI->getRawSource()), Ty, false,
+                        0);
+      return;
+    }
+  }
+
   // If this is a call to a struct-return function, assign to the first
   // parameter instead of passing it to the call.
   const AttributeList &PAL = I.getAttributes();
@@ -2846,7 +4310,10 @@ void CWriter::visitCallInst(CallInst &I) {
   if (I.isTailCall())
     Out << " /*tail*/ ";
 
-  writeOperand(Callee);
+  if (MemIntrinsic *MI = dyn_cast<MemIntrinsic>(&I))
+    Out << getMemIntrinsicName(*MI);
+  else
+    writeOperand(Callee);
 
   Out << '(';
 
@@ -2883,9 +4350,89 @@ void CWriter::visitCallInst(CallInst &I) {
       writeOperand(*AI);
     PrintedArg = true;
   }
+  if (Function *F = I.getCalledFunction()) {
+    for (GlobalVariable *GV : getLocalParams(F)) {
+      if (PrintedArg)
+        Out << ", ";
+      writeOperand(GV);
+      PrintedArg = true;
+    }
+  }
   Out << ')';
 }
 
+// isSameBuiltInPointer - Return true if a pointer printed as TyName can be
+// passed as the built-in parameter Name without a cast. Unqualified pointers
+// in a built-in signature are private ones, and a pointer converts implicitly
+// to a pointer to const or volatile.
+static bool isSameBuiltInPointer(std::string TyName, std::string Name) {
+  replace(Name, " const", "");
+  replace(Name, " volatile", "");
+  replace(TyName, " __private", "");
+  replace(Name, " __private", "");
+  return TyName == Name;
+}
+
+// isDirectBuiltIn - Return true if calls to the OpenCL built-in F can name
+// the built-in itself instead of a generated wrapper. Scalars and pointers
+// are converted with a C cast at the call site, so only vector types have to
+// match the OpenCL signature.
+bool CWriter::isDirectBuiltIn(Function *F, const Func &func) {
+  if (builtins.isCommon(func) || F->hasAddressTaken() ||
+      F->arg_size() != func.args.size())
+    return false;
+
+  auto Matches = [this](Type *Ty, const std::string &Name) {
+    if (!Ty->isVectorTy())
+      return true;
+    std::string TyName;
+    raw_string_ostream TyOut(TyName);
+    printTypeName(TyOut, Ty, false);
+    return TyOut.str() == Name;
+  };
+
+  if (!Matches(F->getReturnType(), func.ret))
+    return false;
+  unsigned i = 0;
+  for (Argument &A : F->args())
+    if (!Matches(A.getType(), func.args[i++]))
+      return false;
+  return true;
+}
+
+// printDirectBuiltInCall - Print a call to an OpenCL built-in accepted by
+// isDirectBuiltIn, casting scalar and pointer operands whose C type differs
+// from the signature (e.g. the signed arguments of abs or atomic_add).
+void CWriter::printDirectBuiltInCall(CallInst &I, const Func &func) {
+  auto TypeName = [this](Type *Ty) {
+    std::string Name;
+    raw_string_ostream NameOut(Name);
+    printTypeName(NameOut, Ty, false);
+    return NameOut.str();
+  };
+
+  Type *RetTy = I.getType();
+  bool RetCast = !RetTy->isVoidTy() && TypeName(RetTy) != func.ret;
+  if (RetCast)
+    Out << "(" << TypeName(RetTy) << ")(";
+  Out << func.name << "(";
+  for (unsigned i = 0, e = I.arg_size(); i != e; ++i) {
+    if (i > 0)
+      Out << ", ";
+    Value *Arg = I.getArgOperand(i);
+    Type *ArgTy = Arg->getType();
+    bool Cast = ArgTy->isPointerTy()
+                    ? !isSameBuiltInPointer(TypeName(ArgTy), func.args[i])
+                    : !ArgTy->isVectorTy() && TypeName(ArgTy) != func.args[i];
+    if (Cast)
+      Out << "(" << func.args[i] << ")";
+    writeOperand(Arg);
+  }
+  Out << ")";
+  if (RetCast)
+    Out << ")";
+}
+
 /// visitBuiltinCall - Handle the call to the specified builtin.  Returns true
 /// if the entire call is handled, return false if it wasn't handled
 bool CWriter::visitBuiltinCall(CallInst &I, Intrinsic::ID ID) {
@@ -2893,63 +4440,82 @@ bool CWriter::visitBuiltinCall(CallInst &I, Intrinsic::ID ID) {
 
   if (isIntrinsicIgnored(ID)) {
     return true;
-  } else if (intrinsics.hasImpl(ID)) {
+  } else if (intrinsics.hasImpl(ID, I.getFunctionType())) {
     return false;
   } else {
-    errs() << "Unsupported LLVM intrinsic: " << I << "\n";
-    errorWithMessage("Unsupported llvm intrinsic");
+    errorWithMessage("Unsupported llvm intrinsic", &I);
+    return true;
   }
 }
 
-// TODO_: Simplify expressions in cases of zero indices
+// printGEPExpression - Print the address computed by a GEP as the address of
+// a single access path, e.g. `(&p[i].f2.a[j])`.
 void CWriter::printGEPExpression(Value *Ptr, gep_type_iterator I,
                                  gep_type_iterator E) {
-  Out.flush();
-  OutModifier mod(_Out); // writeOperand always print to Out
-  // We use this workaround to extract written data from Out
-
-  Type *IntoT = I.getIndexedType();
-  Out << "(";
-  writeOperand(Ptr);
-  if (I != E) {
-    Out << " + ";
-    writeOperandWithCast(I.getOperand(), Instruction::GetElementPtr);
-    ++I;
+  if (I == E) {
+    writeOperand(Ptr);
+    return;
   }
-  Out << ")";
 
-  for (; I != E; ++I) {
+  // The type indexed by each operand after the first one.
+  Value *FirstIdx = I.getOperand();
+  Type *IntoT = I.getIndexedType();
+  SmallVector<std::pair<Type *, Value *>, 4> Levels;
+  for (++I; I != E; ++I) {
     cwriter_assert(I.getOperand()->getType()->isIntegerTy());
     // TODO: indexing a Vector with a Vector is valid,
     // but we don't support it here
+    Levels.push_back(std::make_pair(IntoT, I.getOperand()));
+    IntoT = I.getIndexedType();
+  }
 
-    Out.flush();
-    std::string prev = mod.cut_tail(); // Extract Out changes
-
-    if (IntoT->isStructTy()) {
-      Out << "(&" << prev << "->f"
-          << cast<ConstantInt>(I.getOperand())->getZExtValue()
-          << ")";
-    } else if (IntoT->isArrayTy()) {
-      Out << "(&" << prev << "->a[";
-      writeOperandWithCast(I.getOperand(), Instruction::GetElementPtr);
-      Out << "])";
-    } else if (IntoT->isVectorTy()) {
-      Out << "(&((";
-      printTypeName(Out, 
-        IntoT->getVectorElementType()->getPointerTo(
-          Ptr->getType()->getPointerAddressSpace()));
-      Out << ")" << prev << ")[";
-      writeOperandWithCast(I.getOperand(), Instruction::GetElementPtr);
-      Out << "])";
-    } else {
-      Out << "(&" << prev << "[";
-      writeOperandWithCast(I.getOperand(), Instruction::GetElementPtr);
-      Out << "])";
+  Out << "(&";
+  // The address of a vector element cannot be taken, so vectors are indexed
+  // through a pointer to their element type wrapping the path before them.
+  unsigned AS = Ptr->getType()->getPointerAddressSpace();
+  for (auto L = Levels.rbegin(), LE = Levels.rend(); L != LE; ++L) {
+    if (L->first->isVectorTy()) {
+      Type *EltPtrTy;
+      {
+        auto Lock = lockShared();
+        EltPtrTy = L->first->getVectorElementType()->getPointerTo(AS);
+      }
+      Out << "((";
+      printTypeName(Out, EltPtrTy);
+      Out << ")&";
     }
+  }
 
-    IntoT = I.getIndexedType();
+  ConstantInt *FirstCI = dyn_cast<ConstantInt>(FirstIdx);
+  if (isAddressExposed(Ptr) && FirstCI && FirstCI->isZero()) {
+    // `x` rather than `(&x)[0]`
+    writeOperandInternal(Ptr);
+  } else {
+    bool IsConstant = isa<Constant>(Ptr) && !isa<GlobalValue>(Ptr);
+    if (IsConstant)
+      Out << "(";
+    writeOperand(Ptr);
+    if (IsConstant)
+      Out << ")";
+    Out << "[";
+    writeOperandWithCast(FirstIdx, Instruction::GetElementPtr);
+    Out << "]";
+  }
+
+  for (auto &L : Levels) {
+    if (L.first->isStructTy()) {
+      Out << ".f" << cast<ConstantInt>(L.second)->getZExtValue();
+      continue;
+    }
+    if (L.first->isArrayTy())
+      Out << ".a";
+    else if (L.first->isVectorTy())
+      Out << ")";
+    Out << "[";
+    writeOperandWithCast(L.second, Instruction::GetElementPtr);
+    Out << "]";
   }
+  Out << ")";
 }
 
 void CWriter::writeMemoryAccess(Value *Operand, Type *OperandType,
@@ -2960,10 +4526,7 @@ void CWriter::writeMemoryAccess(Value *Operand, Type *OperandType,
   }
 
   if (Alignment && Alignment < TD->getABITypeAlignment(OperandType)) {
-    outs() << "Warning: unaligned memory access: " << *CurInstr;
-    outs() << " ; ";
-    CurInstr->getDebugLoc().print(outs());
-    outs() << "\n";
+    warnWithMessage("unaligned memory access");
     //errorWithMessage("Unaligned memory access is restricted");
   }
 
@@ -2979,6 +4542,10 @@ void CWriter::writeMemoryAccess(Value *Operand, Type *OperandType,
 
 void CWriter::visitLoadInst(LoadInst &I) {
   CurInstr = &I;
+  if (I.isAtomic()) {
+    printAtomicLoad(I);
+    return;
+  }
 
   printPadded(Out, I.getType(), [&]() {
     writeMemoryAccess(I.getOperand(0), I.getType(), I.isVolatile(),
@@ -2988,6 +4555,10 @@ void CWriter::visitLoadInst(LoadInst &I) {
 
 void CWriter::visitStoreInst(StoreInst &I) {
   CurInstr = &I;
+  if (I.isAtomic()) {
+    printAtomicStore(I);
+    return;
+  }
 
   writeMemoryAccess(I.getPointerOperand(), I.getOperand(0)->getType(),
                     I.isVolatile(), I.getAlignment());
@@ -2998,6 +4569,330 @@ void CWriter::visitStoreInst(StoreInst &I) {
   });
 }
 
+// getMemoryOrderName - Return the OpenCL 2.0 memory order of an LLVM atomic
+// ordering.
+static const char *getMemoryOrderName(AtomicOrdering Ordering) {
+  switch (Ordering) {
+  case AtomicOrdering::Acquire:
+    return "memory_order_acquire";
+  case AtomicOrdering::Release:
+    return "memory_order_release";
+  case AtomicOrdering::AcquireRelease:
+    return "memory_order_acq_rel";
+  case AtomicOrdering::SequentiallyConsistent:
+    return "memory_order_seq_cst";
+  default:
+    return "memory_order_relaxed";
+  }
+}
+
+// getMemoryScopeName - Return the OpenCL 2.0 memory scope of a sync scope
+// named the way clang names the OpenCL scopes.
+static const char *getMemoryScopeName(LLVMContext &Ctx, SyncScope::ID SSID) {
+  if (SSID == SyncScope::SingleThread)
+    return "memory_scope_work_item";
+  if (SSID != SyncScope::System) {
+    SmallVector<StringRef, 8> Names;
+    Ctx.getSyncScopeNames(Names);
+    StringRef Name = Names[SSID];
+    if (Name == "workgroup")
+      return "memory_scope_work_group";
+    if (Name == "subgroup" || Name == "wavefront")
+      return "memory_scope_sub_group";
+  }
+  // The system scope of languages without scopes is the whole device, the
+  // host never touches kernel buffers concurrently without SVM.
+  return "memory_scope_device";
+}
+
+// getFenceFlags - Return the OpenCL fence flags covering address space AS.
+static const char *getFenceFlags(unsigned AS) {
+  switch (AS) {
+  case 1:
+  case 2:
+    return "CLK_GLOBAL_MEM_FENCE";
+  case 3:
+    return "CLK_LOCAL_MEM_FENCE";
+  default:
+    return "CLK_GLOBAL_MEM_FENCE | CLK_LOCAL_MEM_FENCE";
+  }
+}
+
+// getAtomicIntType - Return the integer type atomic built-ins operate on for
+// values of type Ty, floats are passed by their bits.
+Type *CWriter::getAtomicIntType(Type *Ty) {
+  unsigned Bits = Ty->getPrimitiveSizeInBits();
+  if (!(Ty->isIntegerTy() || Ty->isFloatingPointTy()) ||
+      (Bits != 32 && Bits != 64)) {
+    errorWithMessage("Unsupported atomic type: " + to_string(*Ty));
+    // Go on with some type, nothing is written after an error.
+    Bits = 32;
+  }
+  if (Bits == 64)
+    Decls.UsesInt64Atomics = true;
+  auto Lock = lockShared();
+  return IntegerType::get(Ty->getContext(), Bits);
+}
+
+// getAtomicFunction - Return the name of the read-modify-write built-in Op
+// (add, xchg, min, ...) for IntTy.
+std::string CWriter::getAtomicFunction(StringRef Op, Type *IntTy) {
+  if (ExplicitAtomics) {
+    if (Op == "xchg")
+      return "atomic_exchange_explicit";
+    return ("atomic_fetch_" + Op + "_explicit").str();
+  }
+  bool Is64 = IntTy->getIntegerBitWidth() == 64;
+  return ((Is64 ? "atom_" : "atomic_") + Op).str();
+}
+
+void CWriter::printAtomicPointerType(raw_ostream &Out, Type *Ty, unsigned AS,
+                                     bool isSigned) {
+  Out << "volatile ";
+  if (ExplicitAtomics)
+    Out << "atomic_";
+  printTypeName(Out, Ty, isSigned);
+  printAddressSpace(Out, AS);
+  Out << "*";
+}
+
+// printAtomicPointer - Print Ptr cast to the volatile (OpenCL 1.2) or atomic
+// (OpenCL 2.0) pointer the built-ins take.
+void CWriter::printAtomicPointer(Value *Ptr, Type *Ty, bool isSigned) {
+  Out << "(";
+  printAtomicPointerType(Out, Ty, Ptr->getType()->getPointerAddressSpace(),
+                         isSigned);
+  Out << ")";
+  writeOperand(Ptr);
+}
+
+// checkAtomicAddressSpace - The OpenCL 1.2 atomic built-ins only take
+// __global and __local pointers.
+void CWriter::checkAtomicAddressSpace(Value *Ptr) {
+  unsigned AS = Ptr->getType()->getPointerAddressSpace();
+  if (!ExplicitAtomics && AS != 1 && AS != 3)
+    errorWithMessage("OpenCL 1.2 atomics only operate on __global and "
+                     "__local memory");
+}
+
+void CWriter::printAtomicOrder(Instruction &I, AtomicOrdering Ordering,
+                               SyncScope::ID SSID) {
+  Out << ", " << getMemoryOrderName(Ordering) << ", "
+      << getMemoryScopeName(I.getContext(), SSID);
+}
+
+// printAtomicFence - OpenCL 1.2 atomics are relaxed, so stronger orderings
+// are given by fences printed as statements around the atomic one.
+void CWriter::printAtomicFence(Instruction &I, bool Before) {
+  if (ExplicitAtomics)
+    return;
+
+  AtomicOrdering Ordering;
+  Value *Ptr;
+  if (LoadInst *LI = dyn_cast<LoadInst>(&I)) {
+    Ordering = LI->getOrdering();
+    Ptr = LI->getPointerOperand();
+  } else if (StoreInst *SI = dyn_cast<StoreInst>(&I)) {
+    Ordering = SI->getOrdering();
+    Ptr = SI->getPointerOperand();
+  } else if (AtomicRMWInst *RMWI = dyn_cast<AtomicRMWInst>(&I)) {
+    Ordering = RMWI->getOrdering();
+    Ptr = RMWI->getPointerOperand();
+  } else if (AtomicCmpXchgInst *CXI = dyn_cast<AtomicCmpXchgInst>(&I)) {
+    Ordering = CXI->getSuccessOrdering();
+    Ptr = CXI->getPointerOperand();
+  } else {
+    return;
+  }
+
+  if (Before ? isReleaseOrStronger(Ordering) : isAcquireOrStronger(Ordering))
+    Out.indent(StmtIndent)
+        << "mem_fence("
+        << getFenceFlags(Ptr->getType()->getPointerAddressSpace()) << ");\n";
+}
+
+void CWriter::printAtomicLoad(LoadInst &I) {
+  Type *Ty = I.getType();
+  if (!ExplicitAtomics) {
+    Out << "*";
+    printAtomicPointer(I.getPointerOperand(), Ty, false);
+    return;
+  }
+
+  Type *IntTy = getAtomicIntType(Ty);
+  bool isFP = Ty->isFloatingPointTy();
+  if (isFP) {
+    Out << "as_";
+    printTypeName(Out, Ty);
+    Out << "(";
+  }
+  Out << "atomic_load_explicit(";
+  printAtomicPointer(I.getPointerOperand(), IntTy, false);
+  printAtomicOrder(I, I.getOrdering(), I.getSyncScopeID());
+  Out << ")";
+  if (isFP)
+    Out << ")";
+}
+
+void CWriter::printAtomicStore(StoreInst &I) {
+  Value *Val = I.getValueOperand();
+  Type *Ty = Val->getType();
+  if (!ExplicitAtomics) {
+    Out << "*";
+    printAtomicPointer(I.getPointerOperand(), Ty, false);
+    Out << " = ";
+    writeOperand(Val);
+    return;
+  }
+
+  Type *IntTy = getAtomicIntType(Ty);
+  Out << "atomic_store_explicit(";
+  printAtomicPointer(I.getPointerOperand(), IntTy, false);
+  Out << ", ";
+  if (Ty->isFloatingPointTy()) {
+    Out << "as_";
+    printTypeName(Out, IntTy);
+    Out << "(";
+    writeOperand(Val);
+    Out << ")";
+  } else {
+    writeOperand(Val);
+  }
+  printAtomicOrder(I, I.getOrdering(), I.getSyncScopeID());
+  Out << ")";
+}
+
+void CWriter::visitAtomicRMWInst(AtomicRMWInst &I) {
+  CurInstr = &I;
+
+  Type *Ty = I.getType();
+  Type *IntTy = getAtomicIntType(Ty);
+  Value *Ptr = I.getPointerOperand();
+  checkAtomicAddressSpace(Ptr);
+  bool isSigned = false;
+  const char *Op = nullptr;
+  switch (I.getOperation()) {
+  case AtomicRMWInst::Xchg:
+    Op = "xchg";
+    break;
+  case AtomicRMWInst::Add:
+    Op = "add";
+    break;
+  case AtomicRMWInst::Sub:
+    Op = "sub";
+    break;
+  case AtomicRMWInst::And:
+    Op = "and";
+    break;
+  case AtomicRMWInst::Or:
+    Op = "or";
+    break;
+  case AtomicRMWInst::Xor:
+    Op = "xor";
+    break;
+  case AtomicRMWInst::Max:
+    isSigned = true;
+    LLVM_FALLTHROUGH;
+  case AtomicRMWInst::UMax:
+    Op = "max";
+    break;
+  case AtomicRMWInst::Min:
+    isSigned = true;
+    LLVM_FALLTHROUGH;
+  case AtomicRMWInst::UMin:
+    Op = "min";
+    break;
+  default:
+    break;
+  }
+
+  if (!Op) {
+    // No built-in, retried compare-and-swap defined in the header
+    Decls.AtomicRMWDeclTypes.insert(
+        std::make_pair((unsigned)I.getOperation(), Ptr->getType()));
+    Out << "llvm_atomicrmw_"
+        << AtomicRMWInst::getOperationName(I.getOperation()) << "_";
+    printTypeString(Out, Ptr->getType());
+    Out << "(";
+    printAtomicPointer(Ptr, IntTy, false);
+    Out << ", ";
+    writeOperand(I.getValOperand());
+    if (ExplicitAtomics)
+      printAtomicOrder(I, I.getOrdering(), I.getSyncScopeID());
+    Out << ")";
+    return;
+  }
+
+  bool isFP = Ty->isFloatingPointTy();
+  if (isFP) {
+    Out << "as_";
+    printTypeName(Out, Ty);
+    Out << "(";
+  }
+  Out << getAtomicFunction(Op, IntTy) << "(";
+  printAtomicPointer(Ptr, IntTy, isSigned);
+  Out << ", ";
+  if (isFP) {
+    Out << "as_";
+    printTypeName(Out, IntTy);
+    Out << "(";
+    writeOperand(I.getValOperand());
+    Out << ")";
+  } else {
+    if (isSigned) {
+      Out << "(";
+      printTypeName(Out, IntTy, true);
+      Out << ")";
+    }
+    writeOperand(I.getValOperand());
+  }
+  if (ExplicitAtomics)
+    printAtomicOrder(I, I.getOrdering(), I.getSyncScopeID());
+  Out << ")";
+  if (isFP)
+    Out << ")";
+}
+
+void CWriter::visitAtomicCmpXchgInst(AtomicCmpXchgInst &I) {
+  CurInstr = &I;
+
+  Value *Ptr = I.getPointerOperand();
+  Type *Ty = I.getCompareOperand()->getType();
+  if (!Ty->isIntegerTy()) {
+    errorWithMessage("Unsupported cmpxchg type: " + to_string(*Ty));
+  }
+  getAtomicIntType(Ty);
+  checkAtomicAddressSpace(Ptr);
+  Decls.CmpXchgDeclTypes.insert(std::make_pair(Ptr->getType(), I.getType()));
+
+  Out << "llvm_cmpxchg_";
+  printTypeString(Out, Ptr->getType());
+  Out << "(";
+  printAtomicPointer(Ptr, Ty, false);
+  Out << ", ";
+  writeOperand(I.getCompareOperand());
+  Out << ", ";
+  writeOperand(I.getNewValOperand());
+  if (ExplicitAtomics) {
+    Out << ", " << getMemoryOrderName(I.getSuccessOrdering());
+    printAtomicOrder(I, I.getFailureOrdering(), I.getSyncScopeID());
+  }
+  Out << ")";
+}
+
+void CWriter::visitFenceInst(FenceInst &I) {
+  CurInstr = &I;
+
+  const char *Flags = getFenceFlags(0);
+  if (ExplicitAtomics) {
+    Out << "atomic_work_item_fence(" << Flags;
+    printAtomicOrder(I, I.getOrdering(), I.getSyncScopeID());
+    Out << ")";
+  } else {
+    Out << "mem_fence(" << Flags << ")";
+  }
+}
+
 void CWriter::visitGetElementPtrInst(GetElementPtrInst &I) {
   CurInstr = &I;
 
@@ -3015,20 +4910,15 @@ void CWriter::visitInsertElementInst(InsertElementInst &I) {
     return;
 
   // Then do the insert to update the field.
-  Out << ";\n  ";
+  Out << ";\n";
+  Out.indent(StmtIndent);
   Out << GetValueName(&I) << ".";
-  int index;
-  OutModifier mod(Out.str());
-  writeOperand(I.getOperand(2));
-  Out.str();
-  std::string index_str = mod.cut_tail();
-  std::stringstream ss(index_str);
-  ss >> index;
-  if (!ss.good()) {
-    errs() << "Cannot parse '" << index_str << "' as integer\n";
+  ConstantInt *Index = dyn_cast<ConstantInt>(I.getOperand(2));
+  if (!Index) {
     errorWithMessage("Cannot access vector element by dynamic index");
+    return;
   }
-  printVectorComponent(Out, index);
+  printVectorComponent(Out, Index->getZExtValue());
   Out << " = ";
   writeOperand(I.getOperand(1));
 }
@@ -3045,18 +4935,12 @@ void CWriter::visitExtractElementInst(ExtractElementInst &I) {
     Out << "(";
     writeOperand(I.getOperand(0));
     Out << ").";
-    int index;
-    OutModifier mod(Out.str());
-    writeOperand(I.getOperand(1));
-    Out.str();
-    std::string index_str = mod.cut_tail();
-    std::stringstream ss(index_str);
-    ss >> index;
-    if (!ss.good()) {
-      errs() << "Cannot parse '" << index_str << "' as integer\n";
+    ConstantInt *Index = dyn_cast<ConstantInt>(I.getOperand(1));
+    if (!Index) {
       errorWithMessage("Cannot access vector element by dynamic index");
+      return;
     }
-    printVectorComponent(Out, index);
+    printVectorComponent(Out, Index->getZExtValue());
   }
 }
 
@@ -3072,18 +4956,23 @@ void CWriter::visitShuffleVectorInst(ShuffleVectorInst &SVI) {
   cwriter_assert(!isEmptyType(VT));
   cwriter_assert(InputVT->getElementType() == VT->getElementType());
 
-  CtorDeclTypes.insert(VT);
+  Decls.CtorDeclTypes.insert(VT);
   Out << "llvm_ctor_";
   printTypeString(Out, VT);
   Out << "(";
 
-  Constant *Zero = Constant::getNullValue(EltTy);
+  Constant *Zero = getNullValue(EltTy);
   unsigned NumElts = VT->getNumElements();
   unsigned NumInputElts = InputVT->getNumElements(); // n
   for (unsigned i = 0; i != NumElts; ++i) {
     if (i)
       Out << ", ";
-    int SrcVal = SVI.getMaskValue(i);
+    int SrcVal;
+    {
+      // Reading the mask may create its element constants.
+      auto Lock = lockShared();
+      SrcVal = SVI.getMaskValue(i);
+    }
     if ((unsigned)SrcVal >= NumInputElts * 2) {
       Out << "/*undef*/";
       printConstant(Zero);
@@ -3129,7 +5018,8 @@ void CWriter::visitInsertValueInst(InsertValueInst &IVI) {
     return;
 
   // Then do the insert to update the field.
-  Out << ";\n  ";
+  Out << ";\n";
+  Out.indent(StmtIndent);
   Out << GetValueName(&IVI);
   for (const unsigned *b = IVI.idx_begin(), *i = b, *e = IVI.idx_end(); i != e;
        ++i) {
@@ -3168,26 +5058,67 @@ void CWriter::visitExtractValueInst(ExtractValueInst &EVI) {
   Out << ")";
 }
 
-LLVM_ATTRIBUTE_NORETURN void CWriter::errorWithMessage(
-  const char *message, const Instruction *I
+// errorWithMessage - Record an error. The caller goes on with whatever it can
+// print, the output is dropped and the error is reported by reportError.
+void CWriter::errorWithMessage(
+  const Twine &message, const Instruction *I
 ) const {
-  errs() << message;
-  errs() << " in:\n";
+  if (hasFailed())
+    return;
+  raw_string_ostream OS(ErrorMessage);
+  OS << message;
+  OS << " in:\n";
   if (I == nullptr) {
     I = CurInstr;
   }
   if (I != nullptr) {
-    errs() << *I << "\nat ";
-    I->getDebugLoc().print(errs());
+    OS << *I << "\nat ";
+    I->getDebugLoc().print(OS);
   } else {
-    errs() << "<unknown instruction>";
+    OS << "<unknown instruction>";
   }
-  errs() << "\n\n";
+  OS.flush();
+}
 
-  sys::PrintStackTrace(errs());
-  
-  exit(1);
-  llvm_unreachable(message);
+namespace {
+// DiagnosticInfoCLBackend - A message of the backend which does not stop the
+// translation.
+class DiagnosticInfoCLBackend : public DiagnosticInfo {
+  const Twine &Message;
+
+public:
+  DiagnosticInfoCLBackend(const Twine &Message, DiagnosticSeverity Severity)
+      : DiagnosticInfo(getKindID(), Severity), Message(Message) {}
+
+  void print(DiagnosticPrinter &DP) const override { DP << Message; }
+
+  static int getKindID() {
+    static int ID = getNextAvailablePluginDiagnosticKind();
+    return ID;
+  }
+};
+} // namespace
+
+// warnWithMessage - Report a warning about the current instruction to the
+// LLVMContext, whose handler decides where it is printed.
+void CWriter::warnWithMessage(const Twine &message) {
+  std::string Text;
+  raw_string_ostream OS(Text);
+  OS << message << ": " << *CurInstr << " ; ";
+  CurInstr->getDebugLoc().print(OS);
+  OS.flush();
+  // The handler of the context is shared by the writers.
+  auto Lock = lockShared();
+  TheModule->getContext().diagnose(DiagnosticInfoCLBackend(Text, DS_Warning));
+}
+
+// reportError - Report the recorded error to the LLVMContext once. Without a
+// diagnostic handler the context prints it and exits.
+void CWriter::reportError() {
+  if (!hasFailed() || ErrorReported)
+    return;
+  ErrorReported = true;
+  TheModule->getContext().emitError(ErrorMessage);
 }
 
 } // namespace llvm_opencl
@@ -1,9 +1,14 @@
 #include "CLTargetMachine.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/SmallSet.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/PointerIntPair.h"
 #include "llvm/ADT/SmallString.h"
 #include "llvm/ADT/StringExtras.h"
+#include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/CodeGen/IntrinsicLowering.h"
 #include "llvm/CodeGen/Passes.h"
 #include "llvm/IR/Attributes.h"
@@ -13,6 +18,7 @@
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/GetElementPtrTypeIterator.h"
 #include "llvm/IR/InstVisitor.h"
 #include "llvm/IR/Instructions.h"
@@ -20,6 +26,7 @@
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/ModuleSlotTracker.h"
 #include "llvm/MC/MCAsmInfo.h"
 #include "llvm/MC/MCContext.h"
 #include "llvm/MC/MCInstrInfo.h"
@@ -28,13 +35,19 @@
 #include "llvm/MC/MCSubtargetInfo.h"
 #include "llvm/MC/MCSymbol.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/StringSaver.h"
 #include "llvm/Transforms/Scalar.h"
 
 #include <set>
 #include <functional>
+#include <mutex>
 
+#include "CFGStructurizer.h"
+#include "FunctionCache.h"
 #include "IDMap.h"
+#include "PHICoalescer.h"
 #include "CLBuiltIns.h"
 #include "CLIntrinsics.h"
 
@@ -55,8 +68,39 @@ class CWriter : public FunctionPass, public InstVisitor<CWriter> {
   raw_string_ostream OutHeaders;
   raw_string_ostream Out;
   raw_ostream &FileOut;
+  /// FunctionBodies - Printed functions in module order, written to FileOut
+  /// after the header.
+  std::vector<std::string> FunctionBodies;
   IntrinsicLowering *IL = nullptr;
+  TargetLibraryInfoImpl *TLII = nullptr;
   LoopInfo *LI = nullptr;
+  DominatorTree *DT = nullptr;
+  ScalarEvolution *SE = nullptr;
+  AAResults *AA = nullptr;
+  /// Structure - The statement tree of the function being printed, or null
+  /// if its blocks are printed one by one with gotos.
+  CFGStructurizer *Structure = nullptr;
+  /// Coalescer - The variable assignment of the function being printed.
+  PHICoalescer *Coalescer = nullptr;
+  /// StmtIndent - Indentation of the statements being printed.
+  unsigned StmtIndent = 2;
+
+  /// ForLoop - A counted loop printed as
+  /// for (IV = Init; IV Pred Final; IV += Step).
+  struct ForLoop {
+    PHINode *IV;
+    BinaryOperator *StepInst;
+    Value *Init;
+    Value *Final;
+    Value *Step;
+    CmpInst::Predicate Pred;
+  };
+  DenseMap<BasicBlock *, ForLoop> ForLoops;
+  /// ForLoopInsts - Instructions which are replaced by the header of a
+  /// ForLoop and must not be printed in the loop body.
+  SmallPtrSet<Instruction *, 8> ForLoopInsts;
+  /// InlinableLoads - Loads of the current function folded into their use.
+  SmallPtrSet<const Instruction *, 16> InlinableLoads;
   const Module *TheModule = nullptr;
   const MCAsmInfo *TAsm = nullptr;
   const MCRegisterInfo *MRI = nullptr;
@@ -68,18 +112,19 @@ class CWriter : public FunctionPass, public InstVisitor<CWriter> {
   std::set<const Argument *> ByValParams;
 
   IDMap<const Value *> AnonValueNumbers;
+  /// GlobalValueNumbers - The numbers of the unnamed globals, the local
+  /// values of each function are numbered after them.
+  IDMap<const Value *> GlobalValueNumbers;
 
   /// UnnamedStructIDs - This contains a unique ID for each struct that is
   /// either anonymous or has no name.
   IDMap<StructType *> UnnamedStructIDs;
 
-  std::set<Type *> TypedefDeclTypes;
-  std::set<std::pair<Type *, Type *>> SelectDeclTypes;
-  std::set<std::pair<CmpInst::Predicate, Type *>> CmpDeclTypes;
-  std::set<std::pair<CastInst::CastOps, std::pair<Type *, Type *>>>
-      CastOpDeclTypes;
-  std::set<std::pair<unsigned, Type *>> InlineOpDeclTypes;
-  std::set<Type *> CtorDeclTypes;
+  HeaderDecls Decls;
+  /// FnCache - The function bodies printed by earlier translations.
+  std::unique_ptr<FunctionCache> FnCache;
+  /// SlotTracker - Numbers the values of the module for describeFunction.
+  std::unique_ptr<ModuleSlotTracker> SlotTracker;
 
   IDMap<std::pair<FunctionType *, std::pair<AttributeList, CallingConv::ID>>>
       UnnamedFunctionIDs;
@@ -92,8 +137,41 @@ class CWriter : public FunctionPass, public InstVisitor<CWriter> {
   unsigned LastAnnotatedSourceLine = 0;
 
   std::set<Function *> UsedFunctions;
-
-  CLBuiltIns builtins;
+  /// Callers - The used functions calling each used function.
+  std::map<Function *, std::set<Function *>> Callers;
+  /// LocalVars - The addrspace(3) globals reached by each used function, in
+  /// module order. Kernels declare them as __local variables, other functions
+  /// take a __local pointer to each of them after their own parameters.
+  std::map<Function *, std::vector<GlobalVariable *>> LocalVars;
+  /// InKernel - The function being printed declares its __local variables.
+  bool InKernel = false;
+
+  /// SharedMutex - Guards the state shared with the other writers when the
+  /// functions of a module are printed on several threads.
+  std::mutex *SharedMutex = nullptr;
+
+  /// ErrorMessage - The first error met while printing. Once it is set,
+  /// nothing more is printed and the error is reported to the LLVMContext,
+  /// whose diagnostic handler decides whether the process goes on.
+  mutable std::string ErrorMessage;
+  bool ErrorReported = false;
+
+  const CLBuiltIns &builtins = CLBuiltIns::get();
+  /// BuiltInResolution - How a global resolves against the built-in table:
+  /// Kind is the result of CLBuiltIns::find, Name is the emitted C name.
+  struct BuiltInResolution {
+    int Kind = 0;
+    Func func;
+    std::string Name;
+  };
+  std::map<const GlobalValue *, BuiltInResolution> BuiltInResolutions;
+
+  /// Emitted names of values and spellings of types, computed once per
+  /// module and kept in NameAllocator.
+  BumpPtrAllocator NameAllocator;
+  StringSaver NameSaver{NameAllocator};
+  DenseMap<const Value *, StringRef> ValueNames;
+  DenseMap<PointerIntPair<Type *, 1, bool>, StringRef> TypeNames;
   CLIntrinsicMap intrinsics;
 
 public:
@@ -103,10 +181,7 @@ public:
 
   virtual StringRef getPassName() const { return "OpenCL backend"; }
 
-  void getAnalysisUsage(AnalysisUsage &AU) const {
-    AU.addRequired<LoopInfoWrapperPass>();
-    AU.setPreservesCFG();
-  }
+  void getAnalysisUsage(AnalysisUsage &AU) const;
 
   virtual bool doInitialization(Module &M);
   virtual bool doFinalization(Module &M);
@@ -114,9 +189,41 @@ public:
 
 private:
   void generateHeader(Module &M);
+  void flushFunctionBody();
+  void freeModuleState();
+  void numberUnnamedValues(Module &M);
+  void emitFunctionsInParallel(Module &M, unsigned NumThreads);
+  void initializeWorker(Module &M, const CWriter &Main);
+  void printFunctionWithAnalyses(Function &F);
+  bool describeFunction(Function &F, std::string &Description);
+
+  /// Helpers of generateHeader listing the declarations in an order which
+  /// only depends on the module.
+  int compareTypes(Type *A, Type *B);
+  bool declLess(Type *A, Type *B) { return compareTypes(A, B) < 0; }
+  bool declLess(unsigned A, unsigned B) { return A < B; }
+  template <class X, class Y>
+  bool declLess(const std::pair<X, Y> &A, const std::pair<X, Y> &B) {
+    if (declLess(A.first, B.first))
+      return true;
+    if (declLess(B.first, A.first))
+      return false;
+    return declLess(A.second, B.second);
+  }
+  template <class T> std::vector<T> sortDecls(const std::set<T> &Set) {
+    std::vector<T> Sorted(Set.begin(), Set.end());
+    llvm::sort(Sorted,
+               [this](const T &A, const T &B) { return declLess(A, B); });
+    return Sorted;
+  }
+  std::unique_lock<std::mutex> lockShared();
+  Constant *getNullValue(Type *Ty);
+  Constant *getElementAsConstant(ConstantDataSequential *CDS, unsigned i);
   void declareOneGlobalVariable(GlobalVariable *I);
 
   void markUsed(Function *F);
+  void collectLocalVars(Module &M);
+  ArrayRef<GlobalVariable *> getLocalParams(Function *F) const;
 
   void forwardDeclareStructs(raw_ostream &Out, Type *Ty,
                              std::set<Type *> &TypesPrinted);
@@ -126,17 +233,19 @@ private:
                      std::pair<AttributeList, CallingConv::ID> Attrs,
                      const std::string &Name,
                      iterator_range<Function::arg_iterator> *ArgList,
-                     std::function<std::string(int)> GetArgName);
+                     std::function<std::string(int)> GetArgName,
+                     ArrayRef<GlobalVariable *> LocalParams = None);
   raw_ostream &
   printFunctionProto(raw_ostream &Out, FunctionType *Ty,
                      std::pair<AttributeList, CallingConv::ID> Attrs,
                      const std::string &Name,
-                     iterator_range<Function::arg_iterator> *ArgList);
+                     iterator_range<Function::arg_iterator> *ArgList,
+                     ArrayRef<GlobalVariable *> LocalParams = None);
   raw_ostream &printFunctionProto(raw_ostream &Out, Function *F) {
     return printFunctionProto(
         Out, F->getFunctionType(),
         std::make_pair(F->getAttributes(), F->getCallingConv()),
-        GetValueName(F), nullptr);
+        GetValueName(F).str(), nullptr, getLocalParams(F));
   }
 
   raw_ostream &
@@ -163,7 +272,10 @@ private:
                              std::pair<AttributeList, CallingConv::ID> PAL =
                                  std::make_pair(AttributeList(),
                                                 CallingConv::C));
+  raw_ostream &spellTypeName(raw_ostream &Out, Type *Ty, bool isSigned,
+                             std::pair<AttributeList, CallingConv::ID> PAL);
   raw_ostream &printSimpleType(raw_ostream &Out, Type *Ty, bool isSigned=false);
+  raw_ostream &printAddressSpace(raw_ostream &Out, unsigned AS);
   raw_ostream &printTypeString(raw_ostream &Out, Type *Ty);
 
   std::string getStructName(StructType *ST);
@@ -200,6 +312,9 @@ private:
 
   void writeOperandWithCast(Value *Operand, ICmpInst &I);
   bool writeInstructionCast(Instruction &I);
+  bool isNativeOperator(unsigned Opcode, Type *Ty) const;
+  void printNativeOperator(unsigned Opcode, Type *Ty, Value *A,
+                           Value *B = nullptr);
   void writeMemoryAccess(Value *Operand, Type *OperandType, bool IsVolatile,
                          unsigned Alignment);
 
@@ -210,7 +325,11 @@ private:
   /// intrinsics which need to be explicitly defined in the CLBackend.
   void printIntrinsicDefinition(Function &F, raw_ostream &Out);
   void printIntrinsicDefinition(FunctionType *funT, unsigned Opcode,
-                                std::string OpName, raw_ostream &Out);
+                                std::string OpName, raw_ostream &Out,
+                                const CLIntrinsicSite &Site = CLIntrinsicSite());
+  std::string getMemIntrinsicName(MemIntrinsic &MI);
+  Type *getAggregateCopyType(MemCpyInst &I);
+  Value *stripInlinedBitCasts(Value *V) const;
 
   void printModuleTypes(raw_ostream &Out);
   void printContainedTypes(raw_ostream &Out, Type *Ty, std::set<Type *> &);
@@ -220,8 +339,33 @@ private:
 
   void printFunction(Function &);
   void printBasicBlock(BasicBlock *BB);
+  void printBasicBlockBody(BasicBlock *BB);
   void printLoop(Loop *L);
 
+  void printStructuredSeq(StructuredSeq &Seq, size_t Begin = 0);
+  void printStructuredSeq(StructuredSeq &Seq, size_t Begin, size_t End);
+  void printStructuredNode(StructuredNode &N);
+  void printStructuredEdge(StructuredNode &N);
+  void printStructuredIf(StructuredNode &N);
+  void printStructuredSwitch(StructuredNode &N);
+  void printStructuredLoop(StructuredNode &N);
+  bool isDoWhileLoop(StructuredNode &N, unsigned &Back) const;
+  void collectForLoops(StructuredSeq &Seq);
+  void printForLoop(StructuredNode &N, const ForLoop &FL);
+  void printCondition(Value *Cond, bool Negate);
+  void printLabel(BasicBlock *BB);
+  bool hasPHICopies(BasicBlock *From, BasicBlock *To) const;
+  bool isPHICopyNeeded(PHINode *PN, BasicBlock *From) const;
+  void collectReadVars(Value *V, SmallPtrSetImpl<Value *> &Vars) const;
+  bool copiesClobber(BasicBlock *From, BasicBlock *To, Value *V) const;
+  Value *getVarLeader(Value *V) const {
+    return Coalescer ? Coalescer->getLeader(V) : V;
+  }
+  bool isEmptyBlockBody(BasicBlock *BB) const;
+  bool isEmptyNode(StructuredNode &N) const;
+  bool isEmptySeq(StructuredSeq &Seq) const;
+  bool isJumpOnly(StructuredSeq &Seq, bool BreakOnly = false) const;
+
   void printCast(unsigned opcode, Type *SrcTy, Type *DstTy);
   void printConstant(Constant *CPV, enum OperandContext Context=ContextNormal);
   void printConstantWithCast(Constant *CPV, unsigned Opcode);
@@ -235,6 +379,7 @@ private:
   bool isEmptyType(Type *Ty) const;
   bool isAddressExposed(Value *V) const;
   bool isInlinableInst(Instruction &I) const;
+  void collectInlinableLoads(Function &F);
   AllocaInst *isDirectAlloca(Value *V) const;
 
   // Instruction visitation functions
@@ -250,7 +395,6 @@ private:
     llvm_unreachable("DwarfEHPrepare pass didn't work!");
   }
 
-  void visitPHINode(PHINode &I);
   void visitUnaryOperator(UnaryOperator &I);
   void visitBinaryOperator(BinaryOperator &I);
   void visitICmpInst(ICmpInst &I);
@@ -260,9 +404,26 @@ private:
   void visitSelectInst(SelectInst &I);
   void visitCallInst(CallInst &I);
   bool visitBuiltinCall(CallInst &I, Intrinsic::ID ID);
+  bool isDirectBuiltIn(Function *F, const Func &func);
+  void printDirectBuiltInCall(CallInst &I, const Func &func);
 
   void visitLoadInst(LoadInst &I);
   void visitStoreInst(StoreInst &I);
+
+  void visitAtomicRMWInst(AtomicRMWInst &I);
+  void visitAtomicCmpXchgInst(AtomicCmpXchgInst &I);
+  void visitFenceInst(FenceInst &I);
+  void printAtomicLoad(LoadInst &I);
+  void printAtomicStore(StoreInst &I);
+  Type *getAtomicIntType(Type *Ty);
+  std::string getAtomicFunction(StringRef Op, Type *IntTy);
+  void printAtomicPointerType(raw_ostream &Out, Type *Ty, unsigned AS,
+                              bool isSigned);
+  void printAtomicPointer(Value *Ptr, Type *Ty, bool isSigned);
+  void checkAtomicAddressSpace(Value *Ptr);
+  void printAtomicOrder(Instruction &I, AtomicOrdering Ordering,
+                        SyncScope::ID SSID);
+  void printAtomicFence(Instruction &I, bool Before);
   void visitGetElementPtrInst(GetElementPtrInst &I);
 
   void visitInsertElementInst(InsertElementInst &I);
@@ -277,11 +438,16 @@ private:
     errorWithMessage("unsupported LLVM instruction");
   }
 
-  void outputLValue(Instruction *I) { Out << "  " << GetValueName(I) << " = "; }
+  void outputLValue(Instruction *I) {
+    Out.indent(StmtIndent) << GetValueName(I) << " = ";
+  }
 
-  LLVM_ATTRIBUTE_NORETURN void errorWithMessage(
-    const char *message, const Instruction *I=nullptr
+  void errorWithMessage(
+    const Twine &message, const Instruction *I=nullptr
   ) const;
+  bool hasFailed() const { return !ErrorMessage.empty(); }
+  void warnWithMessage(const Twine &message);
+  void reportError();
 
   bool isGotoCodeNecessary(BasicBlock *From, BasicBlock *To);
   void printPHICopiesForSuccessor(BasicBlock *CurBlock, BasicBlock *Successor,
@@ -291,7 +457,8 @@ private:
   void printGEPExpression(Value *Ptr, gep_type_iterator I, gep_type_iterator E);
 
   std::string GetElementPtrString(std::string ptr, gep_type_iterator I);
-  std::string GetValueName(Value *Operand);
+  StringRef GetValueName(Value *Operand);
+  const BuiltInResolution &resolveBuiltIn(const GlobalValue *GV);
 
   friend class CWriterTestHelper;
 };
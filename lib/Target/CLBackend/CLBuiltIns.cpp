@@ -99,6 +99,8 @@ namespace llvm_opencl {
       replace(arg, "AS1", "__global");
       replace(arg, "AS2", "__constant");
       replace(arg, "AS3", "__local");
+
+      replace(arg, "ocl_event", "event_t");
     }
 
     if (demangled) {
@@ -108,9 +110,31 @@ namespace llvm_opencl {
     return 1;
   }
 
+  CLBuiltIns::CommonList::const_iterator CLBuiltIns::find_common_body(const std::string &name) const {
+    auto it = std::lower_bound(
+      commons.begin(), commons.end(), name,
+      [](const std::pair<std::string, std::string> &c, const std::string &n) {
+        return c.first < n;
+      }
+    );
+    if (it != commons.end() && it->first == name) {
+      return it;
+    } else {
+      return commons.end();
+    }
+  }
+
+  CLBuiltIns::WrapperList::const_iterator CLBuiltIns::find_wrapper_func(const Func &func) const {
+    auto it = std::lower_bound(wrappers.begin(), wrappers.end(), func);
+    if (it != wrappers.end() && !(func < *it)) {
+      return it;
+    } else {
+      return wrappers.end();
+    }
+  }
+
   int CLBuiltIns::find_common(const char *name) const {
-    auto it = commons.find(name);
-    if (it != commons.end()) {
+    if (find_common_body(name) != commons.end()) {
       return 1;
     } else {
       return 0;
@@ -118,7 +142,7 @@ namespace llvm_opencl {
   }
 
   int CLBuiltIns::find_wrapper(Func &func) const {
-    auto it = wrappers.find(func);
+    auto it = find_wrapper_func(func);
     if (it != wrappers.end()) {
       func.ret = it->ret;
       return 1;
@@ -127,7 +151,7 @@ namespace llvm_opencl {
     }
   }
 
-  int CLBuiltIns::find(const char *name, Func *func) {
+  int CLBuiltIns::find(const char *name, Func *func) const {
     Func local_func;
     if (!func) {
       func = &local_func;
@@ -149,6 +173,10 @@ namespace llvm_opencl {
     }
   }
 
+  bool CLBuiltIns::isCommon(const Func &func) const {
+    return find_common_body(func.name) != commons.end();
+  }
+
   bool CLBuiltIns::printDefinition(
     raw_ostream &Out,
     const Func &func,
@@ -156,7 +184,7 @@ namespace llvm_opencl {
     std::function<std::string(int)> GetValueName,
     std::function<std::string(Type *)> GetTypeName
   ) const {
-    auto cf = commons.find(func.name);
+    auto cf = find_common_body(func.name);
     if (cf != commons.end()) {
       // Common function
       Out << cf->second;
@@ -164,7 +192,7 @@ namespace llvm_opencl {
     }
 
     // OpenCL builtin
-    if (wrappers.find(func) == wrappers.end() || F->arg_size() != func.args.size()) {
+    if (find_wrapper_func(func) == wrappers.end() || F->arg_size() != func.args.size()) {
       return false;
     }
     Out << "  return ";
@@ -193,20 +221,46 @@ namespace llvm_opencl {
     return true;
   }
 
-  bool CLBuiltIns::add_common(const std::string &name, const std::string &body) {
-    return commons.insert(std::make_pair(name, body)).second;
+  void CLBuiltIns::add_common(const std::string &name, const std::string &body) {
+    commons.push_back(std::make_pair(name, body));
   }
 
-  bool CLBuiltIns::add_wrapper(const Func &func) {
-    return wrappers.insert(func).second;
+  void CLBuiltIns::add_wrapper(const Func &func) {
+    wrappers.push_back(func);
   }
 
-  int CLBuiltIns::add_wrappers(const std::initializer_list<Func> &list) {
-    int n = 0;
+  void CLBuiltIns::add_wrappers(const std::initializer_list<Func> &list) {
     for (const Func &f : list) {
-      n += add_wrapper(f);
+      add_wrapper(f);
     }
-    return n;
+  }
+
+  void CLBuiltIns::sort_tables() {
+    // The first registration of a name or signature wins
+    auto common_less = [](
+      const std::pair<std::string, std::string> &a,
+      const std::pair<std::string, std::string> &b
+    ) {
+      return a.first < b.first;
+    };
+    std::stable_sort(commons.begin(), commons.end(), common_less);
+    commons.erase(std::unique(
+      commons.begin(), commons.end(),
+      [&](const std::pair<std::string, std::string> &a, const std::pair<std::string, std::string> &b) {
+        return !common_less(a, b) && !common_less(b, a);
+      }
+    ), commons.end());
+
+    std::stable_sort(wrappers.begin(), wrappers.end());
+    wrappers.erase(std::unique(
+      wrappers.begin(), wrappers.end(),
+      [](const Func &a, const Func &b) { return !(a < b) && !(b < a); }
+    ), wrappers.end());
+  }
+
+  const CLBuiltIns &CLBuiltIns::get() {
+    static const CLBuiltIns table;
+    return table;
   }
 
   std::vector<std::string> operator+(const std::vector<std::string> &a, const std::vector<std::string> &b) {
@@ -577,13 +631,124 @@ namespace llvm_opencl {
       }
     }
 
-    // TODO:
+    // Atomic Functions
+    // 64-bit ones are the `atom_` functions of cl_khr_int64_*_atomics
+    std::vector<std::pair<std::string, std::string>> atomics{
+      {"atomic_", "int"}, {"atomic_", "uint"}, {"atom_", "long"}, {"atom_", "ulong"},
+    };
+    for (std::string as : {" __global", " __local"}) {
+      for (auto pt : atomics) {
+        std::string pre = pt.first, t = pt.second, p = t+" volatile"+as+"*";
+        for (std::string op : {"add", "sub", "xchg", "min", "max", "and", "or", "xor"}) {
+          add_wrappers({
+            Func(t, pre+op, { p, t }),
+          });
+        }
+        add_wrappers({
+          Func(t, pre+"inc", { p }),
+          Func(t, pre+"dec", { p }),
+          Func(t, pre+"cmpxchg", { p, t, t }),
+        });
+      }
+      add_wrappers({
+        Func("float", "atomic_xchg", { "float volatile"+as+"*", "float" }),
+      });
+    }
+
     // Synchronization Functions
+    for (std::string name : {"barrier", "work_group_barrier", "sub_group_barrier",
+                             "mem_fence", "read_mem_fence", "write_mem_fence"}) {
+      add_wrappers({
+        Func("void", name, { "uint" }),
+      });
+    }
+    add_wrappers({
+      Func("void", "work_group_barrier", { "uint", "memory_scope" }),
+      Func("void", "sub_group_barrier", { "uint", "memory_scope" }),
+    });
+
     // Async Copy and Prefetch
-    // Atomic Functions
+    for (std::string gt : type) {
+      for (std::string gd : gendim) {
+        std::string t = gt + gd;
+        // Cover 32-bit and 64-bit targets
+        for (std::string size : {"uint", "ulong"}) {
+          for (auto dst_src : {std::make_pair(" __local", " __global"),
+                               std::make_pair(" __global", " __local")}) {
+            std::string dst = t + dst_src.first + "*";
+            std::string src = t + " const" + dst_src.second + "*";
+            add_wrappers({
+              Func("event_t", "async_work_group_copy", { dst, src, size, "event_t" }),
+              Func("event_t", "async_work_group_strided_copy", { dst, src, size, size, "event_t" }),
+            });
+          }
+          add_wrappers({
+            Func("void", "prefetch", { t+" const __global*", size }),
+          });
+        }
+      }
+    }
+    add_wrappers({
+      Func("void", "wait_group_events", { "int", "event_t*" }),
+    });
+
     // Miscellaneous Vector Functions
+    std::vector<std::string> shuffledim{"2", "4", "8", "16"};
+    std::vector<std::string> masktype = typeiu + typeiu + std::vector<std::string>{"uint", "ulong"};
+    for (size_t i = 0; i < type.size(); ++i) {
+      for (std::string m : shuffledim) {
+        for (std::string n : shuffledim) {
+          add_wrappers({
+            Func(type[i]+n, "shuffle", { type[i]+m, masktype[i]+n }),
+            Func(type[i]+n, "shuffle2", { type[i]+m, type[i]+m, masktype[i]+n }),
+          });
+        }
+      }
+    }
+
+    // Work-group and Sub-group Functions
+    std::vector<std::string> grouptype{"int", "uint", "long", "ulong", "float", "double"};
+    for (std::string scope : {"work_group_", "sub_group_"}) {
+      add_wrappers({
+        Func("int", scope+"all", { "int" }),
+        Func("int", scope+"any", { "int" }),
+      });
+      for (std::string t : grouptype) {
+        for (std::string op : {"add", "min", "max"}) {
+          add_wrappers({
+            Func(t, scope+"reduce_"+op, { t }),
+            Func(t, scope+"scan_exclusive_"+op, { t }),
+            Func(t, scope+"scan_inclusive_"+op, { t }),
+          });
+        }
+      }
+    }
+    for (std::string t : grouptype) {
+      add_wrappers({
+        Func(t, "sub_group_broadcast", { t, "uint" }),
+      });
+      // Cover 32-bit and 64-bit targets
+      for (std::string size : {"uint", "ulong"}) {
+        add_wrappers({
+          Func(t, "work_group_broadcast", { t, size }),
+          Func(t, "work_group_broadcast", { t, size, size }),
+          Func(t, "work_group_broadcast", { t, size, size, size }),
+        });
+      }
+    }
+    add_wrappers({
+      Func("uint", "get_sub_group_size", {}),
+      Func("uint", "get_max_sub_group_size", {}),
+      Func("uint", "get_num_sub_groups", {}),
+      Func("uint", "get_enqueued_num_sub_groups", {}),
+      Func("uint", "get_sub_group_id", {}),
+      Func("uint", "get_sub_group_local_id", {}),
+    });
+
+    // TODO:
     // Image Read and Write Functions
-    // Work-group Functions
     // Reinterpreting Types
+
+    sort_tables();
   }
 } // namespace llvm
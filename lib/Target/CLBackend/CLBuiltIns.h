@@ -3,7 +3,7 @@
 
 #include <string>
 #include <map>
-#include <set>
+#include <vector>
 #include <initializer_list>
 #include <functional>
 
@@ -28,21 +28,34 @@ namespace llvm_opencl {
     bool operator<(const Func &other) const;
   };
 
+  /// CLBuiltIns - Table of the OpenCL built-ins and of the common functions
+  /// replacing some of them. It is built once per process and is immutable
+  /// afterwards, lookups are binary searches in sorted flat arrays.
   class CLBuiltIns {
   private:
-    std::map<std::string, std::string> commons;
-    std::set<Func> wrappers;
-    
-    bool add_common(const std::string &name, const std::string &body);
-    bool add_wrapper(const Func &func);
-    int add_wrappers(const std::initializer_list<Func> &list);
+    typedef std::vector<std::pair<std::string, std::string>> CommonList;
+    typedef std::vector<Func> WrapperList;
+
+    /// Common function bodies sorted by name
+    CommonList commons;
+    /// Built-in signatures sorted by `Func::operator<`
+    WrapperList wrappers;
+
+    CLBuiltIns();
+    void add_common(const std::string &name, const std::string &body);
+    void add_wrapper(const Func &func);
+    void add_wrappers(const std::initializer_list<Func> &list);
+    void sort_tables();
 
     static int demangle(const char *name, Func *func);
+    CommonList::const_iterator find_common_body(const std::string &name) const;
+    WrapperList::const_iterator find_wrapper_func(const Func &func) const;
     int find_common(const char *name) const;
     int find_wrapper(Func &func) const;
   public:
-    CLBuiltIns();
-    int find(const char *name, Func *func);
+    static const CLBuiltIns &get();
+    int find(const char *name, Func *func) const;
+    bool isCommon(const Func &func) const;
     bool printDefinition(
       raw_ostream &Out,
       const Func &func,
@@ -4,6 +4,7 @@
 
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/ADT/APInt.h"
+#include "llvm/ADT/StringExtras.h"
 
 #include "StringTools.h"
 
@@ -17,18 +18,21 @@ namespace llvm_opencl {
     FunctionType *funT;
     std::string OpName;
     std::function<void(raw_ostream&, Type*, bool)> printTy;
+    CLIntrinsicSite Site;
 
   public:
     virtual ~IntrinsicGenerator() = default;
 
     void set(
       raw_ostream &Out, FunctionType *funT,
-      std::string OpName, std::function<void(raw_ostream&, Type*, bool)> printTy
+      std::string OpName, std::function<void(raw_ostream&, Type*, bool)> printTy,
+      const CLIntrinsicSite &Site
     ) {
       this->OutPtr = &Out;
       this->funT = funT;
       this->OpName = OpName;
       this->printTy = printTy;
+      this->Site = Site;
     }
 
     void printTypeName(raw_ostream &Out, Type *Ty, bool isSigned=false) const {
@@ -43,6 +47,7 @@ namespace llvm_opencl {
     }
 
     virtual void printContent(raw_ostream &Out) = 0;
+    virtual bool supports(FunctionType *funT) const { return true; }
     virtual void printBefore(raw_ostream &Out) {}
     virtual void printAfter(raw_ostream &Out) {}
 
@@ -82,27 +87,193 @@ namespace llvm_opencl {
     IntrinsicGeneratorWraper(IntrinsicGenerator *gen) : generator(gen) {}
     void printDefinition(
       raw_ostream &Out, FunctionType *funT,
-      std::string OpName, std::function<void(raw_ostream&, Type*, bool)> printTy
+      std::string OpName, std::function<void(raw_ostream&, Type*, bool)> printTy,
+      const CLIntrinsicSite &Site
     ) const override {
-      generator->set(Out, funT, OpName, printTy);
+      generator->set(Out, funT, OpName, printTy, Site);
       generator->printDefinition();
     }
+    bool supports(FunctionType *funT) const override {
+      return generator->supports(funT);
+    }
   };
 
-  class MemSet : public IntrinsicGenerator {
+  // Fills or copies memory in the widest chunks the alignment of the call
+  // sites allows: aligned vectors from 16 bytes on, words from 4, vload16 and
+  // vstore16 below that. The bytes left over are handled with one chunk of
+  // each smaller size. Operands are a = dst, b = value or src, c = length.
+  class MemoryIntrinsic : public IntrinsicGenerator {
   public:
-    void printContent(raw_ostream &Out) override {
-      Out << "  for (uint i = 0; i < c; ++i) {\n"
-          << "    a[i] = b;\n"
-          << "  }\n";
+    enum Kind { Set, Copy, Move };
+
+  private:
+    Kind K;
+
+    struct Chunk {
+      unsigned Size;
+      bool Vector; // Accessed with vloadn/vstoren, otherwise with Type
+      std::string Type;
+    };
+
+    Chunk getChunk(unsigned Size) const {
+      if (Size > 1 && Size > Site.Align) {
+        return { Size, true, "uchar" + utostr(Size) };
+      }
+      switch (Size) {
+        case 16: return { Size, false, "uint4" };
+        case 8: return { Size, false, "ulong" };
+        case 4: return { Size, false, "uint" };
+        case 2: return { Size, false, "ushort" };
+        default: return { Size, false, "uchar" };
+      }
     }
-  };
-  class MemCopy : public IntrinsicGenerator {
+
+    // The chunk the bulk of the memory is handled with.
+    unsigned getMainSize() const {
+      if (Site.Align >= 16) {
+        return 16;
+      } else if (Site.Align >= 4) {
+        return Site.Align;
+      } else {
+        return 16;
+      }
+    }
+
+    std::string ptr(const Chunk &C, unsigned i, const std::string &Name) const {
+      if (C.Size == 1) {
+        return Name;
+      }
+      std::string name = getTypeName(funT->getParamType(i));
+      assert(name.compare(0, 5, "uchar") == 0);
+      return "((" + C.Type + name.substr(5) + ")" + Name + ")";
+    }
+
+    std::string load(const Chunk &C, const std::string &Index) const {
+      if (K == Set) {
+        if (C.Vector || C.Size == 1) {
+          return "(" + C.Type + ")(b)";
+        }
+        std::string Ones = "0x" + std::string(2*std::min(C.Size, 8u), '0');
+        for (unsigned i = 2; i < Ones.size(); i += 2) {
+          Ones[i + 1] = '1';
+        }
+        return "(" + C.Type + ")((" + (C.Size >= 8 ? "ulong" : "uint") +
+               ")b*" + Ones + "UL)";
+      }
+      if (C.Vector) {
+        return "vload" + utostr(C.Size) + "(" + Index + ", b)";
+      }
+      return ptr(C, 1, "b") + "[" + Index + "]";
+    }
+
+    void store(raw_ostream &Out, const Chunk &C, const std::string &Index,
+               const std::string &Indent) const {
+      Out << Indent;
+      if (C.Vector) {
+        Out << "vstore" << C.Size << "(" << load(C, Index) << ", " << Index << ", a);\n";
+      } else {
+        Out << ptr(C, 0, "a") << "[" << Index << "] = " << load(C, Index) << ";\n";
+      }
+    }
+
+    // Chunks are indexed in units of their own size, the offsets of the tail
+    // chunks are always multiples of it.
+    static std::string index(const std::string &Offset, unsigned Size) {
+      return Size == 1 ? Offset : Offset + "/" + utostr(Size);
+    }
+
+    void printForward(raw_ostream &Out, const std::string &Indent) const {
+      std::string LenTy = getTypeName(funT->getParamType(2));
+      unsigned Main = getMainSize();
+      Chunk MC = getChunk(Main);
+      if (Site.Length) {
+        uint64_t N = Site.Length/Main;
+        if (N == 1) {
+          store(Out, MC, "0", Indent);
+        } else if (N > 1) {
+          Out << Indent << "for (" << LenTy << " i = 0; i < " << N << "; ++i) {\n";
+          store(Out, MC, "i", Indent + "  ");
+          Out << Indent << "}\n";
+        }
+        uint64_t Offset = N*Main;
+        for (unsigned Size = Main/2; Size > 0; Size /= 2) {
+          if (Site.Length & Size) {
+            store(Out, getChunk(Size), utostr(Offset/Size), Indent);
+            Offset += Size;
+          }
+        }
+        return;
+      }
+      Out << Indent << "for (" << LenTy << " i = 0; i < c/" << Main << "; ++i) {\n";
+      store(Out, MC, "i", Indent + "  ");
+      Out << Indent << "}\n";
+      Out << Indent << LenTy << " o = c & ~(" << LenTy << ")" << (Main - 1) << ";\n";
+      for (unsigned Size = Main/2; Size > 0; Size /= 2) {
+        Out << Indent << "if (c & " << Size << ") {\n";
+        store(Out, getChunk(Size), index("o", Size), Indent + "  ");
+        if (Size > 1) {
+          Out << Indent << "  o += " << Size << ";\n";
+        }
+        Out << Indent << "}\n";
+      }
+    }
+
+    // Mirrors printForward from the end of the buffers, for moves to higher
+    // addresses.
+    void printBackward(raw_ostream &Out, const std::string &Indent) const {
+      std::string LenTy = getTypeName(funT->getParamType(2));
+      unsigned Main = getMainSize();
+      if (Site.Length) {
+        uint64_t Offset = Site.Length;
+        for (unsigned Size = 1; Size < Main; Size *= 2) {
+          if (Site.Length & Size) {
+            Offset -= Size;
+            store(Out, getChunk(Size), utostr(Offset/Size), Indent);
+          }
+        }
+        uint64_t N = Site.Length/Main;
+        if (N == 1) {
+          store(Out, getChunk(Main), "0", Indent);
+        } else if (N > 1) {
+          Out << Indent << "for (" << LenTy << " i = " << N << "; i-- > 0;) {\n";
+          store(Out, getChunk(Main), "i", Indent + "  ");
+          Out << Indent << "}\n";
+        }
+        return;
+      }
+      Out << Indent << LenTy << " o = c;\n";
+      for (unsigned Size = 1; Size < Main; Size *= 2) {
+        Out << Indent << "if (c & " << Size << ") {\n";
+        Out << Indent << "  o -= " << Size << ";\n";
+        store(Out, getChunk(Size), index("o", Size), Indent + "  ");
+        Out << Indent << "}\n";
+      }
+      Out << Indent << "for (" << LenTy << " i = c/" << Main << "; i-- > 0;) {\n";
+      store(Out, getChunk(Main), "i", Indent + "  ");
+      Out << Indent << "}\n";
+    }
+
   public:
+    MemoryIntrinsic(Kind K) : K(K) {}
+
     void printContent(raw_ostream &Out) override {
-      Out << "  for (uint i = 0; i < c; ++i) {\n"
-          << "    a[i] = b[i];\n"
-          << "  }\n";
+      Type *DstTy = funT->getParamType(0), *SrcTy = funT->getParamType(1);
+      // Buffers in different named address spaces never overlap, but a
+      // generic pointer may point into the other one.
+      bool MayOverlap = DstTy == SrcTy ||
+                        DstTy->getPointerAddressSpace() == 4 ||
+                        SrcTy->getPointerAddressSpace() == 4;
+      if (K != Move || !MayOverlap) {
+        printForward(Out, "  ");
+        return;
+      }
+      // Each chunk is read before it is written, so copying away from the
+      // overlap is enough.
+      Out << "  if (a <= b) {\n";
+      printForward(Out, "    ");
+      Out << "  } else {\n";
+      printBackward(Out, "    ");
+      Out << "  }\n";
     }
   };
 
@@ -126,6 +297,173 @@ namespace llvm_opencl {
     }
   };
 
+  // Element types which OpenCL built-ins accept without padding.
+  static bool isNativeInt(Type *Ty) {
+    Ty = Ty->getScalarType();
+    if (!Ty->isIntegerTy()) {
+      return false;
+    }
+    unsigned N = Ty->getIntegerBitWidth();
+    return N == 8 || N == 16 || N == 32 || N == 64;
+  }
+  static bool isNativeFloat(Type *Ty) {
+    Ty = Ty->getScalarType();
+    return Ty->isFloatTy() || Ty->isDoubleTy();
+  }
+
+  class NativeGenerator : public IntrinsicGenerator {
+  protected:
+    // Reinterprets an unsigned value as the signed type of the same size
+    // and back, as_type works for both scalars and vectors.
+    std::string asSigned(Type *Ty, const std::string &v) const {
+      return "as_" + getTypeName(Ty, true) + "(" + v + ")";
+    }
+    std::string asUnsigned(Type *Ty, const std::string &v) const {
+      return "as_" + getTypeName(Ty) + "(" + v + ")";
+    }
+    std::string constant(Type *Ty, uint64_t value) const {
+      return "(" + getTypeName(Ty) + ")0x" + utohexstr(value) + "UL";
+    }
+  };
+
+  // Calls the OpenCL built-in with the same meaning as the intrinsic on all
+  // of its operands.
+  class NativeFunction : public NativeGenerator {
+  private:
+    std::string Name;
+    bool Signed;
+  public:
+    NativeFunction(const std::string &Name, bool Signed=false) :
+      Name(Name), Signed(Signed) {}
+    bool supports(FunctionType *funT) const override {
+      Type *Ty = funT->getReturnType();
+      return isNativeFloat(Ty) || isNativeInt(Ty);
+    }
+    void printContent(raw_ostream &Out) override {
+      Type *Ty = funT->getReturnType();
+      std::string call = Name + "(";
+      for (unsigned i = 0; i < funT->getNumParams(); ++i) {
+        if (i > 0) {
+          call += ", ";
+        }
+        std::string arg(1, (char)('a' + i));
+        call += Signed ? asSigned(funT->getParamType(i), arg) : arg;
+      }
+      call += ")";
+      Out << "  return " << (Signed ? asUnsigned(Ty, call) : call) << ";\n";
+    }
+  };
+
+  class Canonicalize : public IntrinsicGenerator {
+  public:
+    void printContent(raw_ostream &Out) override {
+      Out << "  return a;\n";
+    }
+  };
+
+  // llvm.minimum and llvm.maximum propagate NaNs unlike fmin and fmax.
+  class FMinMaxNaN : public NativeGenerator {
+  private:
+    std::string Name;
+  public:
+    FMinMaxNaN(const std::string &Name) : Name(Name) {}
+    bool supports(FunctionType *funT) const override {
+      return isNativeFloat(funT->getReturnType());
+    }
+    void printContent(raw_ostream &Out) override {
+      if (funT->getReturnType()->isVectorTy()) {
+        Out << "  return select(" << Name << "(a, b), a + b, isnan(a) | isnan(b));\n";
+      } else {
+        Out << "  return isnan(a) || isnan(b) ? a + b : " << Name << "(a, b);\n";
+      }
+    }
+  };
+
+  class PowI : public NativeGenerator {
+  public:
+    bool supports(FunctionType *funT) const override {
+      return isNativeFloat(funT->getReturnType());
+    }
+    void printContent(raw_ostream &Out) override {
+      Type *Ty = funT->getReturnType();
+      std::string n = "as_int(b)";
+      if (VectorType *VTy = dyn_cast<VectorType>(Ty)) {
+        n = "(int" + utostr(VTy->getNumElements()) + ")(" + n + ")";
+      }
+      Out << "  return pown(a, " << n << ");\n";
+    }
+  };
+
+  // llvm.lround, llvm.lrint and their long long variants.
+  class RoundToInt : public NativeGenerator {
+  private:
+    std::string Name;
+  public:
+    RoundToInt(const std::string &Name) : Name(Name) {}
+    bool supports(FunctionType *funT) const override {
+      return isNativeInt(funT->getReturnType()) &&
+             isNativeFloat(funT->getParamType(0));
+    }
+    void printContent(raw_ostream &Out) override {
+      Type *Ty = funT->getReturnType();
+      Out << "  return " << asUnsigned(Ty, "convert_" + getTypeName(Ty, true) +
+                                      "(" + Name + "(a))") << ";\n";
+    }
+  };
+
+  // Byte swap and bit reverse as a sequence of swaps of adjacent groups of
+  // bits, the widest of which is a rotation.
+  class SwapBits : public NativeGenerator {
+  private:
+    unsigned MinGroup;
+  public:
+    SwapBits(unsigned MinGroup) : MinGroup(MinGroup) {}
+    bool supports(FunctionType *funT) const override {
+      return isNativeInt(funT->getReturnType());
+    }
+    void printContent(raw_ostream &Out) override {
+      Type *Ty = funT->getReturnType();
+      unsigned N = Ty->getScalarSizeInBits();
+      for (unsigned s = N/2; s >= MinGroup; s /= 2) {
+        if (s == N/2) {
+          Out << "  a = rotate(a, (" << getTypeName(Ty) << ")" << s << ");\n";
+          continue;
+        }
+        uint64_t mask = 0;
+        for (unsigned i = 0; i < N; ++i) {
+          if ((i/s) % 2 == 0) {
+            mask |= (uint64_t)1 << i;
+          }
+        }
+        std::string m = constant(Ty, mask);
+        Out << "  a = ((a >> " << s << ") & " << m << ") | ((a & " << m <<
+               ") << " << s << ");\n";
+      }
+      Out << "  return a;\n";
+    }
+  };
+
+  // The shift amount is taken modulo the bit width, OpenCL shifts mask it
+  // the same way so no branch on zero is needed.
+  class FunnelShift : public NativeGenerator {
+  private:
+    bool Left;
+  public:
+    FunnelShift(bool Left) : Left(Left) {}
+    bool supports(FunctionType *funT) const override {
+      return isNativeInt(funT->getReturnType());
+    }
+    void printContent(raw_ostream &Out) override {
+      Type *Ty = funT->getReturnType();
+      std::string m = constant(Ty, Ty->getScalarSizeInBits() - 1);
+      if (Left) {
+        Out << "  return (a << (c & " << m << ")) | ((b >> 1) >> (~c & " << m << "));\n";
+      } else {
+        Out << "  return ((a << 1) << (~c & " << m << ")) | (b >> (c & " << m << "));\n";
+      }
+    }
+  };
+
   class UAddWithOverflow : public IntrinsicGenerator {
   public:
     void printContent(raw_ostream &Out) override {
@@ -242,8 +580,9 @@ namespace llvm_opencl {
   }
 
   CLIntrinsicMap::CLIntrinsicMap() {
-    insert(make_entry(Intrinsic::memset, new MemSet()));
-    insert(make_entry(Intrinsic::memcpy, new MemCopy()));
+    insert(make_entry(Intrinsic::memset, new MemoryIntrinsic(MemoryIntrinsic::Set)));
+    insert(make_entry(Intrinsic::memcpy, new MemoryIntrinsic(MemoryIntrinsic::Copy)));
+    insert(make_entry(Intrinsic::memmove, new MemoryIntrinsic(MemoryIntrinsic::Move)));
     insert(make_entry(Intrinsic::fmuladd, new FMulAdd()));
     insert(make_entry(Intrinsic::ctlz, new CountLeadingZeros()));
     insert(make_entry(Intrinsic::cttz, new CountTrailingZeros()));
@@ -254,6 +593,47 @@ namespace llvm_opencl {
     insert(make_entry(Intrinsic::umul_with_overflow, new UMulWithOverflow()));
     insert(make_entry(Intrinsic::smul_with_overflow, new SMulWithOverflow()));
     //insert(make_entry(Intrinsic::sdiv_with_overflow, new SDivWithOverflow()));
+
+    // Math intrinsics
+    insert(make_entry(Intrinsic::fabs, new NativeFunction("fabs")));
+    insert(make_entry(Intrinsic::sqrt, new NativeFunction("sqrt")));
+    insert(make_entry(Intrinsic::floor, new NativeFunction("floor")));
+    insert(make_entry(Intrinsic::ceil, new NativeFunction("ceil")));
+    insert(make_entry(Intrinsic::trunc, new NativeFunction("trunc")));
+    insert(make_entry(Intrinsic::rint, new NativeFunction("rint")));
+    insert(make_entry(Intrinsic::nearbyint, new NativeFunction("rint")));
+    insert(make_entry(Intrinsic::round, new NativeFunction("round")));
+    insert(make_entry(Intrinsic::sin, new NativeFunction("sin")));
+    insert(make_entry(Intrinsic::cos, new NativeFunction("cos")));
+    insert(make_entry(Intrinsic::exp, new NativeFunction("exp")));
+    insert(make_entry(Intrinsic::exp2, new NativeFunction("exp2")));
+    insert(make_entry(Intrinsic::log, new NativeFunction("log")));
+    insert(make_entry(Intrinsic::log2, new NativeFunction("log2")));
+    insert(make_entry(Intrinsic::log10, new NativeFunction("log10")));
+    insert(make_entry(Intrinsic::pow, new NativeFunction("pow")));
+    insert(make_entry(Intrinsic::powi, new PowI()));
+    insert(make_entry(Intrinsic::fma, new NativeFunction("fma")));
+    insert(make_entry(Intrinsic::copysign, new NativeFunction("copysign")));
+    insert(make_entry(Intrinsic::minnum, new NativeFunction("fmin")));
+    insert(make_entry(Intrinsic::maxnum, new NativeFunction("fmax")));
+    insert(make_entry(Intrinsic::minimum, new FMinMaxNaN("fmin")));
+    insert(make_entry(Intrinsic::maximum, new FMinMaxNaN("fmax")));
+    insert(make_entry(Intrinsic::canonicalize, new Canonicalize()));
+    insert(make_entry(Intrinsic::lround, new RoundToInt("round")));
+    insert(make_entry(Intrinsic::llround, new RoundToInt("round")));
+    insert(make_entry(Intrinsic::lrint, new RoundToInt("rint")));
+    insert(make_entry(Intrinsic::llrint, new RoundToInt("rint")));
+
+    // Bit manipulation intrinsics
+    insert(make_entry(Intrinsic::ctpop, new NativeFunction("popcount")));
+    insert(make_entry(Intrinsic::bswap, new SwapBits(8)));
+    insert(make_entry(Intrinsic::bitreverse, new SwapBits(1)));
+    insert(make_entry(Intrinsic::fshl, new FunnelShift(true)));
+    insert(make_entry(Intrinsic::fshr, new FunnelShift(false)));
+    insert(make_entry(Intrinsic::uadd_sat, new NativeFunction("add_sat")));
+    insert(make_entry(Intrinsic::sadd_sat, new NativeFunction("add_sat", true)));
+    insert(make_entry(Intrinsic::usub_sat, new NativeFunction("sub_sat")));
+    insert(make_entry(Intrinsic::ssub_sat, new NativeFunction("sub_sat", true)));
   }
 
   const CLIntrinsic *CLIntrinsicMap::get(unsigned Opcode) const {
@@ -265,7 +645,8 @@ namespace llvm_opencl {
     }
   }
 
-  bool CLIntrinsicMap::hasImpl(unsigned Opcode) const {
-    return get(Opcode) != nullptr;
+  bool CLIntrinsicMap::hasImpl(unsigned Opcode, FunctionType *funT) const {
+    const CLIntrinsic *intr = get(Opcode);
+    return intr != nullptr && intr->supports(funT);
   }
 } // namespace llvm_opencl  
@@ -11,13 +11,24 @@
 namespace llvm_opencl {
   using namespace llvm;
   
+  /// Facts shared by all call sites a definition is printed for.
+  struct CLIntrinsicSite {
+    /// Constant length of a memory intrinsic, 0 if it is not known.
+    uint64_t Length = 0;
+    /// Alignment of every pointer operand of a memory intrinsic.
+    unsigned Align = 1;
+  };
+
   class CLIntrinsic {
   public:
     virtual ~CLIntrinsic() = default;
     virtual void printDefinition(
       raw_ostream &Out, FunctionType *funT, std::string OpName,
-      std::function<void(raw_ostream&, Type*, bool)> printTy
+      std::function<void(raw_ostream&, Type*, bool)> printTy,
+      const CLIntrinsicSite &Site
     ) const = 0;
+    /// Returns false if the intrinsic has to be lowered for these types.
+    virtual bool supports(FunctionType *funT) const { return true; }
   };
 
   class CLIntrinsicMap {
@@ -27,7 +38,7 @@ namespace llvm_opencl {
   public:
     CLIntrinsicMap();
     const CLIntrinsic *get(unsigned Opcode) const;
-    bool hasImpl(unsigned Opcode) const;
+    bool hasImpl(unsigned Opcode, FunctionType *funT) const;
   };
 
 } // namespace llvm_opencl
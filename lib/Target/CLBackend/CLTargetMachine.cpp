@@ -42,9 +42,6 @@ bool CLTargetMachine::addPassesToEmitFile(PassManagerBase &PM,
   PM.add(createLowerInvokePass());
   PM.add(createUnreachableBlockEliminationPass());
 
-  // Lower atomic operations to libcalls
-  PM.add(createAtomicExpandPass());
-
   PM.add(new llvm_opencl::CWriter(Out));
   return false;
 }
@@ -54,7 +51,7 @@ CLTargetMachine::getSubtargetImpl(const Function &) const {
   return &SubtargetInfo;
 }
 
-bool CLTargetSubtargetInfo::enableAtomicExpand() const { return true; }
+bool CLTargetSubtargetInfo::enableAtomicExpand() const { return false; }
 
 const TargetLowering *CLTargetSubtargetInfo::getTargetLowering() const {
   return &Lowering;
@@ -24,7 +24,9 @@ namespace llvm {
 class CLTargetLowering : public TargetLowering {
 public:
   explicit CLTargetLowering(const TargetMachine &TM) : TargetLowering(TM) {
-    setMaxAtomicSizeInBitsSupported(0);
+    // Atomics are printed as OpenCL built-ins, 64-bit ones need the
+    // cl_khr_int64_*_atomics extensions.
+    setMaxAtomicSizeInBitsSupported(64);
   }
 };
 
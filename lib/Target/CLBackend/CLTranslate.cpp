@@ -0,0 +1,158 @@
+//===-- CLTranslate.cpp - In-memory interface to the OpenCL backend -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the C++ and C interfaces translating a module to
+// OpenCL C in memory.
+//
+//===----------------------------------------------------------------------===//
+
+#include "CLTranslate.h"
+#include "CLTranslateC.h"
+#include "CLTargetMachine.h"
+#include "llvm-c/Core.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/DiagnosticHandler.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <mutex>
+
+extern "C" void LLVMInitializeCLBackendTarget();
+extern "C" void LLVMInitializeCLBackendTargetInfo();
+extern "C" void LLVMInitializeCLBackendTargetMC();
+
+namespace llvm_opencl {
+
+using namespace llvm;
+
+namespace {
+// ErrorCollector - Keep the errors reported to a context instead of printing
+// them and exiting, which the default handler does. The other diagnostics,
+// such as warnings, go to the handler the context had before.
+struct ErrorCollector : DiagnosticHandler {
+  std::string &Errors;
+  DiagnosticHandler &Previous;
+
+  ErrorCollector(std::string &Errors, DiagnosticHandler &Previous)
+      : Errors(Errors), Previous(Previous) {}
+
+  bool handleDiagnostics(const DiagnosticInfo &DI) override {
+    if (DI.getSeverity() != DS_Error)
+      return Previous.handleDiagnostics(DI);
+    raw_string_ostream OS(Errors);
+    if (!Errors.empty())
+      OS << '\n';
+    DiagnosticPrinterRawOStream DP(OS);
+    DI.print(DP);
+    return true;
+  }
+};
+} // namespace
+
+// BackendVersion - Raised whenever a change to the backend changes the code
+// printed for some module, which makes the caches drop their entries.
+static const unsigned BackendVersion = 1;
+
+std::string getBackendVersion() {
+  return (Twine("llvm-opencl ") + Twine(BackendVersion) + " llvm " +
+          LLVM_VERSION_STRING)
+      .str();
+}
+
+void initializeCLBackend() {
+  static std::once_flag Once;
+  std::call_once(Once, []() {
+    LLVMInitializeCLBackendTargetInfo();
+    LLVMInitializeCLBackendTarget();
+    LLVMInitializeCLBackendTargetMC();
+
+    PassRegistry &Registry = *PassRegistry::getPassRegistry();
+    initializeCore(Registry);
+    initializeCodeGen(Registry);
+  });
+}
+
+Expected<std::string> translate(Module &M, const Options &Opts) {
+  initializeCLBackend();
+
+  if (!Opts.TargetTriple.empty())
+    M.setTargetTriple(Triple::normalize(Opts.TargetTriple));
+  Triple TheTriple(M.getTargetTriple());
+
+  std::unique_ptr<TargetMachine> Target(TheCLBackendTarget.createTargetMachine(
+      TheTriple.getTriple(), "", "", TargetOptions(), None, None,
+      Opts.OptLevel));
+  if (!Target)
+    return createStringError(inconvertibleErrorCode(),
+                             "cannot create the OpenCL target machine");
+
+  // The same passes as llvm-opencl runs.
+  legacy::PassManager PM;
+  PM.add(new TargetLibraryInfoWrapperPass(TheTriple));
+  PM.add(createTargetTransformInfoWrapperPass(Target->getTargetIRAnalysis()));
+
+  SmallString<0> Code;
+  raw_svector_ostream OS(Code);
+  if (Target->addPassesToEmitFile(PM, OS, nullptr, CGFT_AssemblyFile))
+    return createStringError(inconvertibleErrorCode(),
+                             "cannot emit OpenCL C");
+  std::string Errors;
+  LLVMContext &Context = M.getContext();
+  std::unique_ptr<DiagnosticHandler> Handler = Context.getDiagnosticHandler();
+  Context.setDiagnosticHandler(
+      std::make_unique<ErrorCollector>(Errors, *Handler));
+  PM.run(M);
+  Context.setDiagnosticHandler(std::move(Handler));
+  if (!Errors.empty())
+    return createStringError(inconvertibleErrorCode(), Errors);
+  return Code.str().str();
+}
+
+} // namespace llvm_opencl
+
+using namespace llvm;
+
+LLVMBool LLVMOpenCLTranslate(const char *Data, size_t Size,
+                             const char *TargetTriple, char **OutCode,
+                             char **OutMessage) {
+  LLVMContext Context;
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M =
+      parseIR(MemoryBufferRef(StringRef(Data, Size), "<buffer>"), Err, Context);
+  if (!M) {
+    std::string Message;
+    raw_string_ostream OS(Message);
+    Err.print("llvm-opencl", OS);
+    *OutMessage = LLVMCreateMessage(OS.str().c_str());
+    return 1;
+  }
+
+  llvm_opencl::Options Opts;
+  if (TargetTriple)
+    Opts.TargetTriple = TargetTriple;
+  Expected<std::string> Code = llvm_opencl::translate(*M, Opts);
+  if (!Code) {
+    *OutMessage = LLVMCreateMessage(toString(Code.takeError()).c_str());
+    return 1;
+  }
+  *OutCode = LLVMCreateMessage(Code->c_str());
+  return 0;
+}
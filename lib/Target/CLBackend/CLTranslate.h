@@ -0,0 +1,53 @@
+//===-- CLTranslate.h - In-memory interface to the OpenCL backend -*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares the functions translating a module to OpenCL C without
+// going through files, for programs embedding the backend. The C interface is
+// declared in CLTranslateC.h.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CLTRANSLATE_H
+#define CLTRANSLATE_H
+
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CodeGen.h"
+#include "llvm/Support/Error.h"
+
+#include <string>
+
+namespace llvm_opencl {
+
+/// Options - How a module is translated. The options of the backend itself
+/// are the command line options of the process.
+struct Options {
+  /// TargetTriple - Replaces the triple of the module if not empty.
+  std::string TargetTriple;
+  llvm::CodeGenOpt::Level OptLevel = llvm::CodeGenOpt::Default;
+};
+
+/// Registers the OpenCL backend. translate calls it, programs using the
+/// backend through the target registry may call it themselves.
+void initializeCLBackend();
+
+/// Identifies the output of this build of the backend. A build returning the
+/// same string prints the same code for the same module and options, so the
+/// caches of translations keep it in their keys.
+std::string getBackendVersion();
+
+/// Translates M to OpenCL C with the passes of the llvm-opencl tool. M is
+/// lowered in place on the way. Functions not reachable from kernels are not
+/// printed. The errors reported to the context of M while translating, such
+/// as unsupported instructions, are returned instead of ending the process.
+llvm::Expected<std::string> translate(llvm::Module &M,
+                                      const Options &Opts = Options());
+
+} // namespace llvm_opencl
+
+#endif // CLTRANSLATE_H
@@ -0,0 +1,40 @@
+/*===-- CLTranslateC.h - C interface to the OpenCL backend --------*- C -*-===*\
+|*                                                                            *|
+|*                     The LLVM Compiler Infrastructure                       *|
+|*                                                                            *|
+|* This file is distributed under the University of Illinois Open Source      *|
+|* License. See LICENSE.TXT for details.                                      *|
+|*                                                                            *|
+|*===----------------------------------------------------------------------===*|
+|*                                                                            *|
+|* This header declares the C interface translating an LLVM module held in   *|
+|* memory to OpenCL C.                                                        *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#ifndef CLTRANSLATEC_H
+#define CLTRANSLATEC_H
+
+#include "llvm-c/Types.h"
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Translate the bitcode or textual IR in Data to OpenCL C. TargetTriple
+ * replaces the triple of the module if it is not null. Returns 0 and stores
+ * the code in *OutCode on success, otherwise returns 1 and stores the
+ * diagnostics in *OutMessage. Both strings are freed with LLVMDisposeMessage.
+ */
+LLVMBool LLVMOpenCLTranslate(const char *Data, size_t Size,
+                             const char *TargetTriple, char **OutCode,
+                             char **OutMessage);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CLTRANSLATEC_H */
@@ -0,0 +1,402 @@
+//===------------------ FunctionCache.cpp ------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the function cache of the OpenCL backend.
+//
+// An entry is a list of declarations, one per line, followed by "body\n" and
+// the printed function. Every number and string ends with ';', strings are
+// prefixed with their length:
+//
+//   T<type>                  typedef
+//   S<type><type>            select helper
+//   C<predicate;><type>      compare helper
+//   X<opcode;><type><type>   cast helper
+//   I<opcode;><type>         operator helper
+//   K<type>                  constructor helper
+//   W<type><type>            cmpxchg helper
+//   R<operation;><type>      atomicrmw helper
+//   A                        64-bit atomics extension
+//   M<name><function><length;><align;>  memory intrinsic helper
+//
+//===----------------------------------------------------------------------===//
+#include "FunctionCache.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SHA1.h"
+
+namespace llvm_opencl {
+
+using namespace llvm;
+
+void HeaderDecls::merge(const HeaderDecls &Other) {
+  TypedefDeclTypes.insert(Other.TypedefDeclTypes.begin(),
+                          Other.TypedefDeclTypes.end());
+  SelectDeclTypes.insert(Other.SelectDeclTypes.begin(),
+                         Other.SelectDeclTypes.end());
+  CmpDeclTypes.insert(Other.CmpDeclTypes.begin(), Other.CmpDeclTypes.end());
+  CastOpDeclTypes.insert(Other.CastOpDeclTypes.begin(),
+                         Other.CastOpDeclTypes.end());
+  InlineOpDeclTypes.insert(Other.InlineOpDeclTypes.begin(),
+                           Other.InlineOpDeclTypes.end());
+  CtorDeclTypes.insert(Other.CtorDeclTypes.begin(), Other.CtorDeclTypes.end());
+  CmpXchgDeclTypes.insert(Other.CmpXchgDeclTypes.begin(),
+                          Other.CmpXchgDeclTypes.end());
+  AtomicRMWDeclTypes.insert(Other.AtomicRMWDeclTypes.begin(),
+                            Other.AtomicRMWDeclTypes.end());
+  UsesInt64Atomics |= Other.UsesInt64Atomics;
+  MemIntrinsicDecls.insert(Other.MemIntrinsicDecls.begin(),
+                           Other.MemIntrinsicDecls.end());
+}
+
+void HeaderDecls::clear() {
+  TypedefDeclTypes.clear();
+  SelectDeclTypes.clear();
+  CmpDeclTypes.clear();
+  CastOpDeclTypes.clear();
+  InlineOpDeclTypes.clear();
+  CtorDeclTypes.clear();
+  CmpXchgDeclTypes.clear();
+  AtomicRMWDeclTypes.clear();
+  UsesInt64Atomics = false;
+  MemIntrinsicDecls.clear();
+}
+
+FunctionCache::FunctionCache(StringRef Dir, Module &M,
+                             IDMap<StructType *> &StructIDs)
+    : Dir(Dir.str()), M(M), StructIDs(StructIDs) {
+  for (auto &Entry : StructIDs)
+    Structs[Entry.second] = Entry.first;
+}
+
+std::string FunctionCache::getKey(StringRef Description) {
+  return toHex(SHA1::hash(arrayRefFromStringRef(Description)));
+}
+
+std::string FunctionCache::getPath(StringRef Key) const {
+  return (Twine(Dir) + "/" + Key + ".fn").str();
+}
+
+static void encodeString(StringRef Str, raw_ostream &OS) {
+  OS << Str.size() << ';' << Str;
+}
+
+static bool decodeNumber(StringRef &S, uint64_t &N) {
+  return !S.consumeInteger(10, N) && S.consume_front(";");
+}
+
+static bool decodeString(StringRef &S, StringRef &Str) {
+  uint64_t Size;
+  if (!decodeNumber(S, Size) || Size > S.size())
+    return false;
+  Str = S.take_front(Size);
+  S = S.drop_front(Size);
+  return true;
+}
+
+bool FunctionCache::encodeType(Type *Ty, raw_ostream &OS) {
+  switch (Ty->getTypeID()) {
+  case Type::VoidTyID:
+    OS << 'V';
+    return true;
+  case Type::HalfTyID:
+    OS << 'H';
+    return true;
+  case Type::FloatTyID:
+    OS << 'F';
+    return true;
+  case Type::DoubleTyID:
+    OS << 'D';
+    return true;
+  case Type::IntegerTyID:
+    OS << 'I' << Ty->getIntegerBitWidth() << ';';
+    return true;
+  case Type::PointerTyID:
+    OS << 'P' << Ty->getPointerAddressSpace() << ';';
+    return encodeType(Ty->getPointerElementType(), OS);
+  case Type::VectorTyID:
+    OS << 'X' << cast<VectorType>(Ty)->getNumElements() << ';';
+    return encodeType(Ty->getVectorElementType(), OS);
+  case Type::ArrayTyID:
+    OS << 'A' << Ty->getArrayNumElements() << ';';
+    return encodeType(Ty->getArrayElementType(), OS);
+  case Type::StructTyID: {
+    StructType *ST = cast<StructType>(Ty);
+    if (!ST->isLiteral() && ST->hasName()) {
+      OS << 'N';
+      encodeString(ST->getName(), OS);
+      return true;
+    }
+    // Structs numbered while printing may get another number next time.
+    auto It = StructIDs.find(ST);
+    if (It == StructIDs.end() || !Structs.count(It->second))
+      return false;
+    OS << 'U' << It->second << ';';
+    return true;
+  }
+  case Type::FunctionTyID: {
+    FunctionType *FT = cast<FunctionType>(Ty);
+    OS << 'Q' << FT->isVarArg() << ';' << FT->getNumParams() << ';';
+    if (!encodeType(FT->getReturnType(), OS))
+      return false;
+    for (Type *Param : FT->params())
+      if (!encodeType(Param, OS))
+        return false;
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+Type *FunctionCache::decodeType(StringRef &S) {
+  if (S.empty())
+    return nullptr;
+  char Kind = S.front();
+  S = S.drop_front();
+  LLVMContext &Context = M.getContext();
+  uint64_t N;
+  switch (Kind) {
+  case 'V':
+    return Type::getVoidTy(Context);
+  case 'H':
+    return Type::getHalfTy(Context);
+  case 'F':
+    return Type::getFloatTy(Context);
+  case 'D':
+    return Type::getDoubleTy(Context);
+  case 'I':
+    if (!decodeNumber(S, N) || N < IntegerType::MIN_INT_BITS ||
+        N > IntegerType::MAX_INT_BITS)
+      return nullptr;
+    return IntegerType::get(Context, N);
+  case 'P': {
+    if (!decodeNumber(S, N))
+      return nullptr;
+    Type *Elt = decodeType(S);
+    if (!Elt || !PointerType::isValidElementType(Elt))
+      return nullptr;
+    return PointerType::get(Elt, N);
+  }
+  case 'X': {
+    if (!decodeNumber(S, N) || N == 0)
+      return nullptr;
+    Type *Elt = decodeType(S);
+    if (!Elt || !VectorType::isValidElementType(Elt))
+      return nullptr;
+    return VectorType::get(Elt, N);
+  }
+  case 'A': {
+    if (!decodeNumber(S, N))
+      return nullptr;
+    Type *Elt = decodeType(S);
+    if (!Elt || !ArrayType::isValidElementType(Elt))
+      return nullptr;
+    return ArrayType::get(Elt, N);
+  }
+  case 'N': {
+    StringRef Name;
+    if (!decodeString(S, Name))
+      return nullptr;
+    return M.getTypeByName(Name);
+  }
+  case 'U':
+    if (!decodeNumber(S, N))
+      return nullptr;
+    return Structs.lookup(N);
+  case 'Q': {
+    uint64_t VarArg;
+    if (!decodeNumber(S, VarArg) || !decodeNumber(S, N))
+      return nullptr;
+    Type *Ret = decodeType(S);
+    if (!Ret || !FunctionType::isValidReturnType(Ret))
+      return nullptr;
+    std::vector<Type *> Params;
+    for (; N; --N) {
+      Type *Param = decodeType(S);
+      if (!Param || !FunctionType::isValidArgumentType(Param))
+        return nullptr;
+      Params.push_back(Param);
+    }
+    return FunctionType::get(Ret, Params, VarArg);
+  }
+  default:
+    return nullptr;
+  }
+}
+
+bool FunctionCache::read(StringRef Key, std::string &Entry) const {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer =
+      MemoryBuffer::getFile(getPath(Key));
+  if (!Buffer)
+    return false;
+  Entry = (*Buffer)->getBuffer().str();
+  return true;
+}
+
+bool FunctionCache::parse(StringRef Entry, std::string &Body,
+                          HeaderDecls &Decls) {
+  StringRef S = Entry;
+  while (!S.consume_front("body\n")) {
+    if (S.empty())
+      return false;
+    char Kind = S.front();
+    S = S.drop_front();
+    Type *A = nullptr, *B = nullptr;
+    uint64_t N = 0;
+    switch (Kind) {
+    case 'T':
+      if (!(A = decodeType(S)))
+        return false;
+      Decls.TypedefDeclTypes.insert(A);
+      break;
+    case 'S':
+      if (!(A = decodeType(S)) || !(B = decodeType(S)))
+        return false;
+      Decls.SelectDeclTypes.insert(std::make_pair(A, B));
+      break;
+    case 'C':
+      if (!decodeNumber(S, N) || !(A = decodeType(S)))
+        return false;
+      Decls.CmpDeclTypes.insert(
+          std::make_pair(static_cast<CmpInst::Predicate>(N), A));
+      break;
+    case 'X':
+      if (!decodeNumber(S, N) || !(A = decodeType(S)) || !(B = decodeType(S)))
+        return false;
+      Decls.CastOpDeclTypes.insert(std::make_pair(
+          static_cast<CastInst::CastOps>(N), std::make_pair(A, B)));
+      break;
+    case 'I':
+      if (!decodeNumber(S, N) || !(A = decodeType(S)))
+        return false;
+      Decls.InlineOpDeclTypes.insert(std::make_pair(unsigned(N), A));
+      break;
+    case 'K':
+      if (!(A = decodeType(S)))
+        return false;
+      Decls.CtorDeclTypes.insert(A);
+      break;
+    case 'W':
+      if (!(A = decodeType(S)) || !(B = decodeType(S)))
+        return false;
+      Decls.CmpXchgDeclTypes.insert(std::make_pair(A, B));
+      break;
+    case 'R':
+      if (!decodeNumber(S, N) || !(A = decodeType(S)))
+        return false;
+      Decls.AtomicRMWDeclTypes.insert(std::make_pair(unsigned(N), A));
+      break;
+    case 'A':
+      Decls.UsesInt64Atomics = true;
+      break;
+    case 'M': {
+      StringRef Name, FuncName;
+      uint64_t Length, Align;
+      if (!decodeString(S, Name) || !decodeString(S, FuncName) ||
+          !decodeNumber(S, Length) || !decodeNumber(S, Align))
+        return false;
+      Function *F = M.getFunction(FuncName);
+      if (!F)
+        return false;
+      CLIntrinsicSite Site;
+      Site.Length = Length;
+      Site.Align = Align;
+      Decls.MemIntrinsicDecls[Name.str()] = std::make_pair(F, Site);
+      break;
+    }
+    default:
+      return false;
+    }
+    if (!S.consume_front("\n"))
+      return false;
+  }
+  Body = S.str();
+  return true;
+}
+
+void FunctionCache::store(StringRef Key, StringRef Body,
+                          const HeaderDecls &Decls) {
+  std::string Entry;
+  raw_string_ostream OS(Entry);
+  bool Encoded = true;
+  for (Type *Ty : Decls.TypedefDeclTypes) {
+    OS << 'T';
+    Encoded &= encodeType(Ty, OS);
+    OS << '\n';
+  }
+  for (auto &D : Decls.SelectDeclTypes) {
+    OS << 'S';
+    Encoded &= encodeType(D.first, OS) && encodeType(D.second, OS);
+    OS << '\n';
+  }
+  for (auto &D : Decls.CmpDeclTypes) {
+    OS << 'C' << unsigned(D.first) << ';';
+    Encoded &= encodeType(D.second, OS);
+    OS << '\n';
+  }
+  for (auto &D : Decls.CastOpDeclTypes) {
+    OS << 'X' << unsigned(D.first) << ';';
+    Encoded &= encodeType(D.second.first, OS) &&
+               encodeType(D.second.second, OS);
+    OS << '\n';
+  }
+  for (auto &D : Decls.InlineOpDeclTypes) {
+    OS << 'I' << D.first << ';';
+    Encoded &= encodeType(D.second, OS);
+    OS << '\n';
+  }
+  for (Type *Ty : Decls.CtorDeclTypes) {
+    OS << 'K';
+    Encoded &= encodeType(Ty, OS);
+    OS << '\n';
+  }
+  for (auto &D : Decls.CmpXchgDeclTypes) {
+    OS << 'W';
+    Encoded &= encodeType(D.first, OS) && encodeType(D.second, OS);
+    OS << '\n';
+  }
+  for (auto &D : Decls.AtomicRMWDeclTypes) {
+    OS << 'R' << D.first << ';';
+    Encoded &= encodeType(D.second, OS);
+    OS << '\n';
+  }
+  if (Decls.UsesInt64Atomics)
+    OS << "A\n";
+  for (auto &D : Decls.MemIntrinsicDecls) {
+    OS << 'M';
+    encodeString(D.first, OS);
+    encodeString(D.second.first->getName(), OS);
+    OS << D.second.second.Length << ';' << D.second.second.Align << ";\n";
+  }
+  if (!Encoded)
+    return;
+  OS << "body\n" << Body;
+  OS.flush();
+
+  // Write a temporary file first so that a concurrent translation never
+  // reads a partial entry.
+  int FD;
+  SmallString<128> TmpPath;
+  if (sys::fs::create_directories(Dir) ||
+      sys::fs::createUniqueFile(Twine(Dir) + "/" + Key + "-%%%%%%.tmp", FD,
+                                TmpPath))
+    return;
+  {
+    raw_fd_ostream File(FD, /*shouldClose=*/true);
+    File << Entry;
+  }
+  if (sys::fs::rename(TmpPath, getPath(Key)))
+    sys::fs::remove(TmpPath);
+}
+
+} // namespace llvm_opencl
@@ -0,0 +1,92 @@
+//===------------------ FunctionCache.h --------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares the function cache of the OpenCL backend, which keeps
+// printed function bodies in a directory together with the declarations they
+// need from the header, so that a function whose IR did not change is not
+// printed again.
+//
+//===----------------------------------------------------------------------===//
+#ifndef FUNCTIONCACHE_H
+#define FUNCTIONCACHE_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <map>
+#include <set>
+#include <string>
+
+#include "CLIntrinsics.h"
+#include "IDMap.h"
+
+namespace llvm_opencl {
+
+/// HeaderDecls - The types and helper functions used by the printed
+/// functions, which generateHeader declares.
+struct HeaderDecls {
+  std::set<llvm::Type *> TypedefDeclTypes;
+  std::set<std::pair<llvm::Type *, llvm::Type *>> SelectDeclTypes;
+  std::set<std::pair<llvm::CmpInst::Predicate, llvm::Type *>> CmpDeclTypes;
+  std::set<std::pair<llvm::CastInst::CastOps,
+                     std::pair<llvm::Type *, llvm::Type *>>>
+      CastOpDeclTypes;
+  std::set<std::pair<unsigned, llvm::Type *>> InlineOpDeclTypes;
+  std::set<llvm::Type *> CtorDeclTypes;
+  std::set<std::pair<llvm::Type *, llvm::Type *>> CmpXchgDeclTypes;
+  std::set<std::pair<unsigned, llvm::Type *>> AtomicRMWDeclTypes;
+  bool UsesInt64Atomics = false;
+  /// MemIntrinsicDecls - Definitions of memset/memcpy/memmove specialized for
+  /// the length and alignment of their call sites, by helper name.
+  std::map<std::string, std::pair<llvm::Function *, CLIntrinsicSite>>
+      MemIntrinsicDecls;
+
+  void merge(const HeaderDecls &Other);
+  void clear();
+};
+
+/// FunctionCache - Function bodies stored in a directory, one file per key.
+/// The key is the hash of everything the body is printed from. Types are
+/// stored by name, structs without a name by the number the writer gives
+/// them, so an entry can only be used with a module numbering them the same.
+class FunctionCache {
+  std::string Dir;
+  llvm::Module &M;
+  IDMap<llvm::StructType *> &StructIDs;
+  /// Structs - The structs numbered before any function is printed.
+  llvm::DenseMap<unsigned, llvm::StructType *> Structs;
+
+  std::string getPath(llvm::StringRef Key) const;
+  llvm::Type *decodeType(llvm::StringRef &S);
+
+public:
+  FunctionCache(llvm::StringRef Dir, llvm::Module &M,
+                IDMap<llvm::StructType *> &StructIDs);
+
+  /// Writes the code of Ty, returns false if Ty cannot be stored.
+  bool encodeType(llvm::Type *Ty, llvm::raw_ostream &OS);
+
+  /// Returns the key of the function described by Description.
+  static std::string getKey(llvm::StringRef Description);
+
+  /// Reads the entry of Key, returns false if there is none.
+  bool read(llvm::StringRef Key, std::string &Entry) const;
+  /// Restores the body and the declarations from an entry. May create types,
+  /// returns false if the entry does not fit the module.
+  bool parse(llvm::StringRef Entry, std::string &Body, HeaderDecls &Decls);
+  /// Stores an entry unless some declaration cannot be encoded.
+  void store(llvm::StringRef Key, llvm::StringRef Body,
+             const HeaderDecls &Decls);
+};
+
+} // namespace llvm_opencl
+
+#endif // FUNCTIONCACHE_H
@@ -1,3 +1,5 @@
+#pragma once
+
 #include "llvm/ADT/DenseMap.h"
 
 namespace llvm_opencl {
@@ -12,6 +14,8 @@ public:
 
   unsigned has(KeyT key) { return Map.count(key) > 0; }
 
+  unsigned size() const { return Map.size(); }
+
   unsigned getOrInsert(KeyT Key) {
     unsigned &i = Map[Key];
     if (i == 0) {
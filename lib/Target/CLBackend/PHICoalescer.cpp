@@ -0,0 +1,182 @@
+//===------------------ PHICoalescer.cpp -------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the PHI coalescer of the OpenCL backend.
+//
+// Liveness is computed per variable rather than per SSA value use: an operand
+// of an inlined expression is read where the expression is printed, and an
+// incoming value of a PHI is read by the copy at the end of the predecessor.
+// Two values interfere if one of them is live right after the other is
+// assigned.
+//
+//===----------------------------------------------------------------------===//
+#include "PHICoalescer.h"
+
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/IR/CFG.h"
+
+namespace llvm_opencl {
+
+using namespace llvm;
+
+void PHICoalescer::addUses(Value *V, unsigned Var) {
+  for (User *U : V->users()) {
+    Instruction *I = dyn_cast<Instruction>(U);
+    if (!I || !Position.count(I))
+      continue;
+    if (PHINode *PN = dyn_cast<PHINode>(I)) {
+      for (unsigned i = 0, e = PN->getNumIncomingValues(); i != e; ++i)
+        if (PN->getIncomingValue(i) == V &&
+            PhiUses.count(PN->getIncomingBlock(i)))
+          PhiUses[PN->getIncomingBlock(i)].set(Var);
+    } else if (IsInlined(*I)) {
+      addUses(I, Var);
+    } else {
+      UseSites[Var].push_back(I);
+    }
+  }
+}
+
+void PHICoalescer::computeLiveness() {
+  unsigned N = Vars.size();
+  DenseMap<BasicBlock *, BitVector> UpwardExposed, Defs, PhiDefs;
+  for (auto &Entry : LiveIn) {
+    BasicBlock *BB = Entry.first;
+    UpwardExposed[BB].resize(N);
+    Defs[BB].resize(N);
+    PhiDefs[BB].resize(N);
+  }
+
+  for (unsigned Var = 0; Var < N; ++Var) {
+    Instruction *Def = Vars[Var];
+    BasicBlock *DefBB = Def->getParent();
+    Defs[DefBB].set(Var);
+    if (isa<PHINode>(Def))
+      PhiDefs[DefBB].set(Var);
+    for (Instruction *Site : UseSites[Var])
+      if (Site->getParent() != DefBB ||
+          (!isa<PHINode>(Def) && Position[Site] < Position[Def]))
+        UpwardExposed[Site->getParent()].set(Var);
+  }
+
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (BasicBlock *BB : post_order(&F)) {
+      BitVector Out = PhiUses[BB];
+      for (BasicBlock *Succ : successors(BB)) {
+        BitVector In = LiveIn[Succ];
+        In.reset(PhiDefs[Succ]);
+        Out |= In;
+      }
+      BitVector In = Out;
+      In.reset(Defs[BB]);
+      In |= UpwardExposed[BB];
+      In |= PhiDefs[BB];
+      if (In != LiveIn[BB] || Out != LiveOut[BB]) {
+        LiveIn[BB] = In;
+        LiveOut[BB] = Out;
+        Changed = true;
+      }
+    }
+  }
+}
+
+// isLiveAfter - Return true if X is still needed right after Def is assigned.
+bool PHICoalescer::isLiveAfter(Instruction *X, Instruction *Def) const {
+  BasicBlock *BB = Def->getParent();
+  unsigned Var = VarIndex.lookup(X);
+  if (isa<PHINode>(Def))
+    return LiveIn.lookup(BB).test(Var);
+
+  unsigned DefPos = Position.lookup(Def);
+  if (X->getParent() == BB && !isa<PHINode>(X) &&
+      Position.lookup(X) > DefPos)
+    return false;
+  if (LiveOut.lookup(BB).test(Var))
+    return true;
+
+  // These are printed as a copy of the aggregate followed by a store to the
+  // element, so their operands are read after the result is written.
+  bool ReadsAfterWrite =
+      isa<InsertElementInst>(Def) || isa<InsertValueInst>(Def);
+  for (Instruction *Site : UseSites[Var])
+    if (Site->getParent() == BB &&
+        (Position.lookup(Site) > DefPos || (ReadsAfterWrite && Site == Def)))
+      return true;
+  return false;
+}
+
+bool PHICoalescer::interfere(Instruction *X, Instruction *Y) const {
+  return isLiveAfter(X, Y) || isLiveAfter(Y, X);
+}
+
+bool PHICoalescer::isCoalescable(Value *V) const {
+  Instruction *I = dyn_cast<Instruction>(V);
+  return I && VarIndex.count(I) && !Pinned.count(I);
+}
+
+void PHICoalescer::run() {
+  ReversePostOrderTraversal<Function *> RPOT(&F);
+  for (BasicBlock *BB : RPOT) {
+    unsigned Pos = 0;
+    for (Instruction &I : *BB) {
+      Position[&I] = Pos++;
+      if (IsVariable(I)) {
+        VarIndex[&I] = Vars.size();
+        Vars.push_back(&I);
+      }
+    }
+  }
+
+  unsigned N = Vars.size();
+  for (BasicBlock *BB : RPOT) {
+    LiveIn[BB].resize(N);
+    LiveOut[BB].resize(N);
+    PhiUses[BB].resize(N);
+  }
+  UseSites.resize(N);
+  for (unsigned Var = 0; Var < N; ++Var)
+    addUses(Vars[Var], Var);
+  computeLiveness();
+
+  for (BasicBlock *BB : RPOT) {
+    for (PHINode &PN : BB->phis()) {
+      if (!isCoalescable(&PN))
+        continue;
+      for (Value *V : PN.incoming_values()) {
+        if (!isCoalescable(V))
+          continue;
+        Value *A = getLeader(&PN), *B = getLeader(V);
+        if (A == B)
+          continue;
+
+        for (Value *Leader : {A, B})
+          if (!Members.count(Leader))
+            Members[Leader].push_back(cast<Instruction>(Leader));
+        auto &WebA = Members[A], &WebB = Members[B];
+        bool Interfere = false;
+        for (Instruction *X : WebA)
+          for (Instruction *Y : WebB)
+            Interfere = Interfere || interfere(X, Y);
+        if (Interfere)
+          continue;
+
+        for (Instruction *Y : WebB) {
+          Leaders[Y] = A;
+          WebA.push_back(Y);
+        }
+        Leaders[A] = A;
+        Members.erase(B);
+      }
+    }
+  }
+}
+
+} // namespace llvm_opencl
@@ -0,0 +1,84 @@
+//===------------------ PHICoalescer.h ---------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares the PHI coalescer which takes a function out of SSA
+// form for the OpenCL backend by sharing one C variable between a PHI node
+// and those of its incoming values whose live ranges do not interfere.
+//
+//===----------------------------------------------------------------------===//
+#ifndef PHICOALESCER_H
+#define PHICOALESCER_H
+
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+
+#include <functional>
+#include <vector>
+
+namespace llvm_opencl {
+
+class PHICoalescer {
+public:
+  using InstPredicate = std::function<bool(llvm::Instruction &)>;
+
+private:
+  llvm::Function &F;
+  /// IsVariable - The instruction is assigned to a C variable of its own.
+  InstPredicate IsVariable;
+  /// IsInlined - The instruction is printed as an expression at its uses.
+  InstPredicate IsInlined;
+
+  llvm::SmallPtrSet<llvm::Value *, 8> Pinned;
+
+  std::vector<llvm::Instruction *> Vars;
+  llvm::DenseMap<llvm::Instruction *, unsigned> VarIndex;
+  llvm::DenseMap<llvm::Instruction *, unsigned> Position;
+  /// UseSites - Positions of the statements reading each variable.
+  std::vector<llvm::SmallVector<llvm::Instruction *, 4>> UseSites;
+  /// PhiUses - Variables read by the PHI copies at the end of each block.
+  llvm::DenseMap<llvm::BasicBlock *, llvm::BitVector> PhiUses;
+  llvm::DenseMap<llvm::BasicBlock *, llvm::BitVector> LiveIn, LiveOut;
+
+  /// Leaders - The value naming the variable of each coalesced value.
+  llvm::DenseMap<llvm::Value *, llvm::Value *> Leaders;
+  llvm::DenseMap<llvm::Value *, llvm::SmallVector<llvm::Instruction *, 4>>
+      Members;
+
+  void addUses(llvm::Value *V, unsigned Var);
+  void computeLiveness();
+  bool isLiveAfter(llvm::Instruction *X, llvm::Instruction *Def) const;
+  bool interfere(llvm::Instruction *X, llvm::Instruction *Y) const;
+  bool isCoalescable(llvm::Value *V) const;
+
+public:
+  PHICoalescer(llvm::Function &F, InstPredicate IsVariable,
+               InstPredicate IsInlined)
+      : F(F), IsVariable(IsVariable), IsInlined(IsInlined) {}
+
+  /// Keeps the variable of V out of every PHI web.
+  void pin(llvm::Value *V) { Pinned.insert(V); }
+
+  /// Merges every PHI node with the incoming values which are not live at
+  /// the same time as the web built so far.
+  void run();
+
+  /// Returns the value whose variable holds V.
+  llvm::Value *getLeader(llvm::Value *V) const {
+    auto It = Leaders.find(V);
+    return It == Leaders.end() ? V : It->second;
+  }
+};
+
+} // namespace llvm_opencl
+
+#endif // PHICOALESCER_H
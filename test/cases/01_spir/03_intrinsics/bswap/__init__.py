@@ -0,0 +1,27 @@
+#!/usr/bin/env python3
+
+import numpy as np
+import pyopencl as cl
+from pyopencl import cltypes
+
+from test.opencl import Mem, run_kernel
+from test.cases.tester import Tester as BaseTester
+
+
+class Tester(BaseTester):
+    def __init__(self, *args):
+        super().__init__(*args, src="source.ll")
+        self.a = np.array([0, 1, 0x12345678, 0xff000000, 0xdeadbeef], dtype=cltypes.uint)
+        self.b = self.a.byteswap()
+        self.n = len(self.a)
+
+    def makeref(self):
+        return [self.a, self.b]
+
+    def run(self, src, **kws):
+        a = self.a
+        b = np.zeros_like(self.b)
+
+        run_kernel(self.ctx, src, (self.n,), *[Mem(x) for x in [a, b]])
+
+        return [a, b]
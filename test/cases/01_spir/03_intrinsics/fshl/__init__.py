@@ -0,0 +1,33 @@
+#!/usr/bin/env python3
+
+import numpy as np
+import pyopencl as cl
+from pyopencl import cltypes
+
+from test.opencl import Mem, run_kernel
+from test.cases.tester import Tester as BaseTester
+
+
+class Tester(BaseTester):
+    def __init__(self, *args):
+        super().__init__(*args, src="source.ll")
+        self.a = np.array([0x12345678, 0x12345678, 0x12345678, 0xffffffff, 1], dtype=cltypes.uint)
+        self.b = np.array([0x9abcdef0, 0x9abcdef0, 0x9abcdef0, 0, 0x80000000], dtype=cltypes.uint)
+        self.c = np.array([0, 4, 36, 31, 1], dtype=cltypes.uint)
+        s = (self.c % 32).astype(np.uint64)
+        ab = (self.a.astype(np.uint64) << np.uint64(32)) | self.b.astype(np.uint64)
+        self.d = ((ab << s) >> np.uint64(32)).astype(cltypes.uint)
+        self.n = len(self.a)
+
+    def makeref(self):
+        return [self.a, self.b, self.c, self.d]
+
+    def run(self, src, **kws):
+        a = self.a
+        b = self.b
+        c = self.c
+        d = np.zeros_like(self.d)
+
+        run_kernel(self.ctx, src, (self.n,), *[Mem(x) for x in [a, b, c, d]])
+
+        return [a, b, c, d]
@@ -0,0 +1,28 @@
+#!/usr/bin/env python3
+
+import numpy as np
+import pyopencl as cl
+from pyopencl import cltypes
+
+from test.opencl import Mem, run_kernel
+from test.cases.tester import Tester as BaseTester
+
+
+class Tester(BaseTester):
+    def __init__(self, *args):
+        super().__init__(*args, src="source.ll")
+        self.n = 4
+        self.a = np.arange(32*self.n, dtype=cltypes.uchar)
+
+    def makeref(self):
+        a = self.a.copy().reshape(self.n, 32)
+        a[:, 3:15] = a[:, 0:12].copy() # backward
+        a[:, 16:29] = a[:, 19:32].copy() # forward
+        return [a.flatten()]
+
+    def run(self, src, **kws):
+        a = self.a.copy()
+
+        run_kernel(self.ctx, src, (self.n,), *[Mem(x) for x in [a]])
+
+        return [a]
@@ -0,0 +1,22 @@
+target datalayout = "e-p:32:32-i64:64-v16:16-v24:32-v32:32-v48:64-v96:128-v192:256-v256:256-v512:512-v1024:1024"
+target triple = "spir-unknown-unknown"
+
+define dso_local spir_kernel void @kernel_main(
+  i8 addrspace(1)*
+) {
+  %i = tail call spir_func i32 @_Z13get_global_idj(i32 0)
+  %o = mul i32 %i, 32
+  %row = getelementptr inbounds i8, i8 addrspace(1)* %0, i32 %o
+
+  %dst0 = getelementptr inbounds i8, i8 addrspace(1)* %row, i32 3
+  call void @llvm.memmove.p1i8.p1i8.i32(i8 addrspace(1)* align 1 %dst0, i8 addrspace(1)* align 16 %row, i32 12, i1 false)
+
+  %dst1 = getelementptr inbounds i8, i8 addrspace(1)* %row, i32 16
+  %src1 = getelementptr inbounds i8, i8 addrspace(1)* %row, i32 19
+  call void @llvm.memmove.p1i8.p1i8.i32(i8 addrspace(1)* align 16 %dst1, i8 addrspace(1)* align 1 %src1, i32 13, i1 false)
+
+  ret void
+}
+
+declare dso_local spir_func i32 @_Z13get_global_idj(i32)
+declare void @llvm.memmove.p1i8.p1i8.i32(i8 addrspace(1)*, i8 addrspace(1)*, i32, i1)
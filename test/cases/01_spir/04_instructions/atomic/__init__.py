@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+
+import numpy as np
+import pyopencl as cl
+from pyopencl import cltypes
+
+from test.opencl import Mem, run_kernel
+from test.translate import translate
+from test.cases.tester import Tester as BaseTester
+
+
+class Tester(BaseTester):
+    def __init__(self, *args):
+        super().__init__(*args, src="source.ll")
+        self.n = 64
+
+    def explicit_supported(self):
+        # -cl-explicit-atomics prints OpenCL C 2.0 atomics
+        return all([
+            float(d.opencl_c_version.split()[2]) >= 2.0
+            for d in self.ctx.devices
+        ])
+
+    def translate(self, src, **kws):
+        if not kws.get("explicit", False):
+            return super().translate(src, **kws)
+        fe = {"opt": kws["opt"], "debug": kws.get("debug", False)}
+        suffix = "o{}.ea".format(kws["opt"])
+        be = {"args": ["-cl-explicit-atomics"]}
+        if "threads" in kws:
+            suffix += ".t{}".format(kws["threads"])
+            be["args"].append("-cl-emit-threads={}".format(kws["threads"]))
+        return translate(src, suffix=suffix, fe=fe, be=be)
+
+    def test(self, src, **kws):
+        dst = super().test(src, **kws)
+        if self.explicit_supported():
+            super().test(src, **kws, explicit=True)
+        return dst
+
+    def makeref(self):
+        n = self.n
+        return [
+            np.array([n, 1, 1], dtype=cltypes.uint),
+            np.array([n], dtype=cltypes.float),
+            np.arange(n, dtype=cltypes.uint),
+            np.ones(n, dtype=cltypes.uint),
+        ]
+
+    def run(self, src, **kws):
+        n = self.n
+        cnt = np.zeros(3, dtype=cltypes.uint)
+        fsum = np.zeros(1, dtype=cltypes.float)
+        out = np.zeros(2*n, dtype=cltypes.uint)
+        options = ["-cl-std=CL2.0"] if kws.get("explicit", False) else []
+        run_kernel(
+            self.ctx, src, (n,), *[Mem(x) for x in [cnt, fsum, out]],
+            options=options,
+        )
+        return [
+            cnt, fsum, np.sort(out[:n]),
+            (out[n:] == out[:n]).astype(cltypes.uint),
+        ]
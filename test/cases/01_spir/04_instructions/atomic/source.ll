@@ -0,0 +1,36 @@
+target datalayout = "e-p:32:32-i64:64-v16:16-v24:32-v32:32-v48:64-v96:128-v192:256-v256:256-v512:512-v1024:1024"
+target triple = "spir-unknown-unknown"
+
+define dso_local spir_kernel void @kernel_main(
+  i32 addrspace(1)*,
+  float addrspace(1)*,
+  i32 addrspace(1)*
+) {
+  %i = tail call spir_func i32 @_Z13get_global_idj(i32 0)
+  %n = tail call spir_func i32 @_Z15get_global_sizej(i32 0)
+
+  ; Each work item gets a distinct ticket.
+  %ticket = atomicrmw add i32 addrspace(1)* %0, i32 1 seq_cst
+  %f = atomicrmw fadd float addrspace(1)* %1, float 1.0 seq_cst
+
+  ; Exactly one work item swaps the flag.
+  %flag = getelementptr inbounds i32, i32 addrspace(1)* %0, i32 1
+  %pair = cmpxchg i32 addrspace(1)* %flag, i32 0, i32 1 acq_rel monotonic
+  %won = extractvalue { i32, i1 } %pair, 1
+  %winner = zext i1 %won to i32
+  %winners = getelementptr inbounds i32, i32 addrspace(1)* %0, i32 2
+  %w = atomicrmw add i32 addrspace(1)* %winners, i32 %winner monotonic
+
+  fence seq_cst
+
+  %tp = getelementptr inbounds i32, i32 addrspace(1)* %2, i32 %i
+  store atomic i32 %ticket, i32 addrspace(1)* %tp release, align 4
+  %t = load atomic i32, i32 addrspace(1)* %tp acquire, align 4
+  %j = add i32 %i, %n
+  %cp = getelementptr inbounds i32, i32 addrspace(1)* %2, i32 %j
+  store i32 %t, i32 addrspace(1)* %cp, align 4
+  ret void
+}
+
+declare dso_local spir_func i32 @_Z13get_global_idj(i32)
+declare dso_local spir_func i32 @_Z15get_global_sizej(i32)
@@ -0,0 +1,33 @@
+target datalayout = "e-p:32:32-i64:64-v16:16-v24:32-v32:32-v48:64-v96:128-v192:256-v256:256-v512:512-v1024:1024"
+target triple = "spir-unknown-unknown"
+
+@tile = internal addrspace(3) global [64 x i32] undef, align 4
+
+define internal spir_func i32 @load_tile(i32 %j) {
+  %p = getelementptr inbounds [64 x i32], [64 x i32] addrspace(3)* @tile, i32 0, i32 %j
+  %v = load i32, i32 addrspace(3)* %p, align 4
+  %r = add i32 %v, 1
+  ret i32 %r
+}
+
+define dso_local spir_kernel void @kernel_main(
+  i32 addrspace(1)* readonly,
+  i32 addrspace(1)*
+) {
+  %i = tail call spir_func i32 @_Z13get_global_idj(i32 0)
+  %j = tail call spir_func i32 @_Z12get_local_idj(i32 0)
+  %ap = getelementptr inbounds i32, i32 addrspace(1)* %0, i32 %i
+  %a = load i32, i32 addrspace(1)* %ap, align 4
+  %a2 = mul i32 %a, 2
+  %tp = getelementptr inbounds [64 x i32], [64 x i32] addrspace(3)* @tile, i32 0, i32 %j
+  store i32 %a2, i32 addrspace(3)* %tp, align 4
+
+  %b = call spir_func i32 @load_tile(i32 %j)
+
+  %bp = getelementptr inbounds i32, i32 addrspace(1)* %1, i32 %i
+  store i32 %b, i32 addrspace(1)* %bp, align 4
+  ret void
+}
+
+declare dso_local spir_func i32 @_Z13get_global_idj(i32)
+declare dso_local spir_func i32 @_Z12get_local_idj(i32)
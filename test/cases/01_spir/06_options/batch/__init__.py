@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+
+import os
+import filecmp
+from subprocess import run
+
+import numpy as np
+import pyopencl as cl
+from pyopencl import cltypes
+
+from test.opencl import Mem, run_kernel
+from test.translate import frontend, backend
+from test.cases.tester import Tester as BaseTester
+
+
+class Tester(BaseTester):
+    def __init__(self, *args):
+        super().__init__(*args, src=["first.ll", "second.ll"])
+        self.n = 64
+        self.a = np.arange(self.n, dtype=cltypes.uint)
+
+    def translate(self, src, **kws):
+        # The first input is given on the command line and the second one in
+        # -input-list. Both are translated by one process, next to the input.
+        suffix = "o{}".format(kws["opt"])
+        args = ["-j2"]
+        if "threads" in kws:
+            suffix += ".t{}".format(kws["threads"])
+            args.append("-cl-emit-threads={}".format(kws["threads"]))
+        fe = {"opt": kws["opt"], "debug": kws.get("debug", False)}
+        irs, dsts = [], []
+        for s in src:
+            ir = "{}.{}.gen.ll".format(s, suffix)
+            frontend(s, ir, **fe)
+            irs.append(ir)
+            dsts.append("{}.gen.cl".format(ir[:-len(".ll")]))
+            if os.path.exists(dsts[-1]):
+                os.remove(dsts[-1])
+
+        inputs = os.path.join(self.loc, "inputs.{}.gen.txt".format(suffix))
+        with open(inputs, "w") as f:
+            f.write("\n".join(irs[1:]) + "\n")
+        run(["llvm-opencl", *args, irs[0], "-input-list", inputs], check=True)
+
+        # Each output is the same as the one of the input translated alone.
+        for ir, dst in zip(irs, dsts):
+            single = "{}.single.cl".format(ir)
+            backend(ir, single, args=args[1:])
+            if not filecmp.cmp(dst, single, shallow=False):
+                raise AssertionError("{} differs from {}".format(dst, single))
+        return dsts
+
+    def check_threads(self, src, dst, **kws):
+        tdst = self.translate(src, **kws, threads=4)
+        for d, t in zip(dst, tdst):
+            if not filecmp.cmp(d, t, shallow=False):
+                raise AssertionError("{} differs from {}".format(t, d))
+
+    def makeref(self):
+        return [2*self.a, self.a + 3]
+
+    def run(self, src, **kws):
+        res = []
+        for s in src:
+            b = np.zeros_like(self.a)
+            run_kernel(self.ctx, s, (self.n,), *[Mem(x) for x in [self.a, b]])
+            res.append(b)
+        return res
@@ -0,0 +1,47 @@
+#!/usr/bin/env python3
+
+import os
+import filecmp
+import tempfile
+
+import numpy as np
+import pyopencl as cl
+from pyopencl import cltypes
+
+from test.opencl import Mem, run_kernel
+from test.cases.tester import Tester as BaseTester
+
+
+class Tester(BaseTester):
+    def __init__(self, *args):
+        super().__init__(*args, src="source.ll")
+        self.edited = os.path.join(self.loc, "edited.ll")
+        self.n = 64
+        self.a = np.arange(self.n, dtype=cltypes.uint)
+
+    def translate(self, src, **kws):
+        # Fill the cache with the source, then translate it once more with
+        # the first function changed, so the second one comes from the cache.
+        # The first function is also no longer readnone, so a load in the
+        # kernel cannot be moved past the call anymore.
+        with tempfile.TemporaryDirectory() as cache:
+            args = ["-cl-function-cache={}".format(cache)]
+            super().translate(src, **kws, args=args)
+            if not os.listdir(cache):
+                raise AssertionError("{} is empty".format(cache))
+            dst = super().translate(self.edited, **kws, args=args)
+
+        # The cached functions must be printed as without the cache.
+        cold = super().translate(self.edited, **kws, suffix="cold")
+        if not filecmp.cmp(dst, cold, shallow=False):
+            raise AssertionError("{} differs from {}".format(dst, cold))
+        return dst
+
+    def makeref(self):
+        return [self.a, 2*self.a + 1]
+
+    def run(self, src, **kws):
+        a = self.a
+        b = np.zeros_like(a)
+        run_kernel(self.ctx, src, (self.n,), *[Mem(x) for x in [a, b]])
+        return [a, b]
@@ -0,0 +1,51 @@
+#!/usr/bin/env python3
+
+import filecmp
+from subprocess import run
+
+import numpy as np
+import pyopencl as cl
+from pyopencl import cltypes
+
+from test.opencl import Mem, run_kernel
+from test.translate import frontend, backend
+from test.cases.tester import Tester as BaseTester
+
+
+class Tester(BaseTester):
+    def __init__(self, *args):
+        super().__init__(*args, src="source.ll")
+        self.n = 64
+        self.a = np.arange(self.n, dtype=cltypes.uint)
+
+    def translate(self, src, **kws):
+        # The bitcode is assembled without optimization, so that the alias
+        # and the unreachable function are kept, and is read lazily by
+        # default. The output must be the same as when it is read at once.
+        suffix = "o{}".format(kws["opt"])
+        args = []
+        if "threads" in kws:
+            suffix += ".t{}".format(kws["threads"])
+            args.append("-cl-emit-threads={}".format(kws["threads"]))
+        ir = src
+        if not src.endswith(".ll"):
+            ir = "{}.{}.gen.ll".format(src, suffix)
+            frontend(src, ir, opt=0)
+        bc = "{}.{}.gen.bc".format(src, suffix)
+        run(["llvm-as", ir, "-o", bc], check=True)
+
+        lazy = "{}.{}.gen.cl".format(src, suffix)
+        eager = "{}.{}.eager.gen.cl".format(src, suffix)
+        backend(bc, lazy, args=args)
+        backend(bc, eager, args=[*args, "-lazy-load=false"])
+        if not filecmp.cmp(lazy, eager, shallow=False):
+            raise AssertionError("{} differs from {}".format(lazy, eager))
+        return lazy
+
+    def makeref(self):
+        return [3*self.a]
+
+    def run(self, src, **kws):
+        b = np.zeros_like(self.a)
+        run_kernel(self.ctx, src, (self.n,), *[Mem(x) for x in [self.a, b]])
+        return [b]
@@ -0,0 +1,31 @@
+target datalayout = "e-p:32:32-i64:64-v16:16-v24:32-v32:32-v48:64-v96:128-v192:256-v256:256-v512:512-v1024:1024"
+target triple = "spir-unknown-unknown"
+
+; The kernel reaches @triple_impl only through the alias.
+@triple = internal alias i32 (i32), i32 (i32)* @triple_impl
+
+define internal spir_func i32 @triple_impl(i32 %x) {
+  %r = mul i32 %x, 3
+  ret i32 %r
+}
+
+; Not reachable from any kernel.
+define dso_local spir_func i32 @unused(i32 %x) {
+  %r = sub i32 %x, 1
+  ret i32 %r
+}
+
+define dso_local spir_kernel void @kernel_main(
+  i32 addrspace(1)* readonly,
+  i32 addrspace(1)*
+) {
+  %i = tail call spir_func i32 @_Z13get_global_idj(i32 0)
+  %ap = getelementptr inbounds i32, i32 addrspace(1)* %0, i32 %i
+  %a = load i32, i32 addrspace(1)* %ap, align 4
+  %r = call spir_func i32 @triple(i32 %a)
+  %bp = getelementptr inbounds i32, i32 addrspace(1)* %1, i32 %i
+  store i32 %r, i32 addrspace(1)* %bp, align 4
+  ret void
+}
+
+declare dso_local spir_func i32 @_Z13get_global_idj(i32)
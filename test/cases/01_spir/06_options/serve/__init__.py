@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+
+import os
+import time
+import socket
+import tempfile
+from subprocess import Popen
+
+import numpy as np
+import pyopencl as cl
+from pyopencl import cltypes
+
+from test.opencl import Mem, run_kernel
+from test.translate import frontend
+from test.cases.tester import Tester as BaseTester
+
+
+def request(path, data):
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as s:
+        # The socket is bound a moment before the server listens on it.
+        for i in range(100):
+            try:
+                s.connect(path)
+                break
+            except ConnectionRefusedError:
+                time.sleep(0.05)
+        s.sendall(data)
+        s.shutdown(socket.SHUT_WR)
+        reply = b""
+        while True:
+            chunk = s.recv(65536)
+            if not chunk:
+                break
+            reply += chunk
+    status, text = reply.split(b"\n", 1)
+    return status.decode(), text.decode()
+
+
+class Server:
+    def __init__(self, path, *args):
+        self.path = path
+        self.proc = Popen(["llvm-opencl", "--serve", path, *args])
+        for i in range(100):
+            if os.path.exists(path):
+                return
+            time.sleep(0.05)
+        self.proc.kill()
+        raise Exception("{} is not served".format(path))
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.proc.kill()
+        self.proc.wait()
+
+
+class Tester(BaseTester):
+    def __init__(self, *args):
+        super().__init__(*args, src="source.ll")
+        self.n = 64
+        self.a = np.arange(self.n, dtype=cltypes.uint)
+
+    def translate(self, src, **kws):
+        suffix = "o{}".format(kws["opt"])
+        ir = "{}.{}.serve.gen.ll".format(src, suffix)
+        dst = "{}.{}.serve.gen.cl".format(src, suffix)
+        frontend(src, ir, opt=kws["opt"], debug=kws.get("debug", False))
+        with open(ir, "rb") as f:
+            module = f.read()
+
+        with tempfile.TemporaryDirectory() as tmp:
+            cache = os.path.join(tmp, "cache")
+            first = os.path.join(tmp, "first.sock")
+            with Server(first, "-j2", "--serve-cache-dir", cache):
+                status, code = request(first, b"\n" + module)
+                assert status == "ok", code
+                status, text = request(first, b"\nnot a module")
+                assert status == "error", text
+                assert request(first, b"\n" + module) == ("ok", code)
+
+            # Another server on another socket and with other workers finds
+            # the translation in the directory, even if it was changed there.
+            entries = os.listdir(cache)
+            assert len(entries) == 1, entries
+            marked = "// cached\n" + code
+            with open(os.path.join(cache, entries[0]), "w") as f:
+                f.write(marked)
+            second = os.path.join(tmp, "second.sock")
+            with Server(second, "-j1", "--serve-cache-dir", cache):
+                assert request(second, b"\n" + module) == ("ok", marked)
+
+        with open(dst, "w") as f:
+            f.write(code)
+        return dst
+
+    def check_threads(self, src, dst, **kws):
+        # The server translates with the options it was started with.
+        pass
+
+    def makeref(self):
+        return [2*self.a]
+
+    def run(self, src, **kws):
+        b = np.zeros_like(self.a)
+        run_kernel(self.ctx, src, (self.n,), *[Mem(x) for x in [self.a, b]])
+        return [b]
@@ -0,0 +1,11 @@
+typedef struct {
+    int x, y;
+    int z[2];
+} A;
+
+__kernel void kernel_main(__global const A *a, __global A *b) {
+    int i = get_global_id(0);
+    A s = a[i];
+    s.x += 1;
+    b[i] = s;
+}
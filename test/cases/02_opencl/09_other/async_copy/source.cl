@@ -0,0 +1,9 @@
+__kernel void kernel_main(__global const int *a, __global int *b) {
+    __local int tile[64];
+    int l = get_local_id(0);
+    int n = get_local_size(0);
+    event_t e = async_work_group_copy(tile, a + get_group_id(0) * n, n, 0);
+    wait_group_events(1, &e);
+    barrier(CLK_LOCAL_MEM_FENCE);
+    b[get_global_id(0)] = 2 * tile[l];
+}
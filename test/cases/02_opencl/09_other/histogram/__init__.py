@@ -0,0 +1,21 @@
+#!/usr/bin/env python3
+
+import numpy as np
+import pyopencl as cl
+from pyopencl import cltypes
+
+from test.opencl import Mem, run_kernel
+from test.cases.tester import Tester as BaseTester
+
+
+class Tester(BaseTester):
+    def __init__(self, *args):
+        super().__init__(*args, src="source.cl")
+
+    def run(self, src, **kws):
+        n = 256
+        a = ((np.arange(n, dtype=cltypes.uint) * 37) % 211).astype(cltypes.uint)
+        hist = np.zeros(17, dtype=cltypes.uint)
+        s = np.zeros(1, dtype=cltypes.int)
+        run_kernel(self.ctx, src, (n,), *[Mem(x) for x in [a, hist, s]])
+        return (hist, s)
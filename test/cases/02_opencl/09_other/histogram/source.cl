@@ -0,0 +1,7 @@
+__kernel void kernel_main(__global const uint *a, __global uint *hist, __global int *sum) {
+    int i = get_global_id(0);
+    uint v = a[i];
+    atomic_inc(&hist[v % 16]);
+    atomic_add(sum, (int)v - 100);
+    atomic_max(&hist[16], v);
+}
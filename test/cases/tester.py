@@ -1,4 +1,5 @@
 import os
+import filecmp
 
 import numpy as np
 
@@ -26,7 +27,20 @@ class Tester:
         fe = {"opt": opt, "debug": kws.get("debug", False)}
         if "std" in kws:
             fe["std"] = kws["std"]
-        return translate(src, suffix="o{}".format(opt), fe=fe)
+        suffix = "o{}".format(opt)
+        if "suffix" in kws:
+            suffix += ".{}".format(kws["suffix"])
+        be = {"args": list(kws.get("args", []))}
+        if "threads" in kws:
+            suffix += ".t{}".format(kws["threads"])
+            be["args"].append("-cl-emit-threads={}".format(kws["threads"]))
+        return translate(src, suffix=suffix, fe=fe, be=be)
+
+    def check_threads(self, src, dst, **kws):
+        # The output must not depend on the number of threads printing it.
+        tdst = self.translate(src, **kws, threads=4)
+        if not filecmp.cmp(dst, tdst, shallow=False):
+            raise AssertionError("{} differs from {}".format(tdst, dst))
 
     def check(self, res, **kws):
         assert len(self.ref) == len(res)
@@ -44,6 +58,7 @@ class Tester:
     def test(self, src, **kws):
         try:
             dst = self.translate(src, **kws)
+            self.check_threads(src, dst, **kws)
         except Exception as e:
             raise Exception(src) from e
 
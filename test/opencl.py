@@ -9,7 +9,7 @@ class Mem:
     def __init__(self, content):
         self.content = content
 
-def run_kernel(ctx, src_file, shape, *args, name="kernel_main", src=None):
+def run_kernel(ctx, src_file, shape, *args, name="kernel_main", src=None, options=[]):
     queue = cl.CommandQueue(ctx)
 
     mf = cl.mem_flags
@@ -29,7 +29,7 @@ def run_kernel(ctx, src_file, shape, *args, name="kernel_main", src=None):
             with open(sf, "r") as f:
                 src += f.read() + "\n"
     
-    prg = cl.Program(ctx, src).build()
+    prg = cl.Program(ctx, src).build(options=options)
     queue.flush()
     queue.finish()
 
@@ -109,9 +109,9 @@ def frontend(src, ir, opt=3, ty=None, std=None, debug=False):
     except SubprocessError as e:
         raise FrontendError(src) from e
 
-def backend(ir, dst):
+def backend(ir, dst, args=[]):
     try:
-        run(["llvm-opencl", ir, "-o", dst], check=True)
+        run(["llvm-opencl", *args, ir, "-o", dst], check=True)
     except SubprocessError as e:
         raise BackendError(ir) from e
 
@@ -13,37 +13,60 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "CLTranslate.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/Triple.h"
-#include "llvm/Analysis/TargetLibraryInfo.h"
-#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/CodeGen/CommandFlags.inc"
 #include "llvm/CodeGen/LinkAllAsmWriterComponents.h"
 #include "llvm/CodeGen/LinkAllCodegenComponents.h"
 #include "llvm/CodeGen/TargetPassConfig.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DiagnosticHandler.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
 #include "llvm/IR/IRPrintingPasses.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/LLVMContext.h"
-#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IRReader/IRReader.h"
-#include "llvm/MC/SubtargetFeature.h"
 #include "llvm/Pass.h"
 #include "llvm/InitializePasses.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/Error.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/FormattedStream.h"
 #include "llvm/Support/Host.h"
 #include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/PluginLoader.h"
 #include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/SHA1.h"
 #include "llvm/Support/Signals.h"
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Target/TargetMachine.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <thread>
+
+#ifdef LLVM_ON_UNIX
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 using namespace llvm;
 
 extern "C" void LLVMInitializeCLBackendTarget();
@@ -54,12 +77,22 @@ extern "C" void LLVMInitializeCLBackendTargetMC();
 // within the corresponding llc passes, and target-specific options
 // and back-end code generation options are specified with the target machine.
 //
+static cl::list<std::string> InputFilenames(cl::Positional, cl::ZeroOrMore,
+                                            cl::desc("<input bitcode>..."));
+
 static cl::opt<std::string>
-    InputFilename(cl::Positional, cl::desc("<input bitcode>"), cl::init("-"));
+    InputList("input-list", cl::value_desc("filename"),
+              cl::desc("Also translate the files listed in this file, one per "
+                       "line"));
 
 static cl::opt<std::string> OutputFilename("o", cl::desc("Output filename"),
                                            cl::value_desc("filename"));
 
+static cl::opt<unsigned>
+    Jobs("j", cl::init(0), cl::value_desc("N"),
+         cl::desc("Translate N inputs at once, 0 for one per hardware "
+                  "thread"));
+
 static cl::opt<unsigned>
     TimeCompilations("time-compilations", cl::Hidden, cl::init(1u),
                      cl::value_desc("N"),
@@ -78,7 +111,33 @@ static cl::opt<std::string>
 cl::opt<bool> NoVerify("disable-verify", cl::Hidden,
                        cl::desc("Do not verify input module"));
 
-static int compileModule(char **, LLVMContext &);
+#ifdef LLVM_ON_UNIX
+static cl::opt<std::string>
+    ServeSocket("serve", cl::value_desc("socket"),
+                cl::desc("Serve translation requests on this Unix domain "
+                         "socket"));
+
+static cl::opt<std::string>
+    ServeCacheDir("serve-cache-dir", cl::value_desc("directory"),
+                  cl::desc("Keep the translations served in this directory"));
+
+static cl::opt<unsigned>
+    ServeCacheSize("serve-cache-size", cl::init(256), cl::value_desc("MB"),
+                   cl::desc("Keep at most this many megabytes of "
+                            "translations in memory"));
+
+#endif
+
+static cl::opt<bool>
+    LazyLoad("lazy-load", cl::init(true),
+             cl::desc("Only load the bodies of the functions reachable from "
+                      "kernels"));
+
+static int compileModule(char **, LLVMContext &, const std::string &,
+                         raw_ostream &);
+#ifdef LLVM_ON_UNIX
+static int serve(const char *, const std::string &);
+#endif
 
 // GetFileNameRoot - Helper function to get the basename of a filename.
 static inline std::string GetFileNameRoot(const std::string &InputFilename) {
@@ -95,10 +154,11 @@ static inline std::string GetFileNameRoot(const std::string &InputFilename) {
   return outputFilename;
 }
 
-static ToolOutputFile *GetOutputStream(const char *TargetName,
-                                       Triple::OSType OS,
-                                       const char *ProgName) {
+static ToolOutputFile *GetOutputStream(const char *ProgName,
+                                       const std::string &InputFilename,
+                                       raw_ostream &Errs) {
   // If we don't yet have an output filename, make one.
+  std::string OutputFilename = ::OutputFilename;
   if (OutputFilename.empty()) {
     if (InputFilename == "-")
       OutputFilename = "-";
@@ -136,7 +196,7 @@ static ToolOutputFile *GetOutputStream(const char *TargetName,
   ToolOutputFile *FDOut =
       new ToolOutputFile(OutputFilename.c_str(), error, OpenFlags);
   if (error) {
-    errs() << error.message() << '\n';
+    Errs << error.message() << '\n';
     delete FDOut;
     return 0;
   }
@@ -144,7 +204,108 @@ static ToolOutputFile *GetOutputStream(const char *TargetName,
   return FDOut;
 }
 
-static LLVMContext TheContext;
+// collectFunctions - Add the functions V refers to, directly or through
+// constant expressions and aliases, to the worklist.
+static void collectFunctions(Value *V, SmallPtrSetImpl<Function *> &Reached,
+                             std::vector<Function *> &Worklist) {
+  if (Function *F = dyn_cast<Function>(V)) {
+    if (Reached.insert(F).second)
+      Worklist.push_back(F);
+  } else if (GlobalAlias *GA = dyn_cast<GlobalAlias>(V)) {
+    collectFunctions(GA->getAliasee(), Reached, Worklist);
+  } else if (isa<Constant>(V) && !isa<GlobalValue>(V)) {
+    for (Value *Op : cast<Constant>(V)->operands())
+      collectFunctions(Op, Reached, Worklist);
+  }
+}
+
+// materializeKernelFunctions - Load the bodies of the kernels of a lazily
+// read module and of the functions they refer to. The backend prints nothing
+// else, so the remaining bodies are dropped without being read.
+static Error materializeKernelFunctions(Module &M) {
+  SmallPtrSet<Function *, 32> Reached;
+  std::vector<Function *> Worklist;
+  for (Function &F : M)
+    if (F.getCallingConv() == CallingConv::SPIR_KERNEL)
+      collectFunctions(&F, Reached, Worklist);
+
+  while (!Worklist.empty()) {
+    Function *F = Worklist.back();
+    Worklist.pop_back();
+    if (Error E = F->materialize())
+      return E;
+    for (Instruction &I : instructions(F))
+      for (Value *Op : I.operands())
+        collectFunctions(Op, Reached, Worklist);
+  }
+
+  for (Function &F : M)
+    if (F.isMaterializable())
+      F.deleteBody();
+  return Error::success();
+}
+
+// readInputList - Append the non-empty lines of the InputList file to Inputs.
+static bool readInputList(const char *ProgName,
+                          std::vector<std::string> &Inputs) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> List =
+      MemoryBuffer::getFileOrSTDIN(InputList);
+  if (std::error_code EC = List.getError()) {
+    errs() << ProgName << ": " << InputList << ": " << EC.message() << "\n";
+    return false;
+  }
+  SmallVector<StringRef, 16> Lines;
+  (*List)->getBuffer().split(Lines, '\n', -1, false);
+  for (StringRef Line : Lines)
+    if (!Line.trim().empty())
+      Inputs.push_back(Line.trim().str());
+  return true;
+}
+
+// DiagnosticLog - Print the diagnostics reported to a context which do not
+// stop the translation, such as warnings, to Log. Errors are left to the
+// handler translate installs.
+struct DiagnosticLog : DiagnosticHandler {
+  raw_ostream &Log;
+
+  explicit DiagnosticLog(raw_ostream &Log) : Log(Log) {}
+
+  bool handleDiagnostics(const DiagnosticInfo &DI) override {
+    if (DI.getSeverity() == DS_Error)
+      return false;
+    Log << LLVMContext::getDiagnosticMessagePrefix(DI.getSeverity()) << ": ";
+    DiagnosticPrinterRawOStream DP(Log);
+    DI.print(DP);
+    Log << "\n";
+    return true;
+  }
+};
+
+#ifdef LLVM_ON_UNIX
+// getTranslationOptions - The part of the key of every translation served
+// which comes from the server: the version of the backend and the options
+// which change the code printed. Servers which only differ in their socket,
+// workers or caches share the translations kept in a directory.
+static std::string getTranslationOptions(int argc, char **argv) {
+  static const StringRef ServerOnly[] = {
+      "serve", "serve-cache-dir", "serve-cache-size", "j",
+      "cl-emit-threads", "cl-function-cache"};
+  std::string Options = llvm_opencl::getBackendVersion();
+  for (int i = 1; i < argc; ++i) {
+    std::pair<StringRef, StringRef> Arg =
+        StringRef(argv[i]).ltrim('-').split('=');
+    if (is_contained(ServerOnly, Arg.first)) {
+      // The value may be the next argument.
+      if (!StringRef(argv[i]).contains('='))
+        ++i;
+      continue;
+    }
+    Options += ' ';
+    Options += argv[i];
+  }
+  return Options;
+}
+#endif
 
 // main - Entry point for the llc compiler.
 //
@@ -181,143 +342,413 @@ int main(int argc, char **argv) {
 
   cl::ParseCommandLineOptions(argc, argv, "llvm system compiler\n");
 
-  // Compile the module TimeCompilations times to give better compile time
-  // metrics.
-  for (unsigned I = TimeCompilations; I; --I)
-    if (int RetVal = compileModule(argv, TheContext))
-      return RetVal;
-  return 0;
-}
-
-static int compileModule(char **argv, LLVMContext &Context) {
-  // Load the module to be compiled...
-  SMDiagnostic Err;
-
-  std::unique_ptr<Module> M;
-
-  Module *mod = 0;
-  Triple TheTriple;
+  std::vector<std::string> Inputs(InputFilenames.begin(),
+                                  InputFilenames.end());
+  if (!InputList.empty() && !readInputList(argv[0], Inputs))
+    return 1;
+  if (Inputs.empty())
+    Inputs.push_back("-");
+  if (Inputs.size() > 1 && !OutputFilename.empty()) {
+    errs() << argv[0] << ": -o cannot be used with several inputs\n";
+    return 1;
+  }
 
-  bool SkipModule =
-      MCPU == "help" || (!MAttrs.empty() && MAttrs.front() == "help");
+  // Before executing passes, print the final values of the LLVM options.
+  cl::PrintOptionValues();
 
-  // If user just wants to list available options, skip module loading
-  if (!SkipModule) {
-    M = parseIRFile(InputFilename, Err, Context);
-    mod = M.get();
-    if (mod == 0) {
-      Err.print(argv[0], errs());
-      return 1;
+#ifdef LLVM_ON_UNIX
+  if (!ServeSocket.empty())
+    return serve(argv[0], getTranslationOptions(argc, argv));
+#endif
+
+  // Each worker translates the next input in a context of its own, the
+  // targets and the built-in table are shared by all of them. An input which
+  // cannot be loaded does not stop the others. The messages about an input
+  // are collected and printed at once, so that the workers do not write to
+  // stderr at the same time.
+  unsigned NumWorkers = Jobs ? Jobs : std::thread::hardware_concurrency();
+  NumWorkers = std::max(1u, std::min<unsigned>(NumWorkers, Inputs.size()));
+  std::atomic<size_t> Next(0);
+  std::atomic<int> RetVal(0);
+  std::mutex ErrsMutex;
+  auto Work = [&]() {
+    std::string Log;
+    raw_string_ostream LogOS(Log);
+    LLVMContext Context;
+    Context.setDiagnosticHandler(std::make_unique<DiagnosticLog>(LogOS));
+    for (size_t i; (i = Next++) < Inputs.size();) {
+      // Compile the module TimeCompilations times to give better compile
+      // time metrics.
+      for (unsigned I = TimeCompilations; I; --I)
+        if (int R = compileModule(argv, Context, Inputs[i], LogOS)) {
+          RetVal = R;
+          break;
+        }
+      LogOS.flush();
+      std::lock_guard<std::mutex> Lock(ErrsMutex);
+      errs() << Log;
+      Log.clear();
     }
+  };
+  std::vector<std::thread> Workers;
+  for (unsigned i = 1; i < NumWorkers; ++i)
+    Workers.emplace_back(Work);
+  Work();
+  for (std::thread &W : Workers)
+    W.join();
+  return RetVal;
+}
 
-    // If we are supposed to override the target triple, do so now.
-    if (!TargetTriple.empty())
-      mod->setTargetTriple(Triple::normalize(TargetTriple));
-    TheTriple = Triple(mod->getTargetTriple());
-  } else {
-    TheTriple = Triple(Triple::normalize(TargetTriple));
-  }
-
-  if (TheTriple.getTriple().empty())
-    TheTriple.setTriple(sys::getDefaultTargetTriple());
-
-  // Get the target specific parser.
-  std::string Error;
-  // Override MArch
-  MArch = "cl";
-  const Target *TheTarget =
-      TargetRegistry::lookupTarget(MArch, TheTriple, Error);
-  if (!TheTarget) {
-    errs() << argv[0] << ": " << Error << "\n";
-    return 1;
-  }
-
-  // Package up features to be passed to target/subtarget
-  std::string FeaturesStr;
-  if (MAttrs.size()) {
-    SubtargetFeatures Features;
-    for (unsigned i = 0; i != MAttrs.size(); ++i)
-      Features.AddFeature(MAttrs[i]);
-    FeaturesStr = Features.getString();
+// loadModule - Read a module from Buffer. With LazyLoad only the functions
+// reachable from kernels are materialized.
+static std::unique_ptr<Module> loadModule(std::unique_ptr<MemoryBuffer> Buffer,
+                                          SMDiagnostic &Err,
+                                          LLVMContext &Context) {
+  std::string Name = Buffer->getBufferIdentifier().str();
+  if (!LazyLoad)
+    return parseIR(Buffer->getMemBufferRef(), Err, Context);
+
+  std::unique_ptr<Module> M = getLazyIRModule(std::move(Buffer), Err, Context);
+  if (!M)
+    return nullptr;
+  if (Error E = materializeKernelFunctions(*M)) {
+    Err = SMDiagnostic(Name, SourceMgr::DK_Error, toString(std::move(E)));
+    return nullptr;
   }
+  return M;
+}
 
-  CodeGenOpt::Level OLvl = CodeGenOpt::Default;
-
+// getOptLevel - The optimization level given with -O. Errors are printed to
+// Errs.
+static bool getOptLevel(const char *ProgName, raw_ostream &Errs,
+                        CodeGenOpt::Level &Level) {
   switch (OptLevel) {
   default:
-    errs() << argv[0] << ": invalid optimization level.\n";
-    return 1;
+    Errs << ProgName << ": invalid optimization level.\n";
+    return false;
   case ' ':
+    Level = CodeGenOpt::Default;
     break;
   case '0':
-    OLvl = CodeGenOpt::None;
+    Level = CodeGenOpt::None;
     break;
   case '1':
-    OLvl = CodeGenOpt::Less;
+    Level = CodeGenOpt::Less;
     break;
   case '2':
-    OLvl = CodeGenOpt::Default;
+    Level = CodeGenOpt::Default;
     break;
   case '3':
-    OLvl = CodeGenOpt::Aggressive;
+    Level = CodeGenOpt::Aggressive;
     break;
   }
+  return true;
+}
 
-  TargetOptions Options = InitTargetOptionsFromCodeGenFlags();
+// translateModule - Translate M to OpenCL C through the interface of the
+// backend, the same way as the programs embedding it. Errors are printed to
+// Errs, an input the backend cannot translate does not end the process.
+static bool translateModule(const char *ProgName, Module &M,
+                            StringRef ModuleTriple, std::string &Code,
+                            raw_ostream &Errs) {
+  llvm_opencl::Options Opts;
+  Opts.TargetTriple = ModuleTriple.str();
+  if (!getOptLevel(ProgName, Errs, Opts.OptLevel))
+    return false;
+
+  Expected<std::string> Result = llvm_opencl::translate(M, Opts);
+  if (!Result) {
+    Errs << ProgName << ": error: " << toString(Result.takeError()) << "\n";
+    return false;
+  }
+  Code = std::move(*Result);
+  return true;
+}
 
-  // Jackson Korba 9/30/14
-  // OwningPtr<targetMachine>
-  std::unique_ptr<TargetMachine> target(TheTarget->createTargetMachine(
-      TheTriple.getTriple(), MCPU, FeaturesStr, Options, getRelocModel(),
-      getCodeModel(), OLvl));
-  assert(target.get() && "Could not allocate target machine!");
-  assert(mod && "Should have exited after outputting help!");
-  TargetMachine &Target = *target.get();
-
-  // TODO: Find a replacement to this function
-  /* Greg Simpson 6-09-13
-  no member named setMCUseLoc
-  removed statement
-  Target.setMCUseLoc(false);  */
+static int compileModule(char **argv, LLVMContext &Context,
+                         const std::string &InputFilename, raw_ostream &Errs) {
+  // The backend only prints OpenCL C.
+  if (FileType != CGFT_AssemblyFile) {
+    Errs << argv[0] << ": target does not support generation of this"
+           << " file type!\n";
+    return 1;
+  }
+
+  // Load the module to be compiled...
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M;
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer =
+      MemoryBuffer::getFileOrSTDIN(InputFilename);
+  if (std::error_code EC = Buffer.getError())
+    Err = SMDiagnostic(InputFilename, SourceMgr::DK_Error,
+                       "Could not open input file: " + EC.message());
+  else
+    M = loadModule(std::move(*Buffer), Err, Context);
+  if (!M) {
+    Err.print(argv[0], Errs);
+    return 1;
+  }
+
+  std::string Code;
+  if (!translateModule(argv[0], *M, TargetTriple, Code, Errs))
+    return 1;
 
   // Jackson Korba 9/30/14
   std::unique_ptr<ToolOutputFile> Out(
-      GetOutputStream(TheTarget->getName(), TheTriple.getOS(), argv[0]));
+      GetOutputStream(argv[0], InputFilename, Errs));
   if (!Out)
     return 1;
+  Out->os() << Code;
 
-  // Build up all of the passes that we want to do to the module.
-  legacy::PassManager PM;
+  // Declare success.
+  Out->keep();
 
-  // Add an appropriate TargetLibraryInfo pass for the module's triple.
-  TargetLibraryInfoWrapperPass *TLI =
-      new TargetLibraryInfoWrapperPass(TheTriple);
-  PM.add(TLI);
+  return 0;
+}
+
+#ifdef LLVM_ON_UNIX
+// The translation server. A client connects to the socket, writes a request
+// and shuts down its side of the connection:
+//
+//   <options>\n<bitcode or textual IR>
+//
+// The only option is -mtriple=<triple>, the other options are those of the
+// server. The server answers with "ok\n" followed by the OpenCL C code, or
+// with "error\n" followed by the diagnostics, and closes the connection.
+//
+// Translations are cached by the SHA1 of the request and of the options of the
+// server which change the code, in memory and optionally in a directory shared
+// by servers.
+
+// TranslationCache - The translations served so far. At most MaxSize bytes
+// of them are kept in memory, the least recently used are dropped first.
+class TranslationCache {
+  struct Entry {
+    std::string Text;
+    std::list<std::string>::iterator Use;
+  };
+
+  std::mutex Mutex;
+  StringMap<Entry> Entries;
+  /// Uses - The keys of Entries, the most recently used first.
+  std::list<std::string> Uses;
+  size_t Size = 0;
+  size_t MaxSize;
+  std::string Dir;
+
+  std::string getPath(StringRef Key) const {
+    return (Twine(Dir) + "/" + Key + ".cl").str();
+  }
 
-  // Add intenal analysis passes from the target machine.
-  PM.add(createTargetTransformInfoWrapperPass(Target.getTargetIRAnalysis()));
+  void remember(StringRef Key, StringRef Text) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    if (Entries.count(Key) || Text.size() > MaxSize)
+      return;
+    while (Size + Text.size() > MaxSize) {
+      auto It = Entries.find(Uses.back());
+      Size -= It->second.Text.size();
+      Entries.erase(It);
+      Uses.pop_back();
+    }
+    Uses.push_front(Key.str());
+    Entries[Key] = Entry{Text.str(), Uses.begin()};
+    Size += Text.size();
+  }
 
-  if (RelaxAll) {
-    if (FileType != CGFT_ObjectFile)
-      errs() << argv[0]
-             << ": warning: ignoring -mc-relax-all because filetype != obj\n";
+public:
+  TranslationCache(StringRef Dir, size_t MaxSize)
+      : MaxSize(MaxSize), Dir(Dir.str()) {}
+
+  bool lookup(StringRef Key, std::string &Text) {
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      auto It = Entries.find(Key);
+      if (It != Entries.end()) {
+        Uses.splice(Uses.begin(), Uses, It->second.Use);
+        Text = It->second.Text;
+        return true;
+      }
+    }
+    if (Dir.empty())
+      return false;
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer =
+        MemoryBuffer::getFile(getPath(Key));
+    if (!Buffer)
+      return false;
+    Text = (*Buffer)->getBuffer().str();
+    remember(Key, Text);
+    return true;
   }
 
-  // Ask the target to add backend passes as necessary.
-  if (Target.addPassesToEmitFile(PM, Out->os(), nullptr,
-                                 FileType, NoVerify)) {
-    errs() << argv[0] << ": target does not support generation of this"
-           << " file type!\n";
-    return 1;
+  void insert(StringRef Key, StringRef Text) {
+    remember(Key, Text);
+    if (Dir.empty())
+      return;
+    // Write a temporary file first so that other servers never read a
+    // partial translation.
+    int FD;
+    SmallString<128> TmpPath;
+    if (sys::fs::createUniqueFile(Twine(Dir) + "/" + Key + "-%%%%%%.tmp", FD,
+                                  TmpPath))
+      return;
+    {
+      raw_fd_ostream OS(FD, /*shouldClose=*/true);
+      OS << Text;
+    }
+    if (sys::fs::rename(TmpPath, getPath(Key)))
+      sys::fs::remove(TmpPath);
+  }
+};
+
+// translateRequest - Translate the module of a request. On failure Output is
+// set to the diagnostics.
+static bool translateRequest(const char *ProgName, StringRef Options,
+                             StringRef Input, std::string &Output) {
+  raw_string_ostream Errs(Output);
+  SmallVector<StringRef, 4> Args;
+  Options.split(Args, ' ', -1, false);
+  std::string RequestTriple;
+  for (StringRef Arg : Args) {
+    if (!Arg.consume_front("-mtriple=")) {
+      Errs << ProgName << ": unknown request option '" << Arg << "'\n";
+      return false;
+    }
+    RequestTriple = Triple::normalize(Arg);
   }
 
-  // Before executing passes, print the final values of the LLVM options.
-  cl::PrintOptionValues();
+  // The warnings are only answered with the errors of a failed request.
+  LLVMContext Context;
+  Context.setDiagnosticHandler(std::make_unique<DiagnosticLog>(Errs));
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = loadModule(
+      MemoryBuffer::getMemBuffer(Input, "<request>", false), Err, Context);
+  if (!M) {
+    Err.print(ProgName, Errs);
+    return false;
+  }
 
-  PM.run(*mod);
+  std::string Code;
+  if (!translateModule(ProgName, *M,
+                       RequestTriple.empty() ? TargetTriple : RequestTriple,
+                       Code, Errs))
+    return false;
+  Errs.flush();
+  Output = std::move(Code);
+  return true;
+}
 
-  // Declare success.
-  Out->keep();
+static bool writeAll(int FD, StringRef Data) {
+  while (!Data.empty()) {
+    ssize_t N = ::write(FD, Data.data(), Data.size());
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return false;
+    Data = Data.drop_front(N);
+  }
+  return true;
+}
 
-  return 0;
+static void serveConnection(const char *ProgName, int FD,
+                            const std::string &ServerOptions,
+                            TranslationCache &Cache) {
+  std::string Request;
+  char Buffer[65536];
+  for (;;) {
+    ssize_t N = ::read(FD, Buffer, sizeof(Buffer));
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N < 0) {
+      ::close(FD);
+      return;
+    }
+    if (N == 0)
+      break;
+    Request.append(Buffer, N);
+  }
+
+  std::pair<StringRef, StringRef> Parts = StringRef(Request).split('\n');
+  std::string Key = toHex(SHA1::hash(
+      arrayRefFromStringRef(StringRef(ServerOptions + '\n' + Request))));
+  std::string Output;
+  bool Success = Cache.lookup(Key, Output);
+  if (!Success) {
+    Success = translateRequest(ProgName, Parts.first.trim(), Parts.second,
+                               Output);
+    if (Success)
+      Cache.insert(Key, Output);
+  }
+
+  if (writeAll(FD, Success ? "ok\n" : "error\n"))
+    writeAll(FD, Output);
+  ::close(FD);
+}
+
+// serve - Answer the requests made on the ServeSocket until the process is
+// killed. Each of the Jobs workers serves one connection at a time.
+static int serve(const char *ProgName, const std::string &ServerOptions) {
+  sockaddr_un Addr;
+  std::memset(&Addr, 0, sizeof(Addr));
+  Addr.sun_family = AF_UNIX;
+  if (ServeSocket.size() >= sizeof(Addr.sun_path)) {
+    errs() << ProgName << ": socket path is too long: " << ServeSocket
+           << "\n";
+    return 1;
+  }
+  std::strcpy(Addr.sun_path, ServeSocket.c_str());
+
+  if (!ServeCacheDir.empty())
+    if (std::error_code EC = sys::fs::create_directories(ServeCacheDir)) {
+      errs() << ProgName << ": " << ServeCacheDir << ": " << EC.message()
+             << "\n";
+      return 1;
+    }
+
+  // A socket left by a previous server is replaced, any other file is not.
+  sys::fs::file_status Status;
+  if (!sys::fs::status(ServeSocket, Status) && sys::fs::exists(Status)) {
+    if (Status.type() != sys::fs::file_type::socket_file) {
+      errs() << ProgName << ": " << ServeSocket << ": not a socket\n";
+      return 1;
+    }
+    sys::fs::remove(ServeSocket);
+  }
+
+  int Listen = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (Listen < 0 || ::bind(Listen, (sockaddr *)&Addr, sizeof(Addr)) < 0 ||
+      ::listen(Listen, SOMAXCONN) < 0) {
+    errs() << ProgName << ": " << ServeSocket << ": " << std::strerror(errno)
+           << "\n";
+    return 1;
+  }
+  // A client going away before it reads the answer must not kill the server.
+  ::signal(SIGPIPE, SIG_IGN);
+
+  TranslationCache Cache(ServeCacheDir, size_t(ServeCacheSize) << 20);
+  unsigned NumWorkers = Jobs ? Jobs : std::thread::hardware_concurrency();
+  auto Work = [&]() {
+    for (;;) {
+      int FD = ::accept(Listen, nullptr, nullptr);
+      if (FD >= 0)
+        serveConnection(ProgName, FD, ServerOptions, Cache);
+      else if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+               errno == ENOMEM)
+        // The connections being served release what is missing.
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      else if (errno != EINTR && errno != ECONNABORTED)
+        break;
+    }
+  };
+  std::vector<std::thread> Workers;
+  for (unsigned i = 1; i < NumWorkers; ++i)
+    Workers.emplace_back(Work);
+  Work();
+  for (std::thread &W : Workers)
+    W.join();
+
+  errs() << ProgName << ": " << ServeSocket << ": " << std::strerror(errno)
+         << "\n";
+  ::close(Listen);
+  return 1;
 }
+#endif
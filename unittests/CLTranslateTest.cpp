@@ -0,0 +1,114 @@
+//===- CLTranslateTest.cpp - Tests of the in-memory interface -------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "CLTranslate.h"
+#include "CLTranslateC.h"
+#include "llvm-c/Core.h"
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/SourceMgr.h"
+#include "gtest/gtest.h"
+
+#include <cstring>
+
+using namespace llvm;
+
+namespace {
+
+const char *ValidIR = R"(
+target datalayout = "e-p:32:32-i64:64-v16:16-v24:32-v32:32-v48:64-v96:128-v192:256-v256:256-v512:512-v1024:1024"
+target triple = "spir-unknown-unknown"
+
+define spir_kernel void @kernel_main(i32 addrspace(1)* %p) {
+  %v = load i32, i32 addrspace(1)* %p, align 4
+  %r = add i32 %v, 1
+  store i32 %r, i32 addrspace(1)* %p, align 4
+  ret void
+}
+)";
+
+// OpenCL C cannot index a vector by a variable.
+const char *UnsupportedIR = R"(
+target datalayout = "e-p:32:32-i64:64-v16:16-v24:32-v32:32-v48:64-v96:128-v192:256-v256:256-v512:512-v1024:1024"
+target triple = "spir-unknown-unknown"
+
+define spir_kernel void @kernel_main(<4 x i32> addrspace(1)* %p, i32 %i) {
+  %v = load <4 x i32>, <4 x i32> addrspace(1)* %p, align 16
+  %r = insertelement <4 x i32> %v, i32 0, i32 %i
+  store <4 x i32> %r, <4 x i32> addrspace(1)* %p, align 16
+  ret void
+}
+)";
+
+std::unique_ptr<Module> parse(const char *IR, LLVMContext &Context) {
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseAssemblyString(IR, Err, Context);
+  if (!M)
+    Err.print("CLTranslateTest", errs());
+  return M;
+}
+
+TEST(CLTranslate, TranslatesModule) {
+  LLVMContext Context;
+  std::unique_ptr<Module> M = parse(ValidIR, Context);
+  ASSERT_TRUE(M);
+  Expected<std::string> Code = llvm_opencl::translate(*M);
+  ASSERT_TRUE(bool(Code)) << toString(Code.takeError());
+  EXPECT_NE(Code->find("__kernel"), std::string::npos);
+  EXPECT_NE(Code->find("kernel_main"), std::string::npos);
+}
+
+TEST(CLTranslate, ReturnsBackendErrors) {
+  LLVMContext Context;
+  std::unique_ptr<Module> M = parse(UnsupportedIR, Context);
+  ASSERT_TRUE(M);
+  Expected<std::string> Code = llvm_opencl::translate(*M);
+  ASSERT_FALSE(bool(Code));
+  EXPECT_NE(toString(Code.takeError()).find("dynamic index"),
+            std::string::npos);
+
+  // The context goes on with its own handler.
+  std::unique_ptr<Module> Valid = parse(ValidIR, Context);
+  ASSERT_TRUE(Valid);
+  Expected<std::string> ValidCode = llvm_opencl::translate(*Valid);
+  EXPECT_TRUE(bool(ValidCode)) << toString(ValidCode.takeError());
+}
+
+TEST(CLTranslateC, TranslatesBuffer) {
+  char *Code = nullptr, *Message = nullptr;
+  ASSERT_FALSE(LLVMOpenCLTranslate(ValidIR, std::strlen(ValidIR), nullptr,
+                                   &Code, &Message))
+      << Message;
+  ASSERT_TRUE(Code);
+  EXPECT_TRUE(std::strstr(Code, "__kernel"));
+  LLVMDisposeMessage(Code);
+}
+
+TEST(CLTranslateC, ReturnsBackendErrors) {
+  char *Code = nullptr, *Message = nullptr;
+  ASSERT_TRUE(LLVMOpenCLTranslate(UnsupportedIR, std::strlen(UnsupportedIR),
+                                  nullptr, &Code, &Message));
+  EXPECT_FALSE(Code);
+  ASSERT_TRUE(Message);
+  EXPECT_TRUE(std::strstr(Message, "dynamic index"));
+  LLVMDisposeMessage(Message);
+}
+
+TEST(CLTranslateC, ReturnsParseErrors) {
+  const char *IR = "define void @f() {";
+  char *Code = nullptr, *Message = nullptr;
+  ASSERT_TRUE(
+      LLVMOpenCLTranslate(IR, std::strlen(IR), nullptr, &Code, &Message));
+  EXPECT_FALSE(Code);
+  ASSERT_TRUE(Message);
+  LLVMDisposeMessage(Message);
+}
+
+} // namespace